@@ -1,74 +1,131 @@
-#include <windows.h>
-#include <cstdio>
-#include <string>
-#include <vector>
-#include <queue>
-#include <mutex>
-#include <thread>
-#include <atomic>
-#include <condition_variable>
-#include <chrono>
-#include <iostream>
-#include <algorithm>
+#include "scanner_internal.h"
 
 //----------------------------------------------------------
-// Data structures and global settings
-//----------------------------------------------------------
-
-// Holds all scanning context shared across threads
-struct ScanContext
-{
-    std::wstring ROOT_DIR;
-    std::wstring PREFIX = L"";
-    size_t OUTPUT_BUFFER_FLUSH_COUNT = 5000; // Default buffer size in lines
-    std::string OUTPUT_FILE = "file_list.csv";
-    std::vector<std::wstring> file_types;
-
-    std::mutex q_m;
-    std::condition_variable q_cv;
-    std::queue<std::wstring> dir_queue;
-    std::atomic<int> active_dir_count{0};
-    std::atomic<bool> done{false};
-
-    std::mutex out_m;
-    FILE *out_fp = nullptr;
-
-    std::atomic<long long> file_count{0};
-};
-
-static const int NUM_THREADS = std::thread::hardware_concurrency();
-
-//----------------------------------------------------------
-// Function Declarations
+// Command-line interface
 //----------------------------------------------------------
 void print_help();
 bool parse_arguments(int argc, char *argv[], ScanContext &ctx);
-bool initialize_directory_queue(ScanContext &ctx);
-void flush_buffer(ScanContext &ctx, std::string &buffer);
-void process_directory(ScanContext &ctx, const std::wstring &dir, std::string &local_out_buf);
-void directory_processing_worker(ScanContext &ctx);
-
-//----------------------------------------------------------
-// Function Implementations
-//----------------------------------------------------------
+void print_estimate(const TreeEstimate &estimate, double seconds);
 
 void print_help()
 {
     std::cout << "Usage: file_scanner --path=<root_path> [--prefix=<folder_prefix>] "
-                 "[--buffer=<buffer_size_kb>] [--output=<output_file>] [--filetypes=<extensions>]\n\n"
+                 "[--buffer=<buffer_size_kb>] [--output-memory=<limit_mb>] [--output=<output_file>] "
+                 "[--filetypes=<extensions>] [--threads=<n> | --min-threads=<n> --max-threads=<n>] "
+                 "[--io-backend=find|async|simulated] [--sim-tree=<d,f,n>] [--sim-latency=<o,r,c>] [--sim-jitter=<s>] "
+                 "[--queue-depth=<n>] [--columns=<list>] [--inode-order] "
+                 "[--sorted [--sort-temp=<dir>]] [--traversal=bfs|dfs] [--max-pending=<n>] "
+                 "[--split-entries=<n>] [--history=<file>] [--shard=<i>/<n> [--shard-depth=1|2]] "
+                 "[--coordinator=<port> | --connect=<host>:<port>] "
+                 "[--checkpoint[=<seconds>]] [--resume] [--queries=<file>] [--limit=<n>] "
+                 "[--max-iops=<n>] [--max-dirs-per-sec=<n>] [--time-budget=<seconds>] "
+                 "[--estimate[=<probes>]] [--report=<file>] [--slowest-dirs=<n>] "
+                 "[--latency-interval=<seconds>] [--progress[=<seconds>]] [--metrics-file=<file>] "
+                 "[--trace=<file>]\n\n"
                  "Options:\n"
                  "  --path       Path to the root directory to scan (required).\n"
                  "  --prefix     Filter for top-level folders to include in the scan.\n"
                  "               Only folders starting with this prefix will be scanned.\n"
-                 "  --buffer     Output buffer size in KB (default: 5000 lines).\n"
+                 "  --buffer     Per-thread output block size in KB (default: 1024).\n"
+                 "  --output-memory\n"
+                 "               Upper bound in MB for output buffered across all threads (default: 256).\n"
+                 "               The per-thread block is reduced to fit if necessary, down to\n"
+                 "               4 KB; an adaptive --max-threads is lowered to keep that.\n"
+                 "               With --checkpoint, half of it holds rows of unfinished directories.\n"
                  "  --output     Name of the output file (default: file_list.csv).\n"
                  "  --filetypes  Comma-separated list of file extensions to include (e.g., doc,docx,pdf).\n"
                  "               If not provided, all files will be included.\n"
+                 "  --columns    Comma-separated metadata columns to write after the path:\n"
+                 "               size, mtime, attributes (e.g., size,mtime). Taken from the\n"
+                 "               directory listing itself, so no extra per-file calls are made.\n"
+                 "  --threads    Use exactly this many worker threads and disable adaptive tuning.\n"
+                 "  --min-threads, --max-threads\n"
+                 "               Bounds for the adaptive worker count (default: 1 to 16x hardware threads).\n"
+                 "               The scanner starts at the hardware thread count and grows or shrinks\n"
+                 "               the active workers based on enumeration throughput and latency.\n"
+                 "  --io-backend Directory enumeration method (default: find).\n"
+                 "               find:  one blocking FindFirstFileEx/FindNextFile listing per worker.\n"
+                 "               async: batch reads queued on an I/O completion port, keeping\n"
+                 "                      --queue-depth directories in flight from --threads threads\n"
+                 "                      (default: hardware threads).\n"
+                 "               simulated: a generated in-memory tree whose calls block for\n"
+                 "                      --sim-latency; --path only names its root.\n"
+                 "  --sim-tree   Simulated tree as depth,fanout,files (default: 4,8,20).\n"
+                 "  --sim-latency\n"
+                 "               Median simulated open,read,close latency in ms (default: 1,1,0.2).\n"
+                 "  --sim-jitter Spread of simulated latencies, the sigma of a lognormal factor\n"
+                 "               (default: 0.5; 0 = fixed latencies).\n"
+                 "  --queue-depth Directories in flight for the async backend (default: 256).\n"
+                 "  --inode-order\n"
+                 "               Read each directory completely, then queue subdirectories and write\n"
+                 "               files in NTFS file ID (MFT record) order. Reduces seeking on\n"
+                 "               rotational disks at the cost of holding one listing in memory.\n"
+                 "  --sorted     Write rows sorted by path so repeated scans produce identical files.\n"
+                 "               Workers sort and spill runs within --output-memory, then the runs\n"
+                 "               are merged. --buffer defaults to the full per-thread share here.\n"
+                 "  --sort-temp  Directory for sorted run files (default: next to the output file).\n"
+                 "  --traversal  bfs: one shared FIFO of directories (default).\n"
+                 "               dfs: each worker descends through its own LIFO first and only\n"
+                 "                    shares directories when other workers are idle.\n"
+                 "  --max-pending\n"
+                 "               Directories kept in memory awaiting a worker before further ones\n"
+                 "               are spilled to <output>.frontier.tmp (default: 0, no cap).\n"
+                 "  --split-entries\n"
+                 "               Entries into one directory listing after which idle workers take\n"
+                 "               over chunks of it (default: 16384, 0 = never split).\n"
+                 "  --history    Start top-level directories in descending order of the time their\n"
+                 "               subtrees took in the previous scan recorded in <file>, then record\n"
+                 "               this scan's times there. Only complete scans rewrite the file.\n"
+                 "  --shard      Scan only shard <i> of <n> (i counts from 0). Directories are\n"
+                 "               assigned by a hash of their path below --path, so <n> processes\n"
+                 "               with the same --path tree cover it exactly once between them.\n"
+                 "               Combine their outputs with scanner-merge.\n"
+                 "  --shard-depth\n"
+                 "               Hash top-level directories (1, default) or the ones below them (2),\n"
+                 "               for shares with only a few large top-level folders.\n"
+                 "  --coordinator\n"
+                 "               List --path and hand its top-level directories to worker processes\n"
+                 "               connecting on this TCP port, rebalancing as they run. Writes no output.\n"
+                 "  --connect    Work for the coordinator at <host>:<port>: scan the directories it\n"
+                 "               hands out below this process's --path into this process's --output.\n"
+                 "  --checkpoint Journal progress to <output>.checkpoint every <seconds> (default: 30)\n"
+                 "               so an interrupted scan can be resumed. Not available with --sorted.\n"
+                 "  --resume     Continue an interrupted scan from <output>.checkpoint, appending to\n"
+                 "               the existing output. Pass the same --path and --output as before.\n"
+                 "  --queries    Run the named queries in <file> in a single traversal. Each\n"
+                 "               [name] section sets its own prefix=, filetypes= and output=\n"
+                 "               (default: <name>.csv). Replaces --prefix, --filetypes and --output.\n"
+                 "  --limit      Stop once <n> matching files have been written, e.g. --limit=1 to\n"
+                 "               check whether any match exists. Queued directories are dropped.\n"
+                 "  --max-iops   Cap directory opens plus listing reads per second across all workers.\n"
+                 "  --max-dirs-per-sec\n"
+                 "               Cap directories started per second across all workers.\n"
+                 "  --time-budget\n"
+                 "               Stop after <seconds> and keep <output>.checkpoint so the scan can be\n"
+                 "               continued with --resume. Enables --checkpoint.\n"
+                 "  --estimate   Instead of scanning, follow <probes> random root-to-leaf paths\n"
+                 "               (default: 2000) and extrapolate total files, bytes and extension\n"
+                 "               mix with 95% confidence intervals. No output file is written.\n"
+                 "  --report     Write per-worker counters (directories, entries, bytes, time in\n"
+                 "               enumeration, queue and output locks, flushes, idle) as JSON.\n"
+                 "  --slowest-dirs\n"
+                 "               Number of slowest directories to list at the end (default: 5).\n"
+                 "  --latency-interval\n"
+                 "               Print open/read/close latency percentiles for the last <seconds>\n"
+                 "               to stderr while the scan runs.\n"
+                 "  --progress   Print directories, files, bytes, rates and threads to stderr every\n"
+                 "               <seconds> (default: 10).\n"
+                 "  --metrics-file\n"
+                 "               Rewrite <file> with the same progress in Prometheus text format every\n"
+                 "               interval, e.g. for the windows_exporter textfile collector.\n"
+                 "  --trace      Record per-thread spans (directories, opens, lock waits, flushes,\n"
+                 "               idle, handoffs) and write them as Chrome trace JSON at exit.\n"
                  "  --help       Display this help message.\n";
 }
 
 bool parse_arguments(int argc, char *argv[], ScanContext &ctx)
 {
+    bool buffer_given = false;
     for (int i = 1; i < argc; ++i)
     {
         std::string arg = argv[i];
@@ -82,7 +139,12 @@ bool parse_arguments(int argc, char *argv[], ScanContext &ctx)
         }
         else if (arg.find("--buffer=") == 0)
         {
-            ctx.OUTPUT_BUFFER_FLUSH_COUNT = std::stoul(arg.substr(9)) * 1000 / 256;
+            ctx.OUTPUT_BLOCK_BYTES = std::stoull(arg.substr(9)) * 1024;
+            buffer_given = true;
+        }
+        else if (arg.find("--output-memory=") == 0)
+        {
+            ctx.OUTPUT_MEMORY_LIMIT_BYTES = std::stoull(arg.substr(16)) << 20;
         }
         else if (arg.find("--output=") == 0)
         {
@@ -90,213 +152,350 @@ bool parse_arguments(int argc, char *argv[], ScanContext &ctx)
         }
         else if (arg.find("--filetypes=") == 0)
         {
-            std::wstring extensions = std::wstring(arg.begin() + 12, arg.end());
+            split_extensions(std::wstring(arg.begin() + 12, arg.end()), ctx.file_types);
+        }
+        else if (arg.find("--queries=") == 0)
+        {
+            ctx.QUERIES_FILE = arg.substr(10);
+        }
+        else if (arg.find("--columns=") == 0)
+        {
+            std::string list = arg.substr(10) + ",";
             size_t pos = 0;
-            while ((pos = extensions.find(L",")) != std::wstring::npos)
+            while ((pos = list.find(',')) != std::string::npos)
             {
-                ctx.file_types.push_back(extensions.substr(0, pos));
-                extensions.erase(0, pos + 1);
+                std::string name = list.substr(0, pos);
+                list.erase(0, pos + 1);
+                if (name == "size")
+                    ctx.columns.push_back(Column::Size);
+                else if (name == "mtime")
+                    ctx.columns.push_back(Column::Modified);
+                else if (name == "attributes")
+                    ctx.columns.push_back(Column::Attributes);
+                else if (!name.empty())
+                {
+                    std::cerr << "Error: unknown column '" << name << "'.\n\n";
+                    print_help();
+                    return false;
+                }
             }
-            ctx.file_types.push_back(extensions);
         }
-        else if (arg == "--help")
+        else if (arg.find("--threads=") == 0)
         {
-            print_help();
-            return false;
+            ctx.FIXED_THREADS = std::stoi(arg.substr(10));
         }
-    }
-
-    if (ctx.ROOT_DIR.empty())
-    {
-        std::cerr << "Error: --path is required.\n\n";
-        print_help();
-        return false;
-    }
-
-    return true;
-}
-
-// Initializes the directory queue with the top-level directories that match PREFIX
-bool initialize_directory_queue(ScanContext &ctx)
-{
-    WIN32_FIND_DATAW fdata;
-    std::wstring top_search = ctx.ROOT_DIR + L"\\*";
-    HANDLE hFind = FindFirstFileW(top_search.c_str(), &fdata);
-    if (hFind == INVALID_HANDLE_VALUE)
-    {
-        return false;
-    }
-
-    do
-    {
-        if ((fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+        else if (arg.find("--min-threads=") == 0)
         {
-            // Skip '.' and '..'
-            if (fdata.cFileName[0] == L'.' &&
-                (fdata.cFileName[1] == 0 || (fdata.cFileName[1] == L'.' && fdata.cFileName[2] == 0)))
-            {
-                continue;
-            }
-
-            if (ctx.PREFIX.empty() || _wcsnicmp(fdata.cFileName, ctx.PREFIX.c_str(), ctx.PREFIX.size()) == 0)
+            ctx.MIN_THREADS = std::stoi(arg.substr(14));
+        }
+        else if (arg.find("--max-threads=") == 0)
+        {
+            ctx.MAX_THREADS = std::stoi(arg.substr(14));
+        }
+        else if (arg.find("--io-backend=") == 0)
+        {
+            std::string backend = arg.substr(13);
+            ctx.ASYNC_IO = backend == "async";
+            ctx.SIMULATED_IO = backend == "simulated";
+            if (backend != "find" && backend != "async" && backend != "simulated")
             {
-                std::wstring subdir = ctx.ROOT_DIR + L"\\" + fdata.cFileName;
-                {
-                    std::lock_guard<std::mutex> lk(ctx.q_m);
-                    ctx.dir_queue.push(subdir);
-                    ctx.active_dir_count++;
-                }
+                std::cerr << "Error: unknown --io-backend '" << backend << "'.\n\n";
+                print_help();
+                return false;
             }
         }
-    } while (FindNextFileW(hFind, &fdata));
-    FindClose(hFind);
-
-    return (ctx.active_dir_count > 0);
-}
-
-// Flushes the local buffer to the output file safely
-void flush_buffer(ScanContext &ctx, std::string &buffer)
-{
-    std::lock_guard<std::mutex> lk_out(ctx.out_m);
-    fwrite(buffer.data(), 1, buffer.size(), ctx.out_fp);
-    buffer.clear();
-}
-
-// Processes a single directory: finds subdirectories (pushing them to queue)
-// and files (writing them to output if they match conditions)
-void process_directory(ScanContext &ctx, const std::wstring &dir, std::string &local_out_buf)
-{
-    WIN32_FIND_DATAW fdata;
-    std::wstring search_pattern = dir + L"\\*";
-    HANDLE hFind = FindFirstFileExW(search_pattern.c_str(), FindExInfoBasic, &fdata, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
-
-    if (hFind == INVALID_HANDLE_VALUE)
-    {
-        ctx.active_dir_count--;
-        return;
-    }
-
-    do
-    {
-        if ((fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+        else if (arg.find("--sim-tree=") == 0)
         {
-            // Skip '.' and '..'
-            if (fdata.cFileName[0] == L'.' &&
-                (fdata.cFileName[1] == 0 || (fdata.cFileName[1] == L'.' && fdata.cFileName[2] == 0)))
+            if (sscanf(arg.c_str() + 11, "%d,%d,%d", &ctx.SIM_DEPTH, &ctx.SIM_FANOUT, &ctx.SIM_FILES) != 3 ||
+                ctx.SIM_DEPTH < 1 || ctx.SIM_FANOUT < 1 || ctx.SIM_FILES < 0)
             {
-                continue;
+                std::cerr << "Error: --sim-tree takes depth,fanout,files.\n\n";
+                print_help();
+                return false;
             }
-
-            std::wstring subdir = dir + L"\\" + fdata.cFileName;
-            // Check prefix if specified
-            if (!ctx.PREFIX.empty() && subdir.find(ctx.PREFIX) == std::wstring::npos)
+        }
+        else if (arg.find("--shard=") == 0)
+        {
+            if (sscanf(arg.c_str() + 8, "%d/%d", &ctx.SHARD_INDEX, &ctx.SHARD_COUNT) != 2 || ctx.SHARD_COUNT < 1 ||
+                ctx.SHARD_INDEX < 0 || ctx.SHARD_INDEX >= ctx.SHARD_COUNT)
             {
-                continue;
+                std::cerr << "Error: --shard takes <i>/<n> with 0 <= i < n.\n\n";
+                print_help();
+                return false;
             }
-
+        }
+        else if (arg.find("--coordinator=") == 0)
+        {
+            ctx.COORDINATOR_PORT = std::stoi(arg.substr(14));
+            if (ctx.COORDINATOR_PORT < 1 || ctx.COORDINATOR_PORT > 65535)
             {
-                std::lock_guard<std::mutex> lk(ctx.q_m);
-                ctx.dir_queue.push(subdir);
-                ctx.active_dir_count++;
+                std::cerr << "Error: --coordinator takes a TCP port.\n\n";
+                print_help();
+                return false;
             }
-            ctx.q_cv.notify_one();
         }
-        else
+        else if (arg.find("--connect=") == 0)
         {
-            std::wstring full_path = dir + L"\\" + fdata.cFileName;
-
-            // File extension filtering
-            if (!ctx.file_types.empty())
+            ctx.CONNECT_ADDRESS = arg.substr(10);
+        }
+        else if (arg.find("--shard-depth=") == 0)
+        {
+            ctx.SHARD_DEPTH = std::stoi(arg.substr(14));
+            if (ctx.SHARD_DEPTH != 1 && ctx.SHARD_DEPTH != 2)
             {
-                std::wstring file_ext = full_path.substr(full_path.find_last_of(L".") + 1);
-                bool match = false;
-                for (const auto &ext : ctx.file_types)
-                {
-                    if (_wcsicmp(file_ext.c_str(), ext.c_str()) == 0)
-                    {
-                        match = true;
-                        break;
-                    }
-                }
-                if (!match)
-                    continue;
+                std::cerr << "Error: --shard-depth must be 1 or 2.\n\n";
+                print_help();
+                return false;
             }
-
-            // Convert to UTF-8 and add to output buffer
-            int slen = (int)full_path.size();
-            int utf8_len = WideCharToMultiByte(CP_UTF8, 0, full_path.c_str(), slen, NULL, 0, NULL, NULL);
-
-            if (utf8_len > 0)
+        }
+        else if (arg.find("--sim-latency=") == 0)
+        {
+            if (sscanf(arg.c_str() + 14, "%lf,%lf,%lf", &ctx.SIM_OPEN_MS, &ctx.SIM_READ_MS, &ctx.SIM_CLOSE_MS) != 3 ||
+                ctx.SIM_OPEN_MS < 0 || ctx.SIM_READ_MS < 0 || ctx.SIM_CLOSE_MS < 0)
             {
-                std::string utf8_path(utf8_len, '\0');
-                WideCharToMultiByte(CP_UTF8, 0, full_path.c_str(), slen, utf8_path.data(), utf8_len, NULL, NULL);
-
-                // Add to the output buffer with a newline
-                local_out_buf += utf8_path + "\n";
-
-                ctx.file_count.fetch_add(1, std::memory_order_relaxed);
-
-                // Flush if buffer is large enough
-                if (local_out_buf.size() >= ctx.OUTPUT_BUFFER_FLUSH_COUNT * 256)
-                {
-                    flush_buffer(ctx, local_out_buf);
-                }
+                std::cerr << "Error: --sim-latency takes open,read,close in milliseconds.\n\n";
+                print_help();
+                return false;
             }
-            else
+        }
+        else if (arg.find("--sim-jitter=") == 0)
+        {
+            ctx.SIM_JITTER = std::stod(arg.substr(13));
+        }
+        else if (arg.find("--queue-depth=") == 0)
+        {
+            ctx.QUEUE_DEPTH = std::stoi(arg.substr(14));
+        }
+        else if (arg == "--inode-order")
+        {
+            ctx.INODE_ORDER = true;
+        }
+        else if (arg == "--sorted")
+        {
+            ctx.SORTED = true;
+        }
+        else if (arg.find("--sort-temp=") == 0)
+        {
+            ctx.SORT_TEMP_DIR = arg.substr(12);
+        }
+        else if (arg.find("--traversal=") == 0)
+        {
+            std::string traversal = arg.substr(12);
+            if (traversal == "dfs")
+                ctx.DEPTH_FIRST = true;
+            else if (traversal != "bfs")
             {
-                // Log the error or handle the file path gracefully
-                std::cerr << "Error converting file path to UTF-8: " << GetLastError() << "\n";
+                std::cerr << "Error: unknown --traversal '" << traversal << "'.\n\n";
+                print_help();
+                return false;
             }
         }
-    } while (FindNextFileW(hFind, &fdata));
-    FindClose(hFind);
+        else if (arg.find("--max-pending=") == 0)
+        {
+            ctx.MAX_PENDING = std::stoll(arg.substr(14));
+        }
+        else if (arg.find("--split-entries=") == 0)
+        {
+            ctx.SPLIT_ENTRIES = std::stoll(arg.substr(16));
+        }
+        else if (arg.find("--history=") == 0)
+        {
+            ctx.HISTORY_FILE = arg.substr(10);
+        }
+        else if (arg == "--checkpoint")
+        {
+            ctx.CHECKPOINT_SECONDS = 30;
+        }
+        else if (arg.find("--checkpoint=") == 0)
+        {
+            ctx.CHECKPOINT_SECONDS = std::stoi(arg.substr(13));
+        }
+        else if (arg == "--resume")
+        {
+            ctx.RESUME = true;
+        }
+        else if (arg.find("--limit=") == 0)
+        {
+            ctx.LIMIT = std::stoll(arg.substr(8));
+        }
+        else if (arg.find("--max-iops=") == 0)
+        {
+            ctx.MAX_IOPS = std::stod(arg.substr(11));
+        }
+        else if (arg.find("--max-dirs-per-sec=") == 0)
+        {
+            ctx.MAX_DIRS_PER_SEC = std::stod(arg.substr(19));
+        }
+        else if (arg.find("--time-budget=") == 0)
+        {
+            ctx.TIME_BUDGET_SECONDS = std::stod(arg.substr(14));
+        }
+        else if (arg.find("--report=") == 0)
+        {
+            ctx.REPORT_FILE = arg.substr(9);
+        }
+        else if (arg.find("--slowest-dirs=") == 0)
+        {
+            ctx.SLOWEST_DIRS = std::stoi(arg.substr(15));
+        }
+        else if (arg.find("--latency-interval=") == 0)
+        {
+            ctx.LATENCY_INTERVAL_SECONDS = std::stod(arg.substr(19));
+        }
+        else if (arg == "--progress")
+        {
+            ctx.PROGRESS_STDERR = true;
+        }
+        else if (arg.find("--progress=") == 0)
+        {
+            ctx.PROGRESS_STDERR = true;
+            ctx.PROGRESS_SECONDS = std::stod(arg.substr(11));
+        }
+        else if (arg.find("--metrics-file=") == 0)
+        {
+            ctx.METRICS_FILE = arg.substr(15);
+        }
+        else if (arg.find("--trace=") == 0)
+        {
+            ctx.TRACE_FILE = arg.substr(8);
+        }
+        else if (arg == "--estimate")
+        {
+            ctx.ESTIMATE_PROBES = 2000;
+        }
+        else if (arg.find("--estimate=") == 0)
+        {
+            ctx.ESTIMATE_PROBES = std::stoll(arg.substr(11));
+        }
+        else if (arg == "--help")
+        {
+            print_help();
+            return false;
+        }
+    }
 
-    ctx.active_dir_count--;
-}
+    if (ctx.ROOT_DIR.empty())
+    {
+        std::cerr << "Error: --path is required.\n\n";
+        print_help();
+        return false;
+    }
 
-// The main worker thread function that continuously processes directories from the queue
-void directory_processing_worker(ScanContext &ctx)
-{
-    std::string local_out_buf;
-    local_out_buf.reserve(256 * ctx.OUTPUT_BUFFER_FLUSH_COUNT);
+    if (ctx.OUTPUT_BLOCK_BYTES == 0 || ctx.OUTPUT_MEMORY_LIMIT_BYTES == 0)
+    {
+        std::cerr << "Error: --buffer and --output-memory must be greater than zero.\n\n";
+        print_help();
+        return false;
+    }
 
-    for (;;)
+    if ((ctx.RESUME || ctx.TIME_BUDGET_SECONDS > 0) && ctx.CHECKPOINT_SECONDS <= 0)
     {
-        std::wstring current_dir;
-        {
-            std::unique_lock<std::mutex> lk(ctx.q_m);
-            ctx.q_cv.wait(lk, [&]
-                          { return !ctx.dir_queue.empty() || ctx.done.load(); });
+        ctx.CHECKPOINT_SECONDS = 30;
+    }
+    if ((ctx.PROGRESS_STDERR || !ctx.METRICS_FILE.empty()) && ctx.PROGRESS_SECONDS <= 0)
+    {
+        ctx.PROGRESS_SECONDS = 10;
+    }
+    if (ctx.SORTED && ctx.CHECKPOINT_SECONDS > 0)
+    {
+        std::cerr << "Error: --checkpoint, --resume and --time-budget cannot be combined with --sorted.\n\n";
+        print_help();
+        return false;
+    }
 
-            if (ctx.done.load() && ctx.dir_queue.empty())
-            {
-                // No more directories to process
-                break;
-            }
+    if (ctx.LIMIT > 0 && ctx.CHECKPOINT_SECONDS > 0)
+    {
+        std::cerr << "Error: --limit cannot be combined with --checkpoint, --resume or --time-budget.\n\n";
+        print_help();
+        return false;
+    }
 
-            if (!ctx.dir_queue.empty())
-            {
-                current_dir = ctx.dir_queue.front();
-                ctx.dir_queue.pop();
-            }
-        }
+    bool distributed = ctx.COORDINATOR_PORT > 0 || !ctx.CONNECT_ADDRESS.empty();
+    if (distributed && (ctx.COORDINATOR_PORT > 0) == !ctx.CONNECT_ADDRESS.empty())
+    {
+        std::cerr << "Error: a process is either the --coordinator or connects to one.\n\n";
+        print_help();
+        return false;
+    }
+    if (distributed && (ctx.CHECKPOINT_SECONDS > 0 || ctx.LIMIT > 0 || ctx.SHARD_COUNT > 1 || !ctx.HISTORY_FILE.empty() ||
+                        !ctx.QUERIES_FILE.empty()))
+    {
+        std::cerr << "Error: --coordinator and --connect cannot be combined with --checkpoint, --resume, "
+                     "--time-budget, --limit, --shard, --history or --queries.\n\n";
+        print_help();
+        return false;
+    }
 
-        if (!current_dir.empty())
+    if (!ctx.QUERIES_FILE.empty())
+    {
+        if (ctx.SORTED || ctx.CHECKPOINT_SECONDS > 0)
         {
-            process_directory(ctx, current_dir, local_out_buf);
+            std::cerr << "Error: --queries cannot be combined with --sorted, --checkpoint, --resume or --time-budget.\n\n";
+            print_help();
+            return false;
         }
+        if (!ctx.PREFIX.empty() || !ctx.file_types.empty())
+        {
+            std::cerr << "Error: with --queries, set prefix and filetypes per query in the file.\n\n";
+            print_help();
+            return false;
+        }
+        if (!load_queries(ctx))
+            return false;
+        compile_query_matcher(ctx);
+    }
+
+    if (ctx.SORTED && !buffer_given)
+    {
+        // Larger runs mean fewer merge passes; size_output_buffers cuts this to the per-thread share
+        ctx.OUTPUT_BLOCK_BYTES = ctx.OUTPUT_MEMORY_LIMIT_BYTES;
     }
 
-    // Flush remaining buffer
-    if (!local_out_buf.empty())
+    if (!normalize_thread_settings(ctx))
     {
-        flush_buffer(ctx, local_out_buf);
+        print_help();
+        return false;
     }
+
+    return true;
 }
 
 //----------------------------------------------------------
 // Main
 //----------------------------------------------------------
+// Prints an --estimate result, with the ten extensions holding the most bytes
+void print_estimate(const TreeEstimate &estimate, double seconds)
+{
+    auto line = [](const char *label, const EstimateStat &s)
+    {
+        std::cout << label << (long long)std::llround(s.mean) << " +/- " << (long long)std::llround(s.ci95);
+        if (s.mean > 0)
+            std::cout << " (" << (int)std::lround(100.0 * s.ci95 / s.mean) << "%)";
+        std::cout << "\n";
+    };
+    std::cout << "Estimated from " << estimate.probes << " random probes (" << estimate.directories_listed
+              << " directories listed) in " << seconds << " seconds, 95% confidence intervals:\n";
+    line("  Files:       ", estimate.files);
+    line("  Bytes:       ", estimate.bytes);
+    line("  Directories: ", estimate.directories);
+
+    std::cout << "Extension mix by bytes:\n";
+    size_t shown = std::min<size_t>(estimate.extensions.size(), 10);
+    for (size_t i = 0; i < shown; i++)
+    {
+        const auto &e = estimate.extensions[i];
+        std::string name = e.name.empty() ? "(none)" : to_utf8(e.name);
+        double share = estimate.bytes.mean > 0 ? 100.0 * e.bytes.mean / estimate.bytes.mean : 0.0;
+        std::cout << "  " << name << ": " << (long long)std::llround(e.files.mean) << " +/- "
+                  << (long long)std::llround(e.files.ci95) << " files, " << (long long)std::llround(e.bytes.mean)
+                  << " +/- " << (long long)std::llround(e.bytes.ci95) << " bytes (" << std::lround(share) << "%)\n";
+    }
+    if (estimate.extensions.size() > shown)
+        std::cout << "  ... " << estimate.extensions.size() - shown << " more\n";
+    std::cout << "Estimates follow random paths, so trees with a few huge subtrees need more probes "
+                 "for a tight interval.\n";
+}
+
 int main(int argc, char *argv[])
 {
     ScanContext ctx;
@@ -308,54 +507,120 @@ int main(int argc, char *argv[])
 
     auto start_time = std::chrono::steady_clock::now();
 
-    ctx.out_fp = fopen(ctx.OUTPUT_FILE.c_str(), "wb");
-    if (!ctx.out_fp)
+    if (ctx.ESTIMATE_PROBES > 0)
     {
-        std::cerr << "Failed to open output file.\n";
-        return 1;
+        TreeEstimate estimate = estimate_tree(ctx);
+        print_estimate(estimate, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+        return 0;
     }
 
-    // Write BOM for UTF-8
-    const unsigned char bom[] = {0xEF, 0xBB, 0xBF};
-    fwrite(bom, sizeof(bom), 1, ctx.out_fp);
-
-    // Write CSV header
-    const char *header = "File Path\n";
-    fwrite(header, 1, strlen(header), ctx.out_fp);
+    if (ctx.COORDINATOR_PORT > 0)
+    {
+        return run_coordinator(ctx) ? 0 : 1;
+    }
 
-    // Initialize the directory queue
-    if (!initialize_directory_queue(ctx))
+    if (ctx.RESUME)
     {
-        fclose(ctx.out_fp);
-        std::cout << "No matching directories found.\n";
-        return 0;
+        // Reopens the output at the last checkpoint and queues the pending frontier
+        if (!load_checkpoint(ctx))
+            return 1;
     }
+    else if (!ctx.queries.empty())
+    {
+        if (!open_query_outputs(ctx))
+            return 1;
+        if (!initialize_directory_queue(ctx))
+        {
+            for (auto &q : ctx.queries)
+                fclose(q->fp);
+            std::cout << "No matching directories found.\n";
+            return 0;
+        }
+    }
+    else
+    {
+        ctx.out_fp = fopen(ctx.OUTPUT_FILE.c_str(), "wb");
+        if (!ctx.out_fp)
+        {
+            std::cerr << "Failed to open output file.\n";
+            return 1;
+        }
+
+        // Write BOM for UTF-8
+        const unsigned char bom[] = {0xEF, 0xBB, 0xBF};
+        fwrite(bom, sizeof(bom), 1, ctx.out_fp);
+
+        // Write CSV header
+        std::string header = csv_header(ctx);
+        fwrite(header.data(), 1, header.size(), ctx.out_fp);
+
+        // Initialize the directory queue, or let the coordinator fill it
+        if (!ctx.CONNECT_ADDRESS.empty())
+        {
+            if (!connect_to_coordinator(ctx))
+            {
+                fclose(ctx.out_fp);
+                return 1;
+            }
+        }
+        else if (!initialize_directory_queue(ctx))
+        {
+            fclose(ctx.out_fp);
+            std::cout << "No matching directories found.\n";
+            return 0;
+        }
+
+        if (ctx.CHECKPOINT_SECONDS > 0 && !open_checkpoint(ctx))
+        {
+            std::cerr << "Failed to create checkpoint file " << checkpoint_path(ctx) << ".\n";
+            return 1;
+        }
+    }
+
+    run_workers(ctx);
+    if (ctx.cluster)
+        finish_cluster_worker(ctx);
 
-    // Launch worker threads
-    std::vector<std::thread> threads;
-    threads.reserve(NUM_THREADS);
-    for (int i = 0; i < NUM_THREADS; i++)
+    if (ctx.budget_expired && ctx.journal_fp)
     {
-        threads.emplace_back(directory_processing_worker, std::ref(ctx));
+        // Every worker has flushed, so this records all finished directories;
+        // abandoned and still-queued ones stay pending for --resume
+        write_checkpoint(ctx);
     }
 
-    // Wait until all directories are processed
-    for (;;)
+    // A partial or resumed scan would record too little work under some subtrees
+    bool history_saved = false;
+    if (!ctx.HISTORY_FILE.empty() && !ctx.RESUME && !ctx.cancel_token.cancelled())
     {
-        std::unique_lock<std::mutex> lk(ctx.q_m);
-        if (ctx.active_dir_count.load() == 0 && ctx.dir_queue.empty())
-            break;
-        ctx.q_cv.wait_for(lk, std::chrono::milliseconds(50));
+        history_saved = save_history(ctx);
+        if (!history_saved)
+            std::cerr << "Failed to write history " << ctx.HISTORY_FILE << ".\n";
     }
 
-    // Signal threads to finish
-    ctx.done.store(true);
-    ctx.q_cv.notify_all();
+    size_t sorted_runs = ctx.run_files.size();
+    bool sort_ok = true;
+    if (ctx.SORTED)
+    {
+        sort_ok = merge_sorted_runs(ctx);
+        if (!sort_ok)
+        {
+            std::cerr << "Sorted merge failed; " << ctx.OUTPUT_FILE << " is incomplete.\n";
+        }
+    }
 
-    for (auto &t : threads)
-        t.join();
+    if (ctx.out_fp)
+        fclose(ctx.out_fp);
+    for (auto &q : ctx.queries)
+        fclose(q->fp);
 
-    fclose(ctx.out_fp);
+    bool journal_removed = false;
+    if (ctx.journal_fp)
+    {
+        fclose(ctx.journal_fp);
+        // Unless the time budget cut it short, the scan completed and there is nothing to resume
+        if (!ctx.budget_expired)
+            journal_removed = remove(checkpoint_path(ctx).c_str()) == 0;
+    }
 
     auto end_time = std::chrono::steady_clock::now();
     double elapsed_seconds = std::chrono::duration<double>(end_time - start_time).count();
@@ -363,10 +628,133 @@ int main(int argc, char *argv[])
 
     std::cout << "File list export completed in " << elapsed_seconds << " seconds\n";
     std::cout << "Processed " << final_count << " files\n";
+    if (ctx.limit_reached)
+    {
+        std::cout << "Stopped early: reached --limit=" << ctx.LIMIT << "\n";
+    }
+    if (ctx.budget_expired)
+    {
+        std::cout << "Stopped early: --time-budget of " << ctx.TIME_BUDGET_SECONDS << " seconds used up; continue with "
+                  << "--resume (" << checkpoint_path(ctx) << ")\n";
+    }
+    if (ctx.MAX_IOPS > 0 || ctx.MAX_DIRS_PER_SEC > 0)
+    {
+        std::cout << "Rate limiting: workers waited " << ctx.throttle_ns.load() / 1e9 << " thread-seconds for tokens ("
+                  << ctx.open_count.load() << " directory opens)\n";
+    }
     if (elapsed_seconds > 0)
     {
         std::cout << "Average processing speed: " << (double)final_count / elapsed_seconds << " files/second\n";
     }
+    std::cout << "Worker threads: " << ctx.active_thread_limit.load() << " active at finish, peak "
+              << ctx.peak_thread_limit << " (bounds " << ctx.MIN_THREADS << "-" << ctx.MAX_THREADS << ")\n";
+    int output_blocks = ctx.started_threads * (int)std::max<size_t>(ctx.queries.size(), 1);
+    size_t output_block = ctx.output_block_bytes.load();
+    std::cout << "Output buffers: " << output_blocks << " x " << output_block << " bytes = "
+              << (unsigned long long)output_blocks * output_block << " bytes in flight (limit "
+              << ctx.OUTPUT_MEMORY_LIMIT_BYTES << " bytes";
+    if (output_block < ctx.OUTPUT_BLOCK_BYTES)
+    {
+        std::cout << ", block reduced from " << ctx.OUTPUT_BLOCK_BYTES;
+    }
+    std::cout << ")\n";
+    std::cout << "Pending directories: peak " << ctx.peak_pending << " in memory";
+    if (ctx.spill_total > 0)
+    {
+        std::cout << ", " << ctx.spill_total << " spilled to disk";
+    }
+    std::cout << "\n";
+    if (ctx.split_directories > 0)
+    {
+        std::cout << "Split directories: " << ctx.split_directories.load() << ", " << ctx.chunks_shared.load()
+                  << " chunks of " << SPLIT_CHUNK_ENTRIES << " entries handled by other workers\n";
+    }
+    if (ctx.cluster)
+    {
+        std::cout << "Coordinator: " << ctx.cluster->received.load() << " directories received, "
+                  << ctx.cluster->returned << " given back";
+        if (ctx.cluster->lost)
+            std::cout << "; the connection was lost, so the scan may be incomplete";
+        std::cout << "\n";
+    }
+    if (ctx.SHARD_COUNT > 1)
+    {
+        std::cout << "Shard: " << ctx.SHARD_INDEX << " of " << ctx.SHARD_COUNT << ", by "
+                  << (ctx.SHARD_DEPTH == 1 ? "top-level" : "second-level") << " directories\n";
+    }
+    if (!ctx.HISTORY_FILE.empty())
+    {
+        std::cout << "History: " << ctx.history_known << " top-level directories ordered by recorded cost";
+        if (history_saved)
+            std::cout << ", " << subtree_costs(ctx).size() << " subtree costs saved";
+        std::cout << "\n";
+    }
+    if (ctx.CHECKPOINT_SECONDS > 0)
+    {
+        std::cout << "Checkpoints: " << ctx.checkpoint_count << " written, ";
+        if (ctx.staged_spill_count > 0)
+            std::cout << ctx.staged_spill_count.load() << " large directories staged through temp files, ";
+        std::cout << "journal ";
+        if (journal_removed)
+            std::cout << "removed on completion\n";
+        else if (ctx.budget_expired)
+            std::cout << "kept for --resume (" << checkpoint_path(ctx) << ")\n";
+        else
+            std::cout << "could not be removed (" << checkpoint_path(ctx) << ")\n";
+    }
+    for (auto &q : ctx.queries)
+    {
+        std::cout << "Query " << q->name << ": " << q->file_count.load() << " files, "
+                  << q->bytes_written.load() << " bytes written to " << q->output_file << "\n";
+    }
+    WorkerCounters totals = total_worker_counters(ctx);
+    if (totals.wall_ns > 0)
+    {
+        auto share = [&](long long ns)
+        { return std::lround(100.0 * ns / totals.wall_ns); };
+        std::cout << "Worker time: " << share(totals.enumerate_ns) << "% enumeration, " << share(totals.queue_wait_ns)
+                  << "% queue lock, " << share(totals.flush_ns) << "% output (" << share(totals.output_wait_ns)
+                  << "% lock), " << share(totals.idle_ns) << "% idle\n";
+    }
+    for (int k = 0; k < LATENCY_KIND_COUNT; k++)
+    {
+        std::cout << "Latency " << LATENCY_KIND_NAMES[k] << ": " << format_latency(collect_latency(ctx, (LatencyKind)k)) << "\n";
+    }
+    std::vector<SlowDirectory> slowest = slowest_directories(ctx);
+    if (!slowest.empty())
+    {
+        std::cout << "Slowest directories:\n";
+        for (const auto &s : slowest)
+        {
+            std::cout << "  " << format_ns(s.total_ns) << " (open " << format_ns(s.open_ns) << ", slowest read "
+                      << format_ns(s.slowest_read_ns) << ", " << s.reads << " reads, " << s.entries << " entries) "
+                      << to_utf8(s.dir) << "\n";
+        }
+    }
+    if (ctx.SORTED)
+    {
+        std::cout << "Sorted output: merged " << sorted_runs << " runs\n";
+    }
+    else if (ctx.queries.empty())
+    {
+        std::cout << "Output written: " << ctx.output_bytes_written.load() << " bytes in "
+                  << ctx.output_flush_count.load() << " flushes\n";
+    }
+
+    if (!ctx.TRACE_FILE.empty())
+    {
+        if (write_trace(ctx, ctx.TRACE_FILE))
+            std::cout << "Trace written to " << ctx.TRACE_FILE << "\n";
+        else
+            std::cerr << "Failed to write trace " << ctx.TRACE_FILE << ".\n";
+    }
+    if (!ctx.REPORT_FILE.empty())
+    {
+        if (write_run_report(ctx, ctx.REPORT_FILE, elapsed_seconds))
+            std::cout << "Report written to " << ctx.REPORT_FILE << "\n";
+        else
+            std::cerr << "Failed to write report " << ctx.REPORT_FILE << ".\n";
+    }
 
-    return 0;
+    return sort_ok && !(ctx.cluster && ctx.cluster->lost) ? 0 : 1;
 }
@@ -0,0 +1,382 @@
+#include <windows.h>
+#include <psapi.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+//----------------------------------------------------------
+// Benchmark driver
+//
+// Runs landrys-file-scanner over one tree for every combination of thread
+// count and output mode, --repeat times each, and appends one CSV row per
+// run: files/second, peak working set and CPU time of the scanner process.
+// With --cold, the file cache is emptied before every run where the
+// account holds the privileges for it.
+//----------------------------------------------------------
+
+struct BenchSpec
+{
+    std::wstring SCANNER = L"landrys-file-scanner.exe";
+    std::wstring ROOT_DIR;
+    std::vector<std::wstring> threads = {L"auto"};
+    std::vector<std::wstring> modes = {L"paths"};
+    int REPEAT = 3;
+    bool COLD = false;
+    std::string CSV_FILE = "benchmark.csv";
+    std::string LABEL;        // Free text for the CSV, e.g. the build under test
+    std::wstring EXTRA_ARGS;  // Passed to every run as is
+};
+
+struct RunResult
+{
+    bool started = false;
+    DWORD exit_code = 0;
+    long long files = -1;
+    double seconds = 0.0;
+    unsigned long long peak_working_set = 0;
+    double user_seconds = 0.0;
+    double kernel_seconds = 0.0;
+};
+
+void print_help();
+bool parse_arguments(int argc, char *argv[], BenchSpec &spec);
+std::vector<std::wstring> split_list(const std::wstring &list);
+const wchar_t *mode_arguments(const std::wstring &mode);
+bool purge_file_cache();
+RunResult run_scanner(const std::wstring &command_line);
+std::string narrow(const std::wstring &text);
+
+// Scanner options for each --modes name
+static const struct
+{
+    const wchar_t *name;
+    const wchar_t *args;
+} BENCH_MODES[] = {
+    {L"paths", L""},
+    {L"columns", L"--columns=size,mtime,attributes"},
+    {L"sorted", L"--sorted"},
+    {L"async", L"--io-backend=async"},
+    {L"dfs", L"--traversal=dfs"},
+    {L"inode", L"--inode-order"},
+};
+
+void print_help()
+{
+    std::cout << "Usage: scanner-benchmark --path=<root_path> [--scanner=<exe>] [--threads=<list>] "
+                 "[--modes=<list>] [--repeat=<n>] [--cold] [--csv=<file>] [--label=<text>] "
+                 "[--args=<scanner options>]\n\n"
+                 "Options:\n"
+                 "  --path       Tree to scan, e.g. one made with tree-generator (required).\n"
+                 "  --scanner    Scanner executable (default: landrys-file-scanner.exe).\n"
+                 "  --threads    Comma-separated --threads values; auto leaves the adaptive\n"
+                 "               controller on (default: auto).\n"
+                 "  --modes      Comma-separated output modes (default: paths):\n"
+                 "               paths, columns, sorted, async, dfs, inode.\n"
+                 "  --repeat     Runs per combination (default: 3).\n"
+                 "  --cold       Empty the system file cache and standby list before each run.\n"
+                 "               Needs an elevated prompt; otherwise runs are warm and marked so.\n"
+                 "  --csv        File the results are appended to (default: benchmark.csv).\n"
+                 "  --label      Text stored in every row, e.g. the version being qualified.\n"
+                 "  --args       Extra options passed to every scanner run.\n"
+                 "  --help       Display this help message.\n";
+}
+
+bool parse_arguments(int argc, char *argv[], BenchSpec &spec)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.find("--path=") == 0)
+        {
+            spec.ROOT_DIR = std::wstring(arg.begin() + 7, arg.end());
+        }
+        else if (arg.find("--scanner=") == 0)
+        {
+            spec.SCANNER = std::wstring(arg.begin() + 10, arg.end());
+        }
+        else if (arg.find("--threads=") == 0)
+        {
+            spec.threads = split_list(std::wstring(arg.begin() + 10, arg.end()));
+        }
+        else if (arg.find("--modes=") == 0)
+        {
+            spec.modes = split_list(std::wstring(arg.begin() + 8, arg.end()));
+        }
+        else if (arg.find("--repeat=") == 0)
+        {
+            spec.REPEAT = std::stoi(arg.substr(9));
+        }
+        else if (arg == "--cold")
+        {
+            spec.COLD = true;
+        }
+        else if (arg.find("--csv=") == 0)
+        {
+            spec.CSV_FILE = arg.substr(6);
+        }
+        else if (arg.find("--label=") == 0)
+        {
+            spec.LABEL = arg.substr(8);
+        }
+        else if (arg.find("--args=") == 0)
+        {
+            spec.EXTRA_ARGS = std::wstring(arg.begin() + 7, arg.end());
+        }
+        else if (arg == "--help")
+        {
+            print_help();
+            return false;
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << arg << "\n\n";
+            print_help();
+            return false;
+        }
+    }
+
+    if (spec.ROOT_DIR.empty())
+    {
+        std::cerr << "Error: --path is required.\n\n";
+        print_help();
+        return false;
+    }
+    for (const auto &mode : spec.modes)
+    {
+        if (!mode_arguments(mode))
+        {
+            std::cerr << "Error: unknown mode " << narrow(mode) << ".\n\n";
+            print_help();
+            return false;
+        }
+    }
+    if (spec.REPEAT < 1 || spec.threads.empty() || spec.modes.empty())
+    {
+        std::cerr << "Error: nothing to run.\n\n";
+        print_help();
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::wstring> split_list(const std::wstring &list)
+{
+    std::vector<std::wstring> out;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t comma = list.find(L',', start);
+        if (comma == std::wstring::npos)
+            comma = list.size();
+        if (comma > start)
+            out.push_back(list.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return out;
+}
+
+const wchar_t *mode_arguments(const std::wstring &mode)
+{
+    for (const auto &m : BENCH_MODES)
+    {
+        if (mode == m.name)
+            return m.args;
+    }
+    return nullptr;
+}
+
+std::string narrow(const std::wstring &text)
+{
+    std::string out;
+    int len = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0, NULL, NULL);
+    if (len > 0)
+    {
+        out.resize(len);
+        WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &out[0], len, NULL, NULL);
+    }
+    return out;
+}
+
+// Windows counterpart of Linux drop_caches: shrink the system file cache
+// working set, write back modified pages, then purge the standby list.
+// Needs SeIncreaseQuotaPrivilege and SeProfileSingleProcessPrivilege, which
+// only elevated administrators hold.
+bool purge_file_cache()
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return false;
+    bool privileged = true;
+    for (const wchar_t *name : {L"SeIncreaseQuotaPrivilege", L"SeProfileSingleProcessPrivilege"})
+    {
+        TOKEN_PRIVILEGES tp = {};
+        tp.PrivilegeCount = 1;
+        tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        // AdjustTokenPrivileges succeeds without the privilege but sets ERROR_NOT_ALL_ASSIGNED
+        if (!LookupPrivilegeValueW(NULL, name, &tp.Privileges[0].Luid) ||
+            !AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) || GetLastError() != ERROR_SUCCESS)
+        {
+            privileged = false;
+        }
+    }
+    CloseHandle(token);
+    if (!privileged)
+        return false;
+
+    if (!SetSystemFileCacheSize((SIZE_T)-1, (SIZE_T)-1, 0))
+        return false;
+
+    typedef LONG(NTAPI * NtSetSystemInformationFn)(INT, PVOID, ULONG);
+    NtSetSystemInformationFn set_information = reinterpret_cast<NtSetSystemInformationFn>(
+        reinterpret_cast<void *>(GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtSetSystemInformation")));
+    if (!set_information)
+        return false;
+    const INT SystemMemoryListInformation = 80;
+    INT command = 3; // MemoryFlushModifiedList
+    if (set_information(SystemMemoryListInformation, &command, sizeof(command)) < 0)
+        return false;
+    command = 4; // MemoryPurgeStandbyList
+    return set_information(SystemMemoryListInformation, &command, sizeof(command)) >= 0;
+}
+
+// Runs one scan with its output captured, and reads the process's CPU time
+// and peak working set before its handle is closed
+RunResult run_scanner(const std::wstring &command_line)
+{
+    RunResult r;
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, TRUE};
+    HANDLE read_pipe, write_pipe;
+    if (!CreatePipe(&read_pipe, &write_pipe, &sa, 0))
+        return r;
+    SetHandleInformation(read_pipe, HANDLE_FLAG_INHERIT, 0);
+
+    STARTUPINFOW si = {};
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = write_pipe;
+    si.hStdError = write_pipe;
+    PROCESS_INFORMATION pi = {};
+    std::wstring command = command_line; // CreateProcessW may write to it
+
+    auto start_time = std::chrono::steady_clock::now();
+    BOOL created = CreateProcessW(NULL, &command[0], NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+    CloseHandle(write_pipe);
+    if (!created)
+    {
+        CloseHandle(read_pipe);
+        return r;
+    }
+    r.started = true;
+
+    std::string output;
+    char buffer[4096];
+    DWORD n;
+    while (ReadFile(read_pipe, buffer, sizeof(buffer), &n, NULL) && n > 0)
+        output.append(buffer, n);
+    CloseHandle(read_pipe);
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    GetExitCodeProcess(pi.hProcess, &r.exit_code);
+    FILETIME created_at, exited_at, kernel, user;
+    if (GetProcessTimes(pi.hProcess, &created_at, &exited_at, &kernel, &user))
+    {
+        // FILETIME counts 100 ns units
+        r.kernel_seconds = (((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+        r.user_seconds = (((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime) / 1e7;
+    }
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (K32GetProcessMemoryInfo(pi.hProcess, &pmc, sizeof(pmc)))
+        r.peak_working_set = pmc.PeakWorkingSetSize;
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+
+    size_t pos = output.find("Processed ");
+    if (pos != std::string::npos)
+        r.files = std::stoll(output.substr(pos + 10));
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSpec spec;
+    if (!parse_arguments(argc, argv, spec))
+    {
+        return 1;
+    }
+
+    FILE *csv = fopen(spec.CSV_FILE.c_str(), "ab");
+    if (!csv)
+    {
+        std::cerr << "Failed to open " << spec.CSV_FILE << ".\n";
+        return 1;
+    }
+    if (ftell(csv) == 0)
+    {
+        fputs("label,mode,threads,run,cold,exit_code,files,seconds,files_per_second,peak_working_set_bytes,"
+              "user_cpu_seconds,kernel_cpu_seconds\n",
+              csv);
+    }
+
+    wchar_t temp_dir[MAX_PATH];
+    DWORD temp_len = GetTempPathW(MAX_PATH, temp_dir);
+    std::wstring output_file = std::wstring(temp_dir, temp_len) + L"scanner-benchmark-output.csv";
+
+    bool cold_warned = false;
+    int failed_runs = 0;
+    for (const auto &mode : spec.modes)
+    {
+        for (const auto &threads : spec.threads)
+        {
+            for (int run = 1; run <= spec.REPEAT; run++)
+            {
+                std::wstring command = L"\"" + spec.SCANNER + L"\" \"--path=" + spec.ROOT_DIR + L"\" \"--output=" +
+                                       output_file + L"\"";
+                if (threads != L"auto")
+                    command += L" --threads=" + threads;
+                std::wstring mode_args = mode_arguments(mode);
+                if (!mode_args.empty())
+                    command += L" " + mode_args;
+                if (!spec.EXTRA_ARGS.empty())
+                    command += L" " + spec.EXTRA_ARGS;
+
+                bool cold = false;
+                if (spec.COLD)
+                {
+                    cold = purge_file_cache();
+                    if (!cold && !cold_warned)
+                    {
+                        std::cerr << "Cannot empty the file cache (run elevated); runs are recorded as warm.\n";
+                        cold_warned = true;
+                    }
+                }
+
+                RunResult r = run_scanner(command);
+                DeleteFileW(output_file.c_str());
+                if (!r.started || r.exit_code != 0 || r.files < 0)
+                    failed_runs++;
+
+                double rate = r.seconds > 0 && r.files > 0 ? r.files / r.seconds : 0.0;
+                fprintf(csv, "%s,%s,%s,%d,%d,%lu,%lld,%.3f,%.1f,%llu,%.3f,%.3f\n", spec.LABEL.c_str(),
+                        narrow(mode).c_str(), narrow(threads).c_str(), run, cold ? 1 : 0, (unsigned long)r.exit_code,
+                        r.files, r.seconds, rate, r.peak_working_set, r.user_seconds, r.kernel_seconds);
+                fflush(csv);
+                std::cout << narrow(mode) << " threads=" << narrow(threads) << " run " << run << ": "
+                          << (r.started ? "" : "failed to start, ") << r.files << " files in " << r.seconds
+                          << " s (" << (long long)rate << " files/s), peak " << (r.peak_working_set >> 20)
+                          << " MB, cpu " << r.user_seconds + r.kernel_seconds << " s" << (cold ? ", cold" : "") << "\n";
+            }
+        }
+    }
+    fclose(csv);
+
+    if (failed_runs > 0)
+    {
+        std::cerr << failed_runs << " runs failed.\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "scanner_coro.h"
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+
+//----------------------------------------------------------
+// AsyncScanner lifetime test
+//
+// Scans an in-memory tree through a DirectoryBackend and consumes it from a
+// coroutine driven by a single-threaded event loop. The coroutine owns its
+// AsyncScanner and destroys it right after the last co_await, once after the
+// scan finished and once after cancelling it midway; both must return
+// without hanging or terminating. Build with -std=c++20 and link scanner.cpp
+// built as C++17. Exits with 0 on success.
+//----------------------------------------------------------
+
+static const int TEST_DIRS = 8;
+static const int TEST_FILES_PER_DIR = 500;
+static const uint32_t TEST_ATTRIBUTE_DIRECTORY = 0x10; // FILE_ATTRIBUTE_DIRECTORY
+static const uint32_t TEST_ATTRIBUTE_ARCHIVE = 0x20;   // FILE_ATTRIBUTE_ARCHIVE
+
+// Root L"T" holds TEST_DIRS directories, each with TEST_FILES_PER_DIR files
+struct MemoryBackend : DirectoryBackend
+{
+    struct Listing
+    {
+        std::vector<std::wstring> names;
+        bool directories = false;
+        bool read = false;
+    };
+
+    void *open_directory(const std::wstring &dir) override
+    {
+        Listing *l = new Listing();
+        l->directories = dir == L"T";
+        int count = l->directories ? TEST_DIRS : TEST_FILES_PER_DIR;
+        for (int i = 0; i < count; i++)
+            l->names.push_back((l->directories ? L"d" : L"f") + std::to_wstring(i));
+        return l;
+    }
+
+    bool read_batch(void *listing, std::vector<DirEntry> &batch) override
+    {
+        Listing *l = static_cast<Listing *>(listing);
+        batch.clear();
+        if (l->read)
+            return false;
+        l->read = true;
+        for (const auto &name : l->names)
+        {
+            DirEntry e = {};
+            e.name = name.c_str();
+            e.name_len = name.size();
+            e.attributes = l->directories ? TEST_ATTRIBUTE_DIRECTORY : TEST_ATTRIBUTE_ARCHIVE;
+            e.size = 1;
+            batch.push_back(e);
+        }
+        return false;
+    }
+
+    void close_directory(void *listing) override { delete static_cast<Listing *>(listing); }
+
+    bool stat(const std::wstring &path, DirEntry &out) override
+    {
+        out = {};
+        out.attributes = path.find(L"\\f") == std::wstring::npos ? TEST_ATTRIBUTE_DIRECTORY : TEST_ATTRIBUTE_ARCHIVE;
+        return true;
+    }
+};
+
+// Runs posted coroutine handles on the thread that calls run()
+struct EventLoop
+{
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::coroutine_handle<>> ready;
+    bool stopped = false;
+
+    void post(std::coroutine_handle<> h)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            ready.push_back(h);
+        }
+        cv.notify_one();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stopped = true;
+        }
+        cv.notify_one();
+    }
+
+    void run()
+    {
+        for (;;)
+        {
+            std::coroutine_handle<> h;
+            {
+                std::unique_lock<std::mutex> lk(m);
+                cv.wait(lk, [&]
+                        { return !ready.empty() || stopped; });
+                if (ready.empty())
+                    return;
+                h = ready.front();
+                ready.pop_front();
+            }
+            h.resume();
+        }
+    }
+};
+
+// Fire-and-forget coroutine; the frame frees itself when it returns
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+};
+
+struct TestResult
+{
+    long long files = 0;
+    bool destroyed = false;
+};
+
+Task consume(std::unique_ptr<AsyncScanner> scan, EventLoop &loop, TestResult &result, bool cancel_early)
+{
+    ScanBatch batch;
+    while (co_await scan->next(batch))
+    {
+        result.files += (long long)batch.entries.size();
+        if (cancel_early)
+            scan->cancel();
+    }
+    // The last co_await has returned false; the scanner goes away here, on the loop thread
+    scan.reset();
+    result.destroyed = true;
+    loop.stop();
+}
+
+bool run_case(const char *name, bool cancel_early)
+{
+    ScanOptions options;
+    options.root = L"T";
+    options.backend = std::make_shared<MemoryBackend>();
+    options.threads = 4;
+    options.batch_entries = 64;
+    options.max_queued_batches = 2;
+
+    EventLoop loop;
+    TestResult result;
+    consume(std::make_unique<AsyncScanner>(options, [&loop](std::coroutine_handle<> h)
+                                           { loop.post(h); }),
+            loop, result, cancel_early);
+    loop.run();
+
+    long long expected = (long long)TEST_DIRS * TEST_FILES_PER_DIR;
+    bool ok = result.destroyed && (cancel_early ? result.files <= expected : result.files == expected);
+    printf("%s: %lld files, scanner %s: %s\n", name, result.files, result.destroyed ? "destroyed" : "alive",
+           ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main()
+{
+    bool ok = run_case("finished", false);
+    ok = run_case("cancelled", true) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,294 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <queue>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+//----------------------------------------------------------
+// Shard output merger
+//
+// Combines the CSV files written by landrys-file-scanner --shard=i/N (or any
+// scans with the same columns) into one file with a single BOM and header.
+// Rows are k-way merged by path the same way --sorted orders its runs, so
+// shards scanned with --sorted merge into one sorted file; unsorted inputs
+// are interleaved, still with every row exactly once.
+//----------------------------------------------------------
+
+struct MergeSpec
+{
+    std::string OUTPUT_FILE;
+    std::vector<std::string> inputs;
+};
+
+// One input file, positioned on its next row
+struct MergeInput
+{
+    FILE *fp = nullptr;
+    std::string name;
+    std::string line; // Current row, with its newline
+    size_t key_len = 0;
+    long long rows = 0;
+};
+
+void print_help();
+bool parse_arguments(int argc, char *argv[], MergeSpec &spec);
+bool read_line(FILE *fp, std::string &line);
+size_t path_key_length(const std::string &line, bool path_only);
+bool next_row(MergeInput &in, bool path_only);
+int compare_path_keys(const char *a, size_t a_len, const char *b, size_t b_len);
+int compare_rows(const MergeInput &a, const MergeInput &b);
+
+static const char UTF8_BOM[] = "\xEF\xBB\xBF";
+
+void print_help()
+{
+    std::cout << "Usage: scanner-merge --output=<file> <input.csv> [<input.csv> ...]\n\n"
+                 "Options:\n"
+                 "  --output     Merged CSV file to write (required).\n"
+                 "  --help       Display this help message.\n\n"
+                 "Every input must have the same header, i.e. come from scans with the same\n"
+                 "--columns. Inputs written with --sorted give a sorted result.\n";
+}
+
+bool parse_arguments(int argc, char *argv[], MergeSpec &spec)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.find("--output=") == 0)
+        {
+            spec.OUTPUT_FILE = arg.substr(9);
+        }
+        else if (arg == "--help")
+        {
+            print_help();
+            return false;
+        }
+        else if (arg.find("--") == 0)
+        {
+            std::cerr << "Unknown argument: " << arg << "\n\n";
+            print_help();
+            return false;
+        }
+        else
+        {
+            spec.inputs.push_back(arg);
+        }
+    }
+
+    if (spec.OUTPUT_FILE.empty() || spec.inputs.empty())
+    {
+        std::cerr << "Error: --output and at least one input file are required.\n\n";
+        print_help();
+        return false;
+    }
+    if (std::find(spec.inputs.begin(), spec.inputs.end(), spec.OUTPUT_FILE) != spec.inputs.end())
+    {
+        std::cerr << "Error: --output must not be one of the inputs.\n\n";
+        return false;
+    }
+    return true;
+}
+
+// Reads one line including its '\n'; a last line without one gets it added
+bool read_line(FILE *fp, std::string &line)
+{
+    line.clear();
+    char buf[64 * 1024];
+    while (fgets(buf, sizeof(buf), fp))
+    {
+        line += buf;
+        if (line.back() == '\n')
+            return true;
+    }
+    if (line.empty())
+        return false;
+    line += '\n';
+    return true;
+}
+
+// Length of the path field, matching the key --sorted frames: the whole row
+// in path-only output (written unquoted), else the first CSV field with its
+// quotes, which compare_path_keys looks through
+size_t path_key_length(const std::string &line, bool path_only)
+{
+    size_t end = line.size() - 1;
+    if (end > 0 && line[end - 1] == '\r')
+        end--;
+    if (path_only)
+        return end;
+    if (line[0] != '"')
+        return std::min(line.find(','), end);
+    for (size_t i = 1; i < end; i++)
+    {
+        if (line[i] != '"')
+            continue;
+        if (i + 1 < end && line[i + 1] == '"')
+            i++; // Escaped quote
+        else
+            return i + 1;
+    }
+    return end;
+}
+
+bool next_row(MergeInput &in, bool path_only)
+{
+    if (!read_line(in.fp, in.line))
+        return false;
+    in.key_len = path_key_length(in.line, path_only);
+    in.rows++;
+    return true;
+}
+
+// Orders two path fields by the paths they hold, undoing CSV quoting, the
+// same way compare_path_keys in the scanner does
+int compare_path_keys(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    bool a_quoted = a_len >= 2 && a[0] == '"';
+    bool b_quoted = b_len >= 2 && b[0] == '"';
+    if (!a_quoted && !b_quoted)
+    {
+        int c = memcmp(a, b, std::min(a_len, b_len));
+        if (c != 0)
+            return c;
+        return a_len == b_len ? 0 : (a_len < b_len ? -1 : 1);
+    }
+
+    // Skip the enclosing quotes; inside them a doubled quote stands for one
+    const char *pa = a + a_quoted, *a_end = a + a_len - a_quoted;
+    const char *pb = b + b_quoted, *b_end = b + b_len - b_quoted;
+    for (;;)
+    {
+        if (pa == a_end || pb == b_end)
+            return (pa == a_end) == (pb == b_end) ? 0 : (pa == a_end ? -1 : 1);
+        unsigned char ca = (unsigned char)*pa++, cb = (unsigned char)*pb++;
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+        if (ca == '"')
+        {
+            pa++;
+            pb++;
+        }
+    }
+}
+
+// Orders rows by path field, then by the whole row, like compare_records in the scanner
+int compare_rows(const MergeInput &a, const MergeInput &b)
+{
+    int c = compare_path_keys(a.line.data(), a.key_len, b.line.data(), b.key_len);
+    if (c != 0)
+        return c;
+    return a.line.compare(b.line);
+}
+
+int main(int argc, char *argv[])
+{
+    MergeSpec spec;
+    if (!parse_arguments(argc, argv, spec))
+    {
+        return 1;
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Open every input and check that the headers agree
+    std::vector<MergeInput> inputs(spec.inputs.size());
+    std::string header;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        MergeInput &in = inputs[i];
+        in.name = spec.inputs[i];
+        in.fp = fopen(in.name.c_str(), "rb");
+        std::string first;
+        if (!in.fp || !read_line(in.fp, first))
+        {
+            std::cerr << "Failed to read " << in.name << ".\n";
+            return 1;
+        }
+        setvbuf(in.fp, NULL, _IOFBF, 256 * 1024);
+        if (first.compare(0, 3, UTF8_BOM) == 0)
+            first.erase(0, 3);
+        if (i == 0)
+        {
+            header = first;
+        }
+        else if (first != header)
+        {
+            std::cerr << "Error: " << in.name << " has different columns than " << inputs[0].name << ".\n";
+            return 1;
+        }
+    }
+    bool path_only = header == "File Path\n" || header == "File Path\r\n";
+
+    FILE *out = fopen(spec.OUTPUT_FILE.c_str(), "wb");
+    if (!out)
+    {
+        std::cerr << "Failed to open output file " << spec.OUTPUT_FILE << ".\n";
+        return 1;
+    }
+    fwrite(UTF8_BOM, 1, 3, out);
+    fwrite(header.data(), 1, header.size(), out);
+
+    auto greater = [&inputs](size_t a, size_t b)
+    { return compare_rows(inputs[a], inputs[b]) > 0; };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (next_row(inputs[i], path_only))
+            heap.push(i);
+    }
+
+    // A path written by two inputs means the shards overlapped; only
+    // detectable when the inputs are sorted, since duplicates are then adjacent
+    std::string out_buf;
+    out_buf.reserve(1 << 20);
+    std::string last_key;
+    long long rows = 0;
+    long long duplicates = 0;
+    while (!heap.empty())
+    {
+        size_t i = heap.top();
+        heap.pop();
+        MergeInput &in = inputs[i];
+        if (rows > 0 && last_key.size() == in.key_len && memcmp(last_key.data(), in.line.data(), in.key_len) == 0)
+            duplicates++;
+        last_key.assign(in.line, 0, in.key_len);
+        out_buf += in.line;
+        rows++;
+        if (out_buf.size() >= (1 << 20))
+        {
+            fwrite(out_buf.data(), 1, out_buf.size(), out);
+            out_buf.clear();
+        }
+        if (next_row(in, path_only))
+            heap.push(i);
+    }
+    fwrite(out_buf.data(), 1, out_buf.size(), out);
+
+    bool ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    for (auto &in : inputs)
+    {
+        ok = !ferror(in.fp) && ok;
+        fclose(in.fp);
+    }
+    if (!ok)
+    {
+        std::cerr << "Failed to write " << spec.OUTPUT_FILE << ".\n";
+        return 1;
+    }
+
+    double elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    for (const auto &in : inputs)
+        std::cout << in.name << ": " << in.rows << " rows\n";
+    std::cout << "Merged " << rows << " rows into " << spec.OUTPUT_FILE << " in " << elapsed_seconds << " seconds\n";
+    if (duplicates > 0)
+    {
+        std::cerr << "Warning: " << duplicates << " paths appear in more than one row; were the shards "
+                     "scanned with the same --path and --shard-depth?\n";
+    }
+    return 0;
+}
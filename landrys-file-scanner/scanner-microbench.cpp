@@ -0,0 +1,454 @@
+#include "scanner_internal.h"
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+
+//----------------------------------------------------------
+// Microbenchmarks for the per-entry kernels
+//
+// Each kernel that process_entry runs for every directory entry is timed on
+// its own, over a fixed set of synthetic names, and reported in ns/op and
+// heap allocations/op. Allocations are counted by replacing the global
+// operator new, so they include those made inside scanner.cpp.
+//----------------------------------------------------------
+
+static std::atomic<long long> g_allocations{0};
+
+void *operator new(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        abort();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+struct BenchSettings
+{
+    std::string FILTER;      // Only kernels whose name contains this
+    double MIN_SECONDS = 0.2; // Each timed run lasts at least this long
+    int REPEAT = 3;           // Timed runs per kernel; the fastest is reported
+    int THREADS = HARDWARE_THREADS; // Threads for the queue kernels
+};
+
+// Inputs shared by all kernels, built once from a fixed seed
+struct BenchData
+{
+    std::wstring dir = L"C:\\Data\\Projects\\2024\\Quarterly Reports";
+    std::vector<std::wstring> names;
+    std::vector<DirEntry> entries;
+    std::vector<std::wstring> paths;      // dir + '\' + name
+    std::vector<std::wstring> ascii_paths; // The subset without non-ASCII characters
+    std::vector<std::string> utf8_paths;
+    ScanContext ctx;         // --filetypes and --prefix set
+    ScanContext query_ctx;   // Eight queries compiled
+    ScanContext columns_ctx; // --columns=size,mtime,attributes
+    ScanContext sorted_ctx;  // As columns_ctx, plus --sorted framing
+    int threads = 1;
+};
+
+typedef long long (*BenchFn)(BenchData &d, long long iterations);
+
+struct Microbench
+{
+    const char *name;
+    const char *description;
+    BenchFn fn;
+};
+
+void print_help();
+bool parse_arguments(int argc, char *argv[], BenchSettings &settings);
+void build_bench_data(BenchData &d);
+void run_microbench(const Microbench &b, BenchData &d, const BenchSettings &settings);
+long long bench_extension(BenchData &d, long long iterations);
+long long bench_queries(BenchData &d, long long iterations);
+long long bench_prefix(BenchData &d, long long iterations);
+long long bench_query_prefix(BenchData &d, long long iterations);
+long long bench_join_path(BenchData &d, long long iterations);
+long long bench_utf8_ascii(BenchData &d, long long iterations);
+long long bench_utf8_mixed(BenchData &d, long long iterations);
+long long bench_record_path(BenchData &d, long long iterations);
+long long bench_record_columns(BenchData &d, long long iterations);
+long long bench_record_sorted(BenchData &d, long long iterations);
+long long bench_queue(ScanContext &ctx, int threads, long long iterations);
+long long bench_queue_bfs(BenchData &d, long long iterations);
+long long bench_queue_dfs(BenchData &d, long long iterations);
+
+static const Microbench MICROBENCHES[] = {
+    {"extension", "--filetypes test, 5 types", bench_extension},
+    {"queries", "match_queries, 8 queries", bench_queries},
+    {"prefix", "--prefix substring test on a path", bench_prefix},
+    {"query_prefix", "directory_query_mask, 8 query prefixes", bench_query_prefix},
+    {"join_path", "dir + '\\' + name into a reused string", bench_join_path},
+    {"utf8_ascii", "UTF-16 to UTF-8, ASCII paths", bench_utf8_ascii},
+    {"utf8_mixed", "UTF-16 to UTF-8, 20% non-ASCII paths", bench_utf8_mixed},
+    {"record_path", "format_record, path only", bench_record_path},
+    {"record_columns", "format_record, size,mtime,attributes", bench_record_columns},
+    {"record_sorted", "format_record, columns plus sort frame", bench_record_sorted},
+    {"queue_bfs", "push_directory + try_next_directory, shared queue", bench_queue_bfs},
+    {"queue_dfs", "push_directory + try_next_directory, --traversal=dfs", bench_queue_dfs},
+};
+
+// Keeps results observable so the compiler cannot drop the work
+static volatile size_t g_sink;
+
+void print_help()
+{
+    std::cout << "Usage: scanner-microbench [--filter=<text>] [--min-time=<seconds>] [--repeat=<n>] [--threads=<n>]\n\n"
+                 "Options:\n"
+                 "  --filter     Run only kernels whose name contains this text.\n"
+                 "  --min-time   Minimum length of each timed run in seconds (default: 0.2).\n"
+                 "  --repeat     Timed runs per kernel; the fastest is reported (default: 3).\n"
+                 "  --threads    Threads contending in the queue kernels (default: hardware threads).\n"
+                 "  --help       Display this help message.\n\n"
+                 "Kernels:\n";
+    for (const auto &b : MICROBENCHES)
+        std::cout << "  " << std::left << std::setw(16) << b.name << b.description << "\n";
+}
+
+bool parse_arguments(int argc, char *argv[], BenchSettings &settings)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.find("--filter=") == 0)
+        {
+            settings.FILTER = arg.substr(9);
+        }
+        else if (arg.find("--min-time=") == 0)
+        {
+            settings.MIN_SECONDS = std::stod(arg.substr(11));
+        }
+        else if (arg.find("--repeat=") == 0)
+        {
+            settings.REPEAT = std::stoi(arg.substr(9));
+        }
+        else if (arg.find("--threads=") == 0)
+        {
+            settings.THREADS = std::stoi(arg.substr(10));
+        }
+        else if (arg == "--help")
+        {
+            print_help();
+            return false;
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << arg << "\n\n";
+            print_help();
+            return false;
+        }
+    }
+    if (settings.MIN_SECONDS <= 0 || settings.REPEAT < 1 || settings.THREADS < 1)
+    {
+        std::cerr << "Error: --min-time, --repeat and --threads must be positive.\n\n";
+        print_help();
+        return false;
+    }
+    return true;
+}
+
+// 4096 names of 8-32 characters with a spread of extensions; one in five
+// has non-ASCII characters
+void build_bench_data(BenchData &d)
+{
+    static const wchar_t *EXTENSIONS[] = {L"txt", L"docx", L"pdf", L"jpg", L"png", L"log", L"xlsx", L"dll", L"cpp", L""};
+    static const wchar_t UNICODE_CHARS[] = L"àéöñçαβγабв中文件あいう";
+    std::mt19937_64 rng(1);
+    std::uniform_int_distribution<int> length(8, 32);
+    std::uniform_int_distribution<int> letter(0, 25);
+    std::uniform_int_distribution<size_t> unicode(0, wcslen(UNICODE_CHARS) - 1);
+    std::uniform_int_distribution<size_t> ext(0, sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]) - 1);
+
+    for (int i = 0; i < 4096; i++)
+    {
+        bool is_unicode = i % 5 == 0;
+        std::wstring name;
+        int len = length(rng);
+        for (int c = 0; c < len; c++)
+            name += is_unicode && c % 3 == 0 ? UNICODE_CHARS[unicode(rng)] : (wchar_t)(L'a' + letter(rng));
+        const wchar_t *e = EXTENSIONS[ext(rng)];
+        if (*e)
+            name += std::wstring(L".") + e;
+        d.names.push_back(name);
+
+        d.paths.push_back(d.dir + L"\\" + name);
+        if (!is_unicode)
+            d.ascii_paths.push_back(d.paths.back());
+        d.utf8_paths.push_back(to_utf8(d.paths.back()));
+    }
+    for (size_t i = 0; i < d.names.size(); i++)
+    {
+        DirEntry e = {};
+        e.name = d.names[i].c_str();
+        e.name_len = d.names[i].size();
+        e.attributes = i % 7 == 0 ? FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_ARCHIVE : FILE_ATTRIBUTE_ARCHIVE;
+        e.size = (unsigned long long)i * 7919;
+        e.modified = 133500000000000000ULL + (unsigned long long)i * 10000000ULL;
+        d.entries.push_back(e);
+    }
+
+    d.ctx.ROOT_DIR = L"C:\\Data";
+    d.ctx.PREFIX = L"Reports";
+    split_extensions(L"txt,pdf,jpg,log,cpp", d.ctx.file_types);
+
+    d.query_ctx.ROOT_DIR = L"C:\\Data";
+    static const wchar_t *QUERY_PREFIXES[] = {L"", L"Projects", L"Archive", L"Users", L"Proj", L"", L"Shared", L"Temp"};
+    static const wchar_t *QUERY_TYPES[] = {L"txt", L"pdf,docx", L"", L"jpg,png", L"log", L"cpp,h", L"xlsx", L"zip"};
+    for (int i = 0; i < 8; i++)
+    {
+        auto q = std::make_unique<Query>();
+        q->name = "q" + std::to_string(i);
+        q->prefix = QUERY_PREFIXES[i];
+        if (*QUERY_TYPES[i])
+            split_extensions(QUERY_TYPES[i], q->file_types);
+        d.query_ctx.queries.push_back(std::move(q));
+    }
+    compile_query_matcher(d.query_ctx);
+
+    d.columns_ctx.columns = {Column::Size, Column::Modified, Column::Attributes};
+    d.sorted_ctx.columns = d.columns_ctx.columns;
+    d.sorted_ctx.SORTED = true;
+}
+
+// Doubles the iteration count until one run lasts MIN_SECONDS, then keeps
+// the fastest of REPEAT runs at that count
+void run_microbench(const Microbench &b, BenchData &d, const BenchSettings &settings)
+{
+    long long iterations = 1;
+    for (;;)
+    {
+        long long start = now_ns();
+        b.fn(d, iterations);
+        double seconds = (now_ns() - start) / 1e9;
+        if (seconds >= settings.MIN_SECONDS / 4 || iterations >= (1ll << 40))
+        {
+            if (seconds > 0)
+                iterations = std::max(iterations, (long long)(iterations * settings.MIN_SECONDS / seconds));
+            break;
+        }
+        iterations *= 2;
+    }
+
+    double best_ns = 0.0;
+    double allocations = 0.0;
+    long long ops = 0;
+    for (int r = 0; r < settings.REPEAT; r++)
+    {
+        long long allocs_before = g_allocations.load(std::memory_order_relaxed);
+        long long start = now_ns();
+        long long n = b.fn(d, iterations);
+        long long elapsed = now_ns() - start;
+        long long allocs = g_allocations.load(std::memory_order_relaxed) - allocs_before;
+        double ns = n > 0 ? (double)elapsed / n : 0.0;
+        if (r == 0 || ns < best_ns)
+        {
+            best_ns = ns;
+            allocations = n > 0 ? (double)allocs / n : 0.0;
+            ops = n;
+        }
+    }
+    std::cout << std::left << std::setw(16) << b.name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << best_ns << " ns/op" << std::setprecision(3) << std::setw(10) << allocations
+              << " allocs/op" << std::setw(14) << ops << " ops\n";
+}
+
+long long bench_extension(BenchData &d, long long iterations)
+{
+    size_t hits = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        const DirEntry &e = d.entries[i & 4095];
+        hits += extension_matches(d.ctx, e.name, e.name_len);
+    }
+    g_sink = hits;
+    return iterations;
+}
+
+long long bench_queries(BenchData &d, long long iterations)
+{
+    uint64_t masks = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        const DirEntry &e = d.entries[i & 4095];
+        masks += match_queries(d.query_ctx, ~0ull, e.name, e.name_len);
+    }
+    g_sink = (size_t)masks;
+    return iterations;
+}
+
+long long bench_prefix(BenchData &d, long long iterations)
+{
+    size_t hits = 0;
+    for (long long i = 0; i < iterations; i++)
+        hits += prefix_matches(d.ctx, d.paths[i & 4095]);
+    g_sink = hits;
+    return iterations;
+}
+
+long long bench_query_prefix(BenchData &d, long long iterations)
+{
+    uint64_t masks = 0;
+    for (long long i = 0; i < iterations; i++)
+        masks += directory_query_mask(d.query_ctx, d.paths[i & 4095]);
+    g_sink = (size_t)masks;
+    return iterations;
+}
+
+long long bench_join_path(BenchData &d, long long iterations)
+{
+    std::wstring out;
+    size_t total = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        const DirEntry &e = d.entries[i & 4095];
+        join_path(d.dir, e.name, e.name_len, out);
+        total += out.size();
+    }
+    g_sink = total;
+    return iterations;
+}
+
+long long bench_utf8_ascii(BenchData &d, long long iterations)
+{
+    std::string out;
+    size_t total = 0;
+    size_t n = d.ascii_paths.size();
+    for (long long i = 0; i < iterations; i++)
+    {
+        const std::wstring &path = d.ascii_paths[(size_t)i % n];
+        utf16_to_utf8(path.c_str(), path.size(), out);
+        total += out.size();
+    }
+    g_sink = total;
+    return iterations;
+}
+
+long long bench_utf8_mixed(BenchData &d, long long iterations)
+{
+    std::string out;
+    size_t total = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        const std::wstring &path = d.paths[i & 4095];
+        utf16_to_utf8(path.c_str(), path.size(), out);
+        total += out.size();
+    }
+    g_sink = total;
+    return iterations;
+}
+
+long long bench_record_path(BenchData &d, long long iterations)
+{
+    std::string record;
+    size_t total = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        format_record(d.ctx, d.utf8_paths[i & 4095], d.entries[i & 4095], record);
+        total += record.size();
+    }
+    g_sink = total;
+    return iterations;
+}
+
+long long bench_record_columns(BenchData &d, long long iterations)
+{
+    std::string record;
+    size_t total = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        format_record(d.columns_ctx, d.utf8_paths[i & 4095], d.entries[i & 4095], record);
+        total += record.size();
+    }
+    g_sink = total;
+    return iterations;
+}
+
+long long bench_record_sorted(BenchData &d, long long iterations)
+{
+    std::string record;
+    size_t total = 0;
+    for (long long i = 0; i < iterations; i++)
+    {
+        format_record(d.sorted_ctx, d.utf8_paths[i & 4095], d.entries[i & 4095], record);
+        total += record.size();
+    }
+    g_sink = total;
+    return iterations;
+}
+
+// Each thread seeds 100 directories, then pops one and pushes it back per op.
+// The strings circulate, so allocations/op is the queue's own.
+long long bench_queue(ScanContext &ctx, int threads, long long iterations)
+{
+    long long per_thread = std::max(1ll, iterations / threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&ctx, t, per_thread]()
+                             {
+            WorkerState ws;
+            ws.index = t;
+            for (int i = 0; i < 100; i++)
+                push_directory(ctx, ws, L"C:\\Data\\Projects\\2024\\Quarterly Reports\\dir" + std::to_wstring(t * 100 + i));
+            std::wstring dir;
+            for (long long i = 0; i < per_thread; i++)
+            {
+                if (try_next_directory(ctx, ws, dir))
+                    push_directory(ctx, ws, std::move(dir));
+            }
+            while (try_next_directory(ctx, ws, dir))
+                ; });
+    }
+    for (auto &w : workers)
+        w.join();
+    ctx.pending_dirs = 0;
+    ctx.active_dir_count = 0;
+    return per_thread * threads;
+}
+
+long long bench_queue_bfs(BenchData &d, long long iterations)
+{
+    ScanContext ctx;
+    return bench_queue(ctx, d.threads, iterations);
+}
+
+long long bench_queue_dfs(BenchData &d, long long iterations)
+{
+    ScanContext ctx;
+    ctx.DEPTH_FIRST = true;
+    return bench_queue(ctx, d.threads, iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSettings settings;
+    if (!parse_arguments(argc, argv, settings))
+    {
+        return 1;
+    }
+
+    BenchData d;
+    build_bench_data(d);
+    d.threads = settings.THREADS;
+
+    int run = 0;
+    for (const auto &b : MICROBENCHES)
+    {
+        if (!settings.FILTER.empty() && std::string(b.name).find(settings.FILTER) == std::string::npos)
+            continue;
+        run_microbench(b, d, settings);
+        run++;
+    }
+    if (run == 0)
+    {
+        std::cerr << "No kernel matches " << settings.FILTER << ".\n";
+        return 1;
+    }
+    return 0;
+}
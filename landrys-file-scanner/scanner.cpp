@@ -0,0 +1,4388 @@
+// Scanning engine and library API; see scanner.h and scanner_internal.h
+#include "scanner_internal.h"
+
+//----------------------------------------------------------
+// Function Implementations
+//----------------------------------------------------------
+
+// Splits a comma-separated extension list
+void split_extensions(std::wstring extensions, std::vector<std::wstring> &out)
+{
+    size_t pos = 0;
+    while ((pos = extensions.find(L",")) != std::wstring::npos)
+    {
+        out.push_back(extensions.substr(0, pos));
+        extensions.erase(0, pos + 1);
+    }
+    out.push_back(extensions);
+}
+
+//----------------------------------------------------------
+// Multi-query scans (--queries)
+//
+// The file lists named queries as INI-style sections:
+//
+//   [docs]
+//   prefix=Proj
+//   filetypes=doc,docx,pdf
+//   output=docs.csv
+//
+// A top-level folder is scanned if any query's prefix admits it, and every
+// directory below it carries the mask of queries whose prefix matched. Each
+// file's extension is looked up once in ext_query_mask, and the row is
+// formatted once and appended to the buffer of every query in
+// (directory mask & extension mask).
+//----------------------------------------------------------
+
+bool load_queries(ScanContext &ctx)
+{
+    FILE *fp = fopen(ctx.QUERIES_FILE.c_str(), "rb");
+    if (!fp)
+    {
+        std::cerr << "Error: cannot open query file " << ctx.QUERIES_FILE << ".\n";
+        return false;
+    }
+
+    char line_buf[4096];
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line_buf, sizeof(line_buf), fp))
+    {
+        line_no++;
+        std::string line = line_buf;
+        if (line_no == 1 && line.compare(0, 3, "\xEF\xBB\xBF") == 0)
+            line.erase(0, 3);
+        size_t first = line.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos || line[first] == '#' || line[first] == ';')
+            continue;
+        line = line.substr(first, line.find_last_not_of(" \t\r\n") - first + 1);
+
+        if (line[0] == '[')
+        {
+            if (line.back() != ']' || line.size() < 3)
+            {
+                ok = false;
+                break;
+            }
+            if (ctx.queries.size() == MAX_QUERIES)
+            {
+                std::cerr << "Error: at most " << MAX_QUERIES << " queries are supported.\n";
+                fclose(fp);
+                return false;
+            }
+            ctx.queries.emplace_back(new Query);
+            ctx.queries.back()->name = line.substr(1, line.size() - 2);
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos || ctx.queries.empty())
+        {
+            ok = false;
+            break;
+        }
+        std::string key = line.substr(0, eq);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        std::string value = line.substr(eq + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        Query &q = *ctx.queries.back();
+        if (key == "prefix")
+            q.prefix = std::wstring(value.begin(), value.end());
+        else if (key == "filetypes")
+            split_extensions(std::wstring(value.begin(), value.end()), q.file_types);
+        else if (key == "output")
+            q.output_file = value;
+        else
+            ok = false;
+    }
+    fclose(fp);
+
+    if (!ok)
+    {
+        std::cerr << "Error: " << ctx.QUERIES_FILE << " line " << line_no
+                  << ": expected [name], prefix=, filetypes= or output=.\n";
+        return false;
+    }
+    if (ctx.queries.empty())
+    {
+        std::cerr << "Error: " << ctx.QUERIES_FILE << " defines no queries.\n";
+        return false;
+    }
+    for (auto &q : ctx.queries)
+    {
+        if (q->output_file.empty())
+            q->output_file = q->name + ".csv";
+    }
+    return true;
+}
+
+// Builds the shared extension table from every query's filetypes
+void compile_query_matcher(ScanContext &ctx)
+{
+    for (size_t i = 0; i < ctx.queries.size(); i++)
+    {
+        uint64_t bit = 1ull << i;
+        if (ctx.queries[i]->file_types.empty())
+        {
+            ctx.any_ext_query_mask |= bit;
+            continue;
+        }
+        for (std::wstring ext : ctx.queries[i]->file_types)
+        {
+            std::transform(ext.begin(), ext.end(), ext.begin(), towlower);
+            ctx.ext_query_mask[ext] |= bit;
+        }
+    }
+}
+
+// Queries whose prefix admits the top-level folder that dir lies under
+uint64_t directory_query_mask(const ScanContext &ctx, const std::wstring &dir)
+{
+    size_t start = ctx.ROOT_DIR.size() + 1;
+    size_t end = dir.find(L'\\', start);
+    std::wstring top = dir.substr(start, end == std::wstring::npos ? std::wstring::npos : end - start);
+
+    uint64_t mask = 0;
+    for (size_t i = 0; i < ctx.queries.size(); i++)
+    {
+        const std::wstring &prefix = ctx.queries[i]->prefix;
+        if (prefix.empty() || _wcsnicmp(top.c_str(), prefix.c_str(), prefix.size()) == 0)
+            mask |= 1ull << i;
+    }
+    return mask;
+}
+
+// Queries that a file in a directory with dir_mask belongs to
+uint64_t match_queries(const ScanContext &ctx, uint64_t dir_mask, const wchar_t *name, size_t name_len)
+{
+    uint64_t mask = ctx.any_ext_query_mask;
+    if (!ctx.ext_query_mask.empty())
+    {
+        size_t dot = name_len;
+        while (dot > 0 && name[dot - 1] != L'.')
+            dot--;
+        if (dot > 0)
+        {
+            thread_local std::wstring ext;
+            ext.assign(name + dot, name_len - dot);
+            std::transform(ext.begin(), ext.end(), ext.begin(), towlower);
+            auto it = ctx.ext_query_mask.find(ext);
+            if (it != ctx.ext_query_mask.end())
+                mask |= it->second;
+        }
+    }
+    return mask & dir_mask;
+}
+
+// Creates every query's output file with the BOM and CSV header
+bool open_query_outputs(ScanContext &ctx)
+{
+    const unsigned char bom[] = {0xEF, 0xBB, 0xBF};
+    std::string header = csv_header(ctx);
+    for (auto &q : ctx.queries)
+    {
+        q->fp = fopen(q->output_file.c_str(), "wb");
+        if (!q->fp)
+        {
+            std::cerr << "Failed to open output file " << q->output_file << " for query " << q->name << ".\n";
+            return false;
+        }
+        fwrite(bom, sizeof(bom), 1, q->fp);
+        fwrite(header.data(), 1, header.size(), q->fp);
+    }
+    return true;
+}
+
+// Whether a top-level folder is scanned: it matches PREFIX, or in
+// multi-query mode the prefix of at least one query
+bool top_level_matches(const ScanContext &ctx, const wchar_t *name)
+{
+    if (!ctx.queries.empty())
+        return directory_query_mask(ctx, ctx.ROOT_DIR + L"\\" + name) != 0;
+    return ctx.PREFIX.empty() || _wcsnicmp(name, ctx.PREFIX.c_str(), ctx.PREFIX.size()) == 0;
+}
+
+//----------------------------------------------------------
+// Sharding (--shard=i/N)
+//
+// N processes, possibly on different hosts, cover one tree between them.
+// Directories at SHARD_DEPTH are assigned by FNV-1a of their path relative
+// to the root, so every process computes the same split no matter how it
+// mounts the share. With depth 2, every shard lists the top-level
+// directories; a top-level directory's own files go to the shard that owns
+// it and each of its subdirectories to the shard its hash picks.
+//----------------------------------------------------------
+
+// Whether this shard scans path, a directory at SHARD_DEPTH below ROOT_DIR
+bool shard_owns(const ScanContext &ctx, const std::wstring &path)
+{
+    if (ctx.SHARD_COUNT <= 1)
+        return true;
+    std::wstring relative = path.substr(std::min(ctx.ROOT_DIR.size() + 1, path.size()));
+    return hash_path(relative) % (uint64_t)ctx.SHARD_COUNT == (uint64_t)ctx.SHARD_INDEX;
+}
+
+// Sets the worker's shard filters for the directory it is about to handle entries of
+void enter_shard_directory(const ScanContext &ctx, WorkerState &ws, const std::wstring &dir)
+{
+    ws.shard_skip_files = false;
+    ws.shard_filter_dirs = false;
+    if (ctx.SHARD_COUNT <= 1 || ctx.SHARD_DEPTH < 2 || dir.find(L'\\', ctx.ROOT_DIR.size() + 1) != std::wstring::npos)
+        return;
+    ws.shard_skip_files = !shard_owns(ctx, dir);
+    ws.shard_filter_dirs = true;
+}
+
+// Initializes the directory queue with the top-level directories that match
+// PREFIX and, with --shard, belong to this shard
+bool initialize_directory_queue(ScanContext &ctx)
+{
+    create_directory_backend(ctx);
+    void *listing = ctx.backend->open_directory(ctx.ROOT_DIR);
+    if (!listing)
+    {
+        DirEntry root;
+        if (!ctx.backend->stat(ctx.ROOT_DIR, root))
+            std::cerr << "Error: " << to_utf8(ctx.ROOT_DIR) << " does not exist.\n";
+        else if ((root.attributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            std::cerr << "Error: " << to_utf8(ctx.ROOT_DIR) << " is not a directory.\n";
+        else
+            std::cerr << "Error: " << to_utf8(ctx.ROOT_DIR) << " cannot be listed.\n";
+        return false;
+    }
+
+    std::vector<DirEntry> batch;
+    bool more = true;
+    while (more)
+    {
+        more = ctx.backend->read_batch(listing, batch);
+        for (const DirEntry &entry : batch)
+        {
+            if ((entry.attributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+                continue;
+            // Skip '.' and '..'
+            if (entry.name[0] == L'.' && (entry.name_len == 1 || (entry.name_len == 2 && entry.name[1] == L'.')))
+                continue;
+
+            std::wstring name(entry.name, entry.name_len);
+            if (top_level_matches(ctx, name.c_str()))
+            {
+                std::wstring subdir = ctx.ROOT_DIR + L"\\" + name;
+                if (ctx.SHARD_DEPTH < 2 && !shard_owns(ctx, subdir))
+                    continue;
+                {
+                    std::lock_guard<std::mutex> lk(ctx.q_m);
+                    ctx.dir_queue.push(subdir);
+                    ctx.pending_dirs++;
+                    ctx.active_dir_count++;
+                }
+            }
+        }
+    }
+    ctx.backend->close_directory(listing);
+    if (!ctx.HISTORY_FILE.empty())
+        order_by_history(ctx);
+
+    return (ctx.active_dir_count > 0);
+}
+
+// Resolves the worker thread bounds from FIXED_THREADS, MIN_THREADS,
+// MAX_THREADS and the backend
+bool normalize_thread_settings(ScanContext &ctx)
+{
+    if (ctx.ASYNC_IO)
+    {
+        // Concurrency comes from the queue depth, so the thread count is fixed
+        ctx.MIN_THREADS = ctx.MAX_THREADS = ctx.FIXED_THREADS > 0 ? ctx.FIXED_THREADS : HARDWARE_THREADS;
+        if (ctx.QUEUE_DEPTH < 1)
+        {
+            std::cerr << "Error: --queue-depth must be at least 1.\n\n";
+            return false;
+        }
+    }
+    else if (ctx.FIXED_THREADS > 0)
+    {
+        ctx.MIN_THREADS = ctx.MAX_THREADS = ctx.FIXED_THREADS;
+    }
+    else if (ctx.MAX_THREADS <= 0)
+    {
+        ctx.MAX_THREADS = std::max(HARDWARE_THREADS * 16, ctx.MIN_THREADS);
+    }
+    if (ctx.MIN_THREADS < 1 || ctx.MIN_THREADS > ctx.MAX_THREADS)
+    {
+        std::cerr << "Error: thread bounds must satisfy 1 <= --min-threads <= --max-threads.\n\n";
+        return false;
+    }
+
+    // Every thread holds one block per output, so --output-memory bounds the thread count
+    size_t blocks = std::max<size_t>(ctx.queries.size(), 1);
+    size_t memory_threads = output_memory_for_blocks(ctx) / (MIN_OUTPUT_BLOCK_BYTES * blocks);
+    if ((size_t)ctx.MIN_THREADS > memory_threads)
+    {
+        std::cerr << "Error: --output-memory is too small for " << ctx.MIN_THREADS << " threads; it must hold "
+                  << blocks << " x " << MIN_OUTPUT_BLOCK_BYTES << " bytes per thread.\n\n";
+        return false;
+    }
+    if ((size_t)ctx.MAX_THREADS > memory_threads)
+    {
+        // Only reachable with an adaptive range; lower its ceiling rather than overrun the cap
+        ctx.MAX_THREADS = (int)memory_threads;
+    }
+    return true;
+}
+
+// Changes how many workers may take directories from the queue and wakes any
+// parked workers that are now allowed to run
+void set_thread_limit(ScanContext &ctx, int limit)
+{
+    limit = std::clamp(limit, ctx.MIN_THREADS, ctx.MAX_THREADS);
+    {
+        std::lock_guard<std::mutex> lk(ctx.park_m);
+        ctx.active_thread_limit.store(limit);
+    }
+    ctx.peak_thread_limit = std::max(ctx.peak_thread_limit, limit);
+    ctx.park_cv.notify_all();
+    if (!ctx.traces.empty())
+        trace_event(main_trace(ctx), TRACE_THREADS, now_ns(), -1, limit, nullptr);
+}
+
+// Samples enumeration throughput and directory open latency and moves the
+// active worker count one step. Throughput gains keep the current direction,
+// losses reverse it. On a plateau, rising open latency means the storage is
+// saturated so a worker is released; otherwise another step up is probed while
+// there are more queued directories than workers, and the count is held if not.
+void adjust_thread_count(ScanContext &ctx, ThreadController &tc)
+{
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - tc.last_sample).count();
+    if (seconds < 0.5)
+        return;
+
+    long long entries = ctx.entry_count.load(std::memory_order_relaxed);
+    long long opens = ctx.open_count.load(std::memory_order_relaxed);
+    long long open_ns = ctx.open_ns.load(std::memory_order_relaxed);
+    long long delta_opens = opens - tc.last_opens;
+    double throughput = (double)(entries - tc.last_entries) / seconds;
+    double latency_us = delta_opens > 0 ? (double)(open_ns - tc.last_open_ns) / delta_opens / 1000.0 : tc.last_latency_us;
+
+    tc.last_sample = now;
+    tc.last_entries = entries;
+    tc.last_opens = opens;
+    tc.last_open_ns = open_ns;
+
+    int limit = ctx.active_thread_limit.load();
+    long long pending = ctx.pending_dirs.load() + ctx.spilled_dirs.load();
+
+    if (throughput > tc.last_throughput * 1.05)
+    {
+        // Keep going the same way
+    }
+    else if (throughput < tc.last_throughput * 0.95)
+    {
+        tc.direction = -tc.direction;
+    }
+    else if (latency_us > tc.last_latency_us * 1.25)
+    {
+        tc.direction = -1;
+    }
+    else
+    {
+        // Flat throughput at steady latency; probe upwards
+        tc.direction = 1;
+    }
+
+    // Growing is pointless when there are not enough queued directories to feed new workers
+    if (tc.direction > 0 && pending <= limit)
+        tc.direction = 0;
+
+    tc.last_throughput = throughput;
+    tc.last_latency_us = latency_us;
+
+    if (tc.direction > 0)
+        set_thread_limit(ctx, limit + std::max(1, limit / 2));
+    else if (tc.direction < 0)
+        set_thread_limit(ctx, limit - std::max(1, limit / 4));
+}
+
+//----------------------------------------------------------
+// Directory scheduling
+//
+// Breadth-first mode pushes every subdirectory onto the shared dir_queue.
+// Depth-first mode keeps them on the discovering worker's local stack, which
+// bounds the frontier to roughly depth x fan-out, and hands the shallowest
+// ones to dir_queue whenever it pushes or pops while another worker is idle.
+// In either mode, once MAX_PENDING directories are waiting in memory, new
+// ones are appended to a spill file and read back in batches when the
+// in-memory queues run dry.
+//----------------------------------------------------------
+
+std::string spill_path(const ScanContext &ctx)
+{
+    return ctx.OUTPUT_FILE + ".frontier.tmp";
+}
+
+// Appends one directory to the spill file as [u32 length][UTF-16 path]. Must hold q_m.
+bool spill_directory(ScanContext &ctx, const std::wstring &dir)
+{
+    if (!ctx.spill_fp)
+    {
+        ctx.spill_fp = fopen(spill_path(ctx).c_str(), "w+b");
+        if (!ctx.spill_fp)
+            return false;
+    }
+    uint32_t len = (uint32_t)dir.size();
+    _fseeki64(ctx.spill_fp, ctx.spill_write_off, SEEK_SET);
+    if (fwrite(&len, sizeof(len), 1, ctx.spill_fp) != 1 ||
+        fwrite(dir.data(), sizeof(wchar_t), len, ctx.spill_fp) != len)
+        return false;
+    ctx.spill_write_off += sizeof(len) + (long long)len * sizeof(wchar_t);
+    ctx.spilled_dirs++;
+    ctx.spill_total++;
+    return true;
+}
+
+// Moves a batch of spilled directories back into dir_queue. Must hold q_m.
+void refill_from_spill(ScanContext &ctx)
+{
+    long long room = ctx.MAX_PENDING - ctx.pending_dirs.load();
+    long long batch = std::max(1LL, std::min(room, SPILL_REFILL_BATCH));
+    _fseeki64(ctx.spill_fp, ctx.spill_read_off, SEEK_SET);
+    for (long long i = 0; i < batch && ctx.spilled_dirs > 0; i++)
+    {
+        uint32_t len;
+        std::wstring dir;
+        bool ok = fread(&len, sizeof(len), 1, ctx.spill_fp) == 1;
+        if (ok)
+        {
+            dir.resize(len);
+            ok = fread(dir.data(), sizeof(wchar_t), len, ctx.spill_fp) == len;
+        }
+        if (!ok)
+        {
+            // Unreadable spill file: give up on what is left rather than hang
+            std::cerr << "Failed to read spilled directories; " << ctx.spilled_dirs.load() << " skipped.\n";
+            ctx.active_dir_count -= (int)ctx.spilled_dirs.load();
+            ctx.spilled_dirs = 0;
+            break;
+        }
+        ctx.spill_read_off += sizeof(len) + (long long)len * sizeof(wchar_t);
+        ctx.spilled_dirs--;
+        ctx.pending_dirs++;
+        ctx.dir_queue.push(std::move(dir));
+    }
+    if (ctx.spilled_dirs == 0)
+    {
+        // Reuse the file from the start next time
+        ctx.spill_read_off = ctx.spill_write_off = 0;
+    }
+}
+
+// Queues a newly discovered directory according to the traversal mode
+void push_directory(ScanContext &ctx, WorkerState &ws, std::wstring dir)
+{
+    if (ws.stage_journal)
+    {
+        append_journal_path(*ws.stage_journal, 'A', dir);
+        // Already finished before the interruption; its subtree is accounted for
+        if (!ctx.resume_done.empty() && ctx.resume_done.count(dir))
+            return;
+    }
+
+    if (ctx.MAX_PENDING > 0 && ctx.pending_dirs.load(std::memory_order_relaxed) >= ctx.MAX_PENDING)
+    {
+        bool spilled;
+        {
+            TimedLock lk(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+            spilled = spill_directory(ctx, dir);
+            if (spilled)
+                ctx.active_dir_count++;
+        }
+        if (spilled)
+        {
+            ctx.q_cv.notify_one();
+            return;
+        }
+        // Spill file unavailable: keep the directory in memory instead of losing it
+    }
+
+    ctx.pending_dirs.fetch_add(1, std::memory_order_relaxed);
+    if (ctx.DEPTH_FIRST)
+    {
+        ctx.active_dir_count++;
+        ws.local_dirs.push_back(std::move(dir));
+        share_with_idle_workers(ctx, ws, 1);
+        return;
+    }
+
+    {
+        TimedLock lk(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+        ctx.dir_queue.push(std::move(dir));
+        ctx.active_dir_count++;
+    }
+    ctx.q_cv.notify_one();
+}
+
+// Moves the shallowest (usually largest) directories of the local stack to
+// dir_queue, one per idle worker, keeping at least keep of them. Called on
+// every push and pop, so a worker working through a deep stack of leaves
+// still feeds workers that went idle after its last push.
+void share_with_idle_workers(ScanContext &ctx, WorkerState &ws, size_t keep)
+{
+    if (ws.local_dirs.size() <= keep)
+        return;
+    int idle = ctx.idle_workers.load(std::memory_order_relaxed);
+    if (idle <= 0)
+        return;
+    size_t count = std::min(ws.local_dirs.size() - keep, (size_t)idle);
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_HANDOFF, now_ns(), -1, (long long)count, &ws.local_dirs.front());
+    {
+        TimedLock lk(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+        for (size_t i = 0; i < count; i++)
+        {
+            ctx.dir_queue.push(std::move(ws.local_dirs.front()));
+            ws.local_dirs.pop_front();
+        }
+    }
+    if (count == 1)
+        ctx.q_cv.notify_one();
+    else
+        ctx.q_cv.notify_all();
+}
+
+// Takes the next directory without blocking: the local stack first, then
+// dir_queue, then the spill file
+bool try_next_directory(ScanContext &ctx, WorkerState &ws, std::wstring &dir)
+{
+    if (!ws.local_dirs.empty())
+    {
+        dir = std::move(ws.local_dirs.back());
+        ws.local_dirs.pop_back();
+        ctx.pending_dirs.fetch_sub(1, std::memory_order_relaxed);
+        // This worker has its next directory, so the rest may all go
+        share_with_idle_workers(ctx, ws, 0);
+        return true;
+    }
+
+    TimedLock lk(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+    if (ctx.dir_queue.empty() && ctx.spilled_dirs > 0)
+        refill_from_spill(ctx);
+    if (ctx.dir_queue.empty())
+        return false;
+    dir = std::move(ctx.dir_queue.front());
+    ctx.dir_queue.pop();
+    ctx.pending_dirs.fetch_sub(1, std::memory_order_relaxed);
+    if (ws.trace && ctx.DEPTH_FIRST)
+        trace_event(ws.trace, TRACE_STEAL, now_ns(), -1, 1, &dir);
+    return true;
+}
+
+// Blocking version for the find backend workers; returns false once the scan
+// is done. A waiting chunk of a split directory is taken first: it is then
+// left in ws.taken_chunk and dir is empty.
+bool next_directory(ScanContext &ctx, WorkerState &ws, std::wstring &dir)
+{
+    if (!ws.local_dirs.empty())
+        return try_next_directory(ctx, ws, dir);
+
+    TimedLock timed(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+    std::unique_lock<std::mutex> &lk = timed.lock;
+    for (;;)
+    {
+        ctx.idle_workers++;
+        if (ctx.dir_queue.empty() && ctx.entry_chunks.empty() && ctx.spilled_dirs == 0 && !ctx.done.load())
+        {
+            long long idle_start = now_ns();
+            ctx.q_cv.wait(lk, [&]
+                          { return !ctx.dir_queue.empty() || !ctx.entry_chunks.empty() || ctx.spilled_dirs > 0 ||
+                                   ctx.done.load(); });
+            long long idle_ns = now_ns() - idle_start;
+            ws.counters.idle_ns += idle_ns;
+            if (ws.trace)
+                trace_event(ws.trace, TRACE_IDLE, idle_start, idle_ns, 0, nullptr);
+        }
+        ctx.idle_workers--;
+
+        if (!ctx.entry_chunks.empty())
+        {
+            ws.taken_chunk = std::move(ctx.entry_chunks.front());
+            ctx.entry_chunks.pop_front();
+            dir.clear();
+            return true;
+        }
+        if (ctx.dir_queue.empty() && ctx.spilled_dirs > 0)
+            refill_from_spill(ctx);
+        if (!ctx.dir_queue.empty())
+        {
+            dir = std::move(ctx.dir_queue.front());
+            ctx.dir_queue.pop();
+            ctx.pending_dirs.fetch_sub(1, std::memory_order_relaxed);
+            if (ws.trace && ctx.DEPTH_FIRST)
+                trace_event(ws.trace, TRACE_STEAL, now_ns(), -1, 1, &dir);
+            return true;
+        }
+        if (ctx.done.load())
+            return false;
+    }
+}
+
+// Hands a worker's whole local stack to dir_queue, e.g. before it parks
+void share_local_directories(ScanContext &ctx, WorkerState &ws)
+{
+    if (ws.local_dirs.empty())
+        return;
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_HANDOFF, now_ns(), -1, (long long)ws.local_dirs.size(), nullptr);
+    {
+        TimedLock lk(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+        for (auto &dir : ws.local_dirs)
+            ctx.dir_queue.push(std::move(dir));
+    }
+    ws.local_dirs.clear();
+    ctx.q_cv.notify_all();
+}
+
+// Part of OUTPUT_MEMORY_LIMIT_BYTES for the output blocks. With --checkpoint
+// the other half holds rows staged for unfinished directories (stage_row).
+size_t output_memory_for_blocks(const ScanContext &ctx)
+{
+    return ctx.CHECKPOINT_SECONDS > 0 ? ctx.OUTPUT_MEMORY_LIMIT_BYTES / 2 : ctx.OUTPUT_MEMORY_LIMIT_BYTES;
+}
+
+// Sets the effective per-thread block so that thread_count buffers together
+// stay within output_memory_for_blocks; normalize_thread_settings has already
+// made sure the share is at least MIN_OUTPUT_BLOCK_BYTES. Called again as
+// threads are started, so the block only shrinks; running workers pick up the
+// smaller block at their next append.
+void size_output_buffers(ScanContext &ctx, int thread_count)
+{
+    size_t per_thread_limit = output_memory_for_blocks(ctx) / (size_t)std::max(thread_count, 1);
+    ctx.output_block_bytes.store(std::min(ctx.OUTPUT_BLOCK_BYTES, per_thread_limit));
+}
+
+// Releases a reservation made before the block shrank, once the buffer is empty
+void fit_output_block(ScanContext &ctx, std::string &buffer)
+{
+    size_t block = ctx.output_block_bytes.load(std::memory_order_relaxed);
+    if (buffer.empty() && buffer.capacity() > block)
+    {
+        std::string().swap(buffer);
+        buffer.reserve(block);
+    }
+}
+
+// Flushes the local buffer to the output file safely
+void flush_buffer(ScanContext &ctx, WorkerState &ws)
+{
+    std::string &buffer = ws.out_buf;
+    long long flush_start = now_ns();
+    if (ctx.SORTED)
+    {
+        long long bytes = (long long)buffer.size();
+        spill_sorted_run(ctx, buffer);
+        fit_output_block(ctx, buffer);
+        ws.counters.flush_ns += now_ns() - flush_start;
+        if (ws.trace)
+            trace_event(ws.trace, TRACE_FLUSH, flush_start, now_ns() - flush_start, bytes, nullptr);
+        return;
+    }
+
+    TimedLock lk_out(ctx.out_m, ws.counters.output_wait_ns, ws.trace, TRACE_OUTPUT_LOCK);
+    long long bytes = (long long)buffer.size();
+    fwrite(buffer.data(), 1, buffer.size(), ctx.out_fp);
+    ctx.output_flush_count.fetch_add(1, std::memory_order_relaxed);
+    ctx.output_bytes_written.fetch_add((long long)buffer.size(), std::memory_order_relaxed);
+    buffer.clear();
+    fit_output_block(ctx, buffer);
+    if (!ws.journal_ready.empty())
+    {
+        // These directories' rows are now in out_fp, so the next checkpoint may record them
+        ctx.journal_committed += ws.journal_ready;
+        ws.journal_ready.clear();
+    }
+    ws.counters.flush_ns += now_ns() - flush_start;
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_FLUSH, flush_start, now_ns() - flush_start, bytes, nullptr);
+}
+
+// Appends a record to the local buffer, flushing first if it would grow past
+// the effective block so the buffer never reallocates beyond its reservation
+void append_output(ScanContext &ctx, WorkerState &ws, const char *data, size_t len)
+{
+    size_t block = ctx.output_block_bytes.load(std::memory_order_relaxed);
+    if (ws.out_buf.size() + len > block && !ws.out_buf.empty())
+    {
+        flush_buffer(ctx, ws);
+    }
+    ws.out_buf.append(data, len);
+    if (ws.out_buf.size() >= block)
+    {
+        flush_buffer(ctx, ws);
+    }
+}
+
+void flush_query_buffer(Query &q, std::string &buffer, WorkerState &ws)
+{
+    long long flush_start = now_ns();
+    long long bytes = (long long)buffer.size();
+    {
+        TimedLock lk(q.m, ws.counters.output_wait_ns, ws.trace, TRACE_OUTPUT_LOCK);
+        fwrite(buffer.data(), 1, buffer.size(), q.fp);
+        q.bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    buffer.clear();
+    ws.counters.flush_ns += now_ns() - flush_start;
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_FLUSH, flush_start, now_ns() - flush_start, bytes, nullptr);
+}
+
+// Appends one formatted row to the block of every query in mask
+void append_query_outputs(ScanContext &ctx, WorkerState &ws, uint64_t mask, const std::string &record)
+{
+    size_t block = ctx.output_block_bytes.load(std::memory_order_relaxed);
+    for (size_t i = 0; mask != 0; i++, mask >>= 1)
+    {
+        if ((mask & 1) == 0)
+            continue;
+        Query &q = *ctx.queries[i];
+        std::string &buffer = ws.query_bufs[i];
+        if (buffer.size() + record.size() > block && !buffer.empty())
+        {
+            flush_query_buffer(q, buffer, ws);
+        }
+        buffer += record;
+        if (buffer.size() >= block)
+        {
+            flush_query_buffer(q, buffer, ws);
+        }
+        q.file_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Flushes whatever a worker still holds when it exits
+void flush_worker_buffers(ScanContext &ctx, WorkerState &ws)
+{
+    ctx.file_bytes.fetch_add(ws.unpublished_bytes, std::memory_order_relaxed);
+    ws.unpublished_bytes = 0;
+    if (!ws.batch.entries.empty())
+    {
+        publish_batch(ctx, ws);
+    }
+    if (!ws.out_buf.empty())
+    {
+        flush_buffer(ctx, ws);
+    }
+    for (size_t i = 0; i < ws.query_bufs.size(); i++)
+    {
+        if (!ws.query_bufs[i].empty())
+            flush_query_buffer(*ctx.queries[i], ws.query_bufs[i], ws);
+    }
+}
+
+// Library mode: adds a matching file to the worker's batch
+void add_batch_entry(ScanContext &ctx, WorkerState &ws, const std::wstring &full_path, size_t name_len,
+                     const DirEntry &entry)
+{
+    ScanEntry e;
+    e.path_len = full_path.size();
+    e.name_offset = full_path.size() - name_len;
+    e.attributes = entry.attributes;
+    e.size = entry.size;
+    e.modified = entry.modified;
+    e.file_id = entry.file_id;
+    ws.batch.path_offsets.push_back(ws.batch.paths.size());
+    ws.batch.paths.append(full_path).append(1, L'\0');
+    ws.batch.entries.push_back(e);
+    ctx.file_count.fetch_add(1, std::memory_order_relaxed);
+    ws.counters.files++;
+    ws.unpublished_bytes += (long long)entry.size;
+    if (ws.batch.entries.size() >= ctx.SINK_BATCH_ENTRIES)
+    {
+        publish_batch(ctx, ws);
+    }
+}
+
+// Hands the worker's batch to entry_sink, which may take it over
+void publish_batch(ScanContext &ctx, WorkerState &ws)
+{
+    ctx.entry_sink(ws.batch);
+    ws.batch.entries.clear();
+    ws.batch.paths.clear();
+    ws.batch.path_offsets.clear();
+}
+
+// Points each entry at its path; the paths buffer must not change afterwards
+void bind_batch_paths(ScanBatch &batch)
+{
+    for (size_t i = 0; i < batch.entries.size(); i++)
+        batch.entries[i].path = batch.paths.data() + batch.path_offsets[i];
+}
+
+// Retires a directory that was dequeued after a cancel. It is neither
+// enumerated nor journaled as finished, so a checkpoint still lists it as pending.
+void drop_directory(ScanContext &ctx)
+{
+    ctx.active_dir_count--;
+}
+
+// Retires a directory whose listing was cut short by a cancel. Rows and
+// journal records staged for it are discarded so a checkpoint never claims
+// it as finished; rows already in an output buffer are kept.
+void abandon_directory(ScanContext &ctx, StagedRows &rows, std::string &journal)
+{
+    discard_staged_rows(ctx, rows);
+    journal.clear();
+    drop_directory(ctx);
+}
+
+// Empties dir_queue and the spill file after a cancel so workers do not have
+// to dequeue every remaining directory one by one
+void drain_cancelled_queue(ScanContext &ctx)
+{
+    std::lock_guard<std::mutex> lk(ctx.q_m);
+    long long queued = (long long)ctx.dir_queue.size();
+    std::queue<std::wstring>().swap(ctx.dir_queue);
+    ctx.pending_dirs.fetch_sub(queued, std::memory_order_relaxed);
+    ctx.active_dir_count -= (int)(queued + ctx.spilled_dirs + ctx.entry_chunks.size());
+    ctx.entry_chunks.clear();
+    ctx.spilled_dirs = 0;
+    ctx.spill_read_off = ctx.spill_write_off;
+}
+
+// Takes one of the LIMIT result slots. Taking the last one cancels the scan,
+// so workers stop as soon as the limit is reached rather than on the next match.
+bool claim_result(ScanContext &ctx)
+{
+    if (ctx.LIMIT <= 0)
+        return true;
+    long long slot = ctx.results_claimed.fetch_add(1, std::memory_order_relaxed);
+    if (slot + 1 >= ctx.LIMIT)
+    {
+        ctx.limit_reached = true;
+        ctx.cancel_token.cancel();
+    }
+    return slot < ctx.LIMIT;
+}
+
+//----------------------------------------------------------
+// Load limits (--max-iops, --max-dirs-per-sec, --time-budget)
+//
+// An I/O is a directory open or a listing read. FindFirstFileExW counts as one,
+// and FindNextFileW refills that are not visible to us are estimated as one
+// per IOPS_ENTRIES_PER_READ entries. The handle-based and async backends
+// count each GetFileInformationByHandleEx / NtQueryDirectoryFile call.
+//----------------------------------------------------------
+
+void init_token_bucket(TokenBucket &bucket, double rate)
+{
+    bucket.rate = rate;
+    // A tenth of a second of burst smooths wakeup jitter without letting the rate spike
+    bucket.capacity = std::max(1.0, rate / 10.0);
+    bucket.tokens = bucket.capacity;
+    bucket.last = std::chrono::steady_clock::now();
+}
+
+// Takes tokens from the bucket, sleeping off any deficit in short slices so a
+// cancel is noticed promptly
+void throttle(ScanContext &ctx, TokenBucket &bucket, double tokens)
+{
+    if (bucket.rate <= 0.0)
+        return;
+
+    double deficit;
+    {
+        std::lock_guard<std::mutex> lk(bucket.m);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+        bucket.last = now;
+        bucket.tokens = std::min(bucket.capacity, bucket.tokens + elapsed * bucket.rate);
+        bucket.tokens -= tokens;
+        deficit = -bucket.tokens;
+    }
+    if (deficit <= 0.0)
+        return;
+
+    auto wait_start = std::chrono::steady_clock::now();
+    auto wake = wait_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                 std::chrono::duration<double>(deficit / bucket.rate));
+    while (!ctx.cancel_token.cancelled())
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= wake)
+            break;
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(wake - now, std::chrono::milliseconds(50)));
+    }
+    ctx.throttle_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wait_start).count(),
+                              std::memory_order_relaxed);
+}
+
+// Stages one row of an unfinished directory. A directory's rows move to its
+// temp file once they fill an output block, or once all directories' staged
+// rows reach the half of --output-memory that output_memory_for_blocks leaves
+// them, so staging stays within the cap.
+void stage_row(ScanContext &ctx, StagedRows &staged, const std::string &record)
+{
+    staged.rows += record;
+    long long staged_total = ctx.staged_bytes.fetch_add((long long)record.size(), std::memory_order_relaxed) +
+                             (long long)record.size();
+    if (staged.rows.size() >= ctx.output_block_bytes.load(std::memory_order_relaxed) ||
+        staged_total >= (long long)(ctx.OUTPUT_MEMORY_LIMIT_BYTES / 2))
+    {
+        spill_staged_rows(ctx, staged);
+    }
+}
+
+// Appends a directory's in-memory rows to its temp file, creating it first
+void spill_staged_rows(ScanContext &ctx, StagedRows &staged)
+{
+    if (staged.spill_failed || staged.rows.empty())
+        return;
+    if (!staged.spill)
+    {
+        staged.spill_path = ctx.OUTPUT_FILE + ".stage" + std::to_string(ctx.next_stage_id.fetch_add(1)) + ".tmp";
+        staged.spill = fopen(staged.spill_path.c_str(), "w+b");
+        if (!staged.spill)
+        {
+            std::cerr << "Failed to create staging file " << staged.spill_path << "; keeping the rows in memory\n";
+            staged.spill_failed = true;
+            return;
+        }
+        ctx.staged_spill_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    fwrite(staged.rows.data(), 1, staged.rows.size(), staged.spill);
+    ctx.staged_bytes.fetch_sub((long long)staged.rows.size(), std::memory_order_relaxed);
+    std::string().swap(staged.rows);
+}
+
+// Drops a directory's staged rows, in memory and on disk
+void discard_staged_rows(ScanContext &ctx, StagedRows &staged)
+{
+    ctx.staged_bytes.fetch_sub((long long)staged.rows.size(), std::memory_order_relaxed);
+    std::string().swap(staged.rows);
+    if (staged.spill)
+    {
+        fclose(staged.spill);
+        remove(staged.spill_path.c_str());
+        staged.spill = nullptr;
+    }
+    staged.spill_failed = false;
+}
+
+// Writes a directory whose rows partly went to its temp file. Everything the
+// worker buffered before goes first; the directory's rows and its journal
+// records then go in under one hold of out_m, so a checkpoint sees the
+// directory whole or not at all.
+void commit_spilled_directory(ScanContext &ctx, WorkerState &ws, StagedRows &staged, std::string &journal)
+{
+    if (!ws.out_buf.empty())
+        flush_buffer(ctx, ws);
+
+    long long flush_start = now_ns();
+    long long bytes = 0;
+    bool read_ok;
+    {
+        TimedLock lk_out(ctx.out_m, ws.counters.output_wait_ns, ws.trace, TRACE_OUTPUT_LOCK);
+        rewind(staged.spill);
+        char buf[64 * 1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), staged.spill)) > 0)
+        {
+            fwrite(buf, 1, n, ctx.out_fp);
+            bytes += (long long)n;
+        }
+        read_ok = !ferror(staged.spill);
+        fwrite(staged.rows.data(), 1, staged.rows.size(), ctx.out_fp);
+        bytes += (long long)staged.rows.size();
+        ctx.output_flush_count.fetch_add(1, std::memory_order_relaxed);
+        ctx.output_bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+        ctx.journal_committed += journal;
+    }
+    if (!read_ok)
+        std::cerr << "Failed to read staging file " << staged.spill_path << "; the output is incomplete\n";
+    journal.clear();
+    discard_staged_rows(ctx, staged);
+    ws.counters.flush_ns += now_ns() - flush_start;
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_FLUSH, flush_start, now_ns() - flush_start, bytes, nullptr);
+}
+
+// Retires a directory. With --checkpoint its staged rows move into out_buf
+// together with its journal records, so a flush never writes rows of a
+// directory that the journal would still consider pending.
+void finish_directory(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, StagedRows &rows,
+                      std::string &journal)
+{
+    if (ctx.CHECKPOINT_SECONDS > 0)
+    {
+        append_journal_path(journal, 'D', dir);
+        if (rows.spill)
+        {
+            commit_spilled_directory(ctx, ws, rows, journal);
+        }
+        else
+        {
+            size_t block = ctx.output_block_bytes.load(std::memory_order_relaxed);
+            if (ws.out_buf.size() + rows.rows.size() > block && !ws.out_buf.empty())
+            {
+                flush_buffer(ctx, ws);
+            }
+            ws.out_buf += rows.rows;
+            ws.journal_ready += journal;
+            ctx.staged_bytes.fetch_sub((long long)rows.rows.size(), std::memory_order_relaxed);
+            rows.rows.clear();
+            journal.clear();
+            if (ws.out_buf.size() >= block)
+            {
+                flush_buffer(ctx, ws);
+            }
+        }
+        flush_for_checkpoint(ctx, ws);
+    }
+    ctx.dir_done_count.fetch_add(1, std::memory_order_relaxed);
+    ws.counters.directories++;
+    if (ws.unpublished_bytes != 0)
+    {
+        ctx.file_bytes.fetch_add(ws.unpublished_bytes, std::memory_order_relaxed);
+        ws.unpublished_bytes = 0;
+    }
+    ctx.active_dir_count--;
+}
+
+// Flushes once per checkpoint request so a checkpoint is not limited to
+// whatever happened to fill a whole output block
+void flush_for_checkpoint(ScanContext &ctx, WorkerState &ws)
+{
+    long long epoch = ctx.checkpoint_epoch.load(std::memory_order_relaxed);
+    if (ws.flushed_epoch == epoch)
+        return;
+    ws.flushed_epoch = epoch;
+    if (!ws.out_buf.empty())
+        flush_buffer(ctx, ws);
+}
+
+//----------------------------------------------------------
+// Checkpoint and resume (--checkpoint, --resume)
+//
+// Progress is an append-only journal of [u8 type][u32 length][payload]
+// records: R = root path, A = directory discovered, D = directory finished,
+// O = output file offset. A directory's A records for its children and its
+// own D record are committed together with its rows, and each checkpoint
+// appends everything committed since the last one followed by an O record.
+// Replaying up to the last O therefore yields the output offset and the
+// pending frontier (directories with more A than D records) at that point.
+// Checkpoints only hold out_m long enough to fflush and take the committed
+// records; the journal write and the sync happen outside the lock.
+//----------------------------------------------------------
+
+std::string checkpoint_path(const ScanContext &ctx)
+{
+    return ctx.OUTPUT_FILE + ".checkpoint";
+}
+
+void append_journal_record(std::string &out, char type, const void *data, uint32_t len)
+{
+    out += type;
+    out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    out.append(reinterpret_cast<const char *>(data), len);
+}
+
+void append_journal_path(std::string &out, char type, const std::wstring &path)
+{
+    append_journal_record(out, type, path.data(), (uint32_t)(path.size() * sizeof(wchar_t)));
+}
+
+// Starts a new journal with the root and the initial directory queue
+bool open_checkpoint(ScanContext &ctx)
+{
+    ctx.journal_fp = fopen(checkpoint_path(ctx).c_str(), "wb");
+    if (!ctx.journal_fp)
+        return false;
+
+    std::string records;
+    append_journal_path(records, 'R', ctx.ROOT_DIR);
+    std::queue<std::wstring> initial = ctx.dir_queue;
+    for (; !initial.empty(); initial.pop())
+        append_journal_path(records, 'A', initial.front());
+    fwrite(records.data(), 1, records.size(), ctx.journal_fp);
+    write_checkpoint(ctx);
+    return true;
+}
+
+// Appends the records committed since the last checkpoint and the current
+// output offset, then makes both files durable
+void write_checkpoint(ScanContext &ctx)
+{
+    std::string records;
+    long long offset;
+    {
+        std::lock_guard<std::mutex> lk_out(ctx.out_m);
+        fflush(ctx.out_fp);
+        offset = _ftelli64(ctx.out_fp);
+        records.swap(ctx.journal_committed);
+    }
+    _commit(_fileno(ctx.out_fp));
+
+    append_journal_record(records, 'O', &offset, sizeof(offset));
+    fwrite(records.data(), 1, records.size(), ctx.journal_fp);
+    fflush(ctx.journal_fp);
+    _commit(_fileno(ctx.journal_fp));
+    ctx.checkpoint_count++;
+}
+
+// Replays the journal, truncates the output and the journal to the last
+// complete checkpoint and queues the directories that were still pending
+bool load_checkpoint(ScanContext &ctx)
+{
+    std::string path = checkpoint_path(ctx);
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        std::cerr << "No checkpoint found at " << path << ".\n";
+        return false;
+    }
+
+    std::unordered_map<std::wstring, int> balance; // A records minus D records, settled ones erased
+    std::vector<std::pair<char, std::wstring>> since_offset;
+    long long output_offset = -1;
+    long long journal_end = 0;
+    bool root_ok = false;
+    for (;;)
+    {
+        char type;
+        uint32_t len;
+        if (fread(&type, 1, 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1)
+            break;
+        std::string payload(len, '\0');
+        if (len > 0 && fread(payload.data(), 1, len, fp) != len)
+            break; // Torn record at the tail
+
+        if (type == 'O' && len == sizeof(long long))
+        {
+            for (auto &op : since_offset)
+            {
+                int &b = balance[op.second];
+                b += op.first == 'A' ? 1 : -1;
+                if (b == 0)
+                    balance.erase(op.second);
+            }
+            since_offset.clear();
+            memcpy(&output_offset, payload.data(), sizeof(output_offset));
+            journal_end = _ftelli64(fp);
+        }
+        else
+        {
+            std::wstring p(len / sizeof(wchar_t), L'\0');
+            memcpy(p.data(), payload.data(), p.size() * sizeof(wchar_t));
+            if (type == 'R')
+                root_ok = (p == ctx.ROOT_DIR);
+            else
+                since_offset.emplace_back(type, std::move(p));
+        }
+    }
+    fclose(fp);
+
+    if (!root_ok || output_offset < 0)
+    {
+        std::cerr << "Checkpoint " << path << " is unusable or was written for a different --path.\n";
+        return false;
+    }
+
+    ctx.out_fp = fopen(ctx.OUTPUT_FILE.c_str(), "r+b");
+    ctx.journal_fp = fopen(path.c_str(), "r+b");
+    if (!ctx.out_fp || !ctx.journal_fp || _chsize_s(_fileno(ctx.out_fp), output_offset) != 0 ||
+        _chsize_s(_fileno(ctx.journal_fp), journal_end) != 0)
+    {
+        std::cerr << "Failed to reopen the output file or checkpoint for resuming.\n";
+        return false;
+    }
+    fseek(ctx.out_fp, 0, SEEK_END);
+    fseek(ctx.journal_fp, 0, SEEK_END);
+    remove(spill_path(ctx).c_str()); // A frontier spill left by the interrupted run is stale
+
+    for (auto &b : balance)
+    {
+        if (b.second > 0)
+        {
+            ctx.dir_queue.push(b.first);
+            ctx.pending_dirs++;
+            ctx.active_dir_count++;
+        }
+        else
+        {
+            // Its parent was still in progress, so the parent will rediscover it
+            ctx.resume_done.insert(b.first);
+        }
+    }
+    std::cout << "Resuming: " << ctx.dir_queue.size() << " directories pending, output at " << output_offset
+              << " bytes\n";
+    return true;
+}
+
+//----------------------------------------------------------
+// Subtree cost history (--history)
+//
+// A FIFO starts top-level directories in listing order, so a giant subtree
+// that happens to be listed last is started last and becomes the long tail
+// of the scan. Each scan records the time and entries below every top-level
+// directory; the next one seeds dir_queue most expensive first (longest
+// processing time first), giving the giants the whole scan to finish.
+//
+// The file uses the checkpoint journal's framing: an 'R' record with the root,
+// then one 'S' record per top-level directory holding ns, entries and dirs
+// as three long longs followed by the UTF-16 name.
+//----------------------------------------------------------
+
+static void write_history_record(FILE *fp, char type, const void *payload, uint32_t len)
+{
+    fwrite(&type, 1, 1, fp);
+    fwrite(&len, sizeof(len), 1, fp);
+    if (len > 0)
+        fwrite(payload, 1, len, fp);
+}
+
+// Reads ctx.HISTORY_FILE into ctx.history; false if there is none or it was
+// written for a different root
+bool load_history(ScanContext &ctx)
+{
+    ctx.history.clear();
+    FILE *fp = fopen(ctx.HISTORY_FILE.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    const uint32_t counts_len = 3 * sizeof(long long);
+    bool root_ok = false;
+    for (;;)
+    {
+        char type;
+        uint32_t len;
+        if (fread(&type, 1, 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1)
+            break;
+        std::string payload(len, '\0');
+        if (len > 0 && fread(payload.data(), 1, len, fp) != len)
+            break;
+
+        if (type == 'R')
+        {
+            std::wstring root(len / sizeof(wchar_t), L'\0');
+            memcpy(root.data(), payload.data(), root.size() * sizeof(wchar_t));
+            root_ok = (root == ctx.ROOT_DIR);
+            if (!root_ok)
+                break;
+        }
+        else if (type == 'S' && root_ok && len >= counts_len)
+        {
+            SubtreeCost cost;
+            memcpy(&cost.ns, payload.data(), sizeof(long long));
+            memcpy(&cost.entries, payload.data() + sizeof(long long), sizeof(long long));
+            memcpy(&cost.dirs, payload.data() + 2 * sizeof(long long), sizeof(long long));
+            std::wstring name((len - counts_len) / sizeof(wchar_t), L'\0');
+            memcpy(name.data(), payload.data() + counts_len, name.size() * sizeof(wchar_t));
+            ctx.history[name] = cost;
+        }
+    }
+    fclose(fp);
+
+    if (!root_ok)
+    {
+        std::cerr << "History " << ctx.HISTORY_FILE << " was written for a different --path; not used.\n";
+        ctx.history.clear();
+    }
+    return root_ok;
+}
+
+// Reorders the seeded dir_queue by recorded subtree time, most expensive
+// first. Directories new since the last scan are assumed to cost the mean.
+void order_by_history(ScanContext &ctx)
+{
+    if (!load_history(ctx) || ctx.history.empty())
+        return;
+
+    long long known_ns = 0;
+    for (const auto &h : ctx.history)
+        known_ns += h.second.ns;
+    long long mean_ns = known_ns / (long long)ctx.history.size();
+
+    std::vector<std::pair<long long, std::wstring>> seeds;
+    seeds.reserve(ctx.dir_queue.size());
+    size_t name_start = ctx.ROOT_DIR.size() + 1;
+    while (!ctx.dir_queue.empty())
+    {
+        std::wstring &dir = ctx.dir_queue.front();
+        auto it = ctx.history.find(dir.substr(std::min(name_start, dir.size())));
+        long long cost = mean_ns;
+        if (it != ctx.history.end())
+        {
+            cost = it->second.ns;
+            ctx.history_known++;
+        }
+        seeds.emplace_back(cost, std::move(dir));
+        ctx.dir_queue.pop();
+    }
+    // Stable, so ties keep listing order
+    std::stable_sort(seeds.begin(), seeds.end(), [](const std::pair<long long, std::wstring> &a,
+                                                    const std::pair<long long, std::wstring> &b)
+                     { return a.first > b.first; });
+    for (auto &s : seeds)
+        ctx.dir_queue.push(std::move(s.second));
+}
+
+// Adds one directory's cost to the top-level directory it lies under
+void charge_subtree(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, long long ns, long long entries, long long dirs)
+{
+    if (ctx.HISTORY_FILE.empty())
+        return;
+    size_t start = ctx.ROOT_DIR.size() + 1;
+    if (dir.size() <= start)
+        return;
+    size_t end = dir.find(L'\\', start);
+    ws.subtree_key.assign(dir, start, end == std::wstring::npos ? std::wstring::npos : end - start);
+    SubtreeCost &cost = ws.subtree_costs[ws.subtree_key];
+    cost.ns += ns;
+    cost.entries += entries;
+    cost.dirs += dirs;
+}
+
+// Every worker's subtree costs summed; call after the workers exit
+std::unordered_map<std::wstring, SubtreeCost> subtree_costs(const ScanContext &ctx)
+{
+    std::unordered_map<std::wstring, SubtreeCost> all;
+    for (const auto &worker : ctx.worker_subtree_costs)
+    {
+        for (const auto &c : worker)
+        {
+            SubtreeCost &cost = all[c.first];
+            cost.ns += c.second.ns;
+            cost.entries += c.second.entries;
+            cost.dirs += c.second.dirs;
+        }
+    }
+    return all;
+}
+
+// Replaces ctx.HISTORY_FILE with this scan's costs. Written beside it and
+// renamed, so an interrupted write leaves the previous history intact.
+bool save_history(const ScanContext &ctx)
+{
+    std::string tmp = ctx.HISTORY_FILE + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+    write_history_record(fp, 'R', ctx.ROOT_DIR.data(), (uint32_t)(ctx.ROOT_DIR.size() * sizeof(wchar_t)));
+    std::string payload;
+    for (const auto &c : subtree_costs(ctx))
+    {
+        payload.resize(3 * sizeof(long long) + c.first.size() * sizeof(wchar_t));
+        memcpy(&payload[0], &c.second.ns, sizeof(long long));
+        memcpy(&payload[sizeof(long long)], &c.second.entries, sizeof(long long));
+        memcpy(&payload[2 * sizeof(long long)], &c.second.dirs, sizeof(long long));
+        memcpy(&payload[3 * sizeof(long long)], c.first.data(), c.first.size() * sizeof(wchar_t));
+        write_history_record(fp, 'S', payload.data(), (uint32_t)payload.size());
+    }
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || !MoveFileExA(tmp.c_str(), ctx.HISTORY_FILE.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------
+// Sorted output (--sorted)
+//
+// In sorted mode a worker's output buffer holds framed records instead of
+// text. When it fills, the worker sorts it in place and spills it as a run
+// file, so every core sorts its own runs in parallel. After the scan the runs
+// are k-way merged into the output, in several passes if there are more than
+// MERGE_FAN_IN of them.
+//----------------------------------------------------------
+
+// Orders two path fields by the paths they hold. With --columns a path with
+// a comma is written CSV-quoted, so the quoting is undone while comparing;
+// otherwise "C:\a,b" would sort before C:\a and apart from path-only output.
+int compare_path_keys(const char *a, uint32_t a_len, const char *b, uint32_t b_len)
+{
+    bool a_quoted = a_len >= 2 && a[0] == '"';
+    bool b_quoted = b_len >= 2 && b[0] == '"';
+    if (!a_quoted && !b_quoted)
+    {
+        int c = memcmp(a, b, std::min(a_len, b_len));
+        if (c != 0)
+            return c;
+        return a_len == b_len ? 0 : (a_len < b_len ? -1 : 1);
+    }
+
+    // Skip the enclosing quotes; inside them a doubled quote stands for one
+    const char *pa = a + a_quoted, *a_end = a + a_len - a_quoted;
+    const char *pb = b + b_quoted, *b_end = b + b_len - b_quoted;
+    for (;;)
+    {
+        if (pa == a_end || pb == b_end)
+            return (pa == a_end) == (pb == b_end) ? 0 : (pa == a_end ? -1 : 1);
+        unsigned char ca = (unsigned char)*pa++, cb = (unsigned char)*pb++;
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+        if (ca == '"')
+        {
+            // Only quoted fields contain quotes, so both are doubled
+            pa++;
+            pb++;
+        }
+    }
+}
+
+// Orders records by path field, then by the whole line so the order is total
+int compare_records(const char *a_line, uint32_t a_key, uint32_t a_len, const char *b_line, uint32_t b_key,
+                    uint32_t b_len)
+{
+    int c = compare_path_keys(a_line, a_key, b_line, b_key);
+    if (c != 0)
+        return c;
+    c = memcmp(a_line, b_line, std::min(a_len, b_len));
+    if (c != 0)
+        return c;
+    return a_len == b_len ? 0 : (a_len < b_len ? -1 : 1);
+}
+
+std::string make_run_path(ScanContext &ctx)
+{
+    std::string base = ctx.SORT_TEMP_DIR.empty() ? ctx.OUTPUT_FILE : ctx.SORT_TEMP_DIR + "\\" + "sorted";
+    return base + ".run" + std::to_string(ctx.next_run_id.fetch_add(1)) + ".tmp";
+}
+
+// Sorts the framed records in a worker buffer and writes them as one run file
+void spill_sorted_run(ScanContext &ctx, std::string &buffer)
+{
+    if (buffer.empty())
+        return;
+
+    std::vector<size_t> offsets;
+    for (size_t pos = 0; pos < buffer.size();)
+    {
+        uint32_t header[2];
+        memcpy(header, buffer.data() + pos, sizeof(header));
+        offsets.push_back(pos);
+        pos += sizeof(header) + header[1];
+    }
+
+    const char *base = buffer.data();
+    std::sort(offsets.begin(), offsets.end(), [base](size_t a, size_t b)
+              {
+                  uint32_t ha[2], hb[2];
+                  memcpy(ha, base + a, sizeof(ha));
+                  memcpy(hb, base + b, sizeof(hb));
+                  return compare_records(base + a + sizeof(ha), ha[0], ha[1], base + b + sizeof(hb), hb[0], hb[1]) < 0;
+              });
+
+    std::string path = make_run_path(ctx);
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp)
+    {
+        std::cerr << "Failed to create sorted run file " << path << "\n";
+        ctx.sort_failed.store(true);
+        buffer.clear();
+        return;
+    }
+    for (size_t off : offsets)
+    {
+        uint32_t header[2];
+        memcpy(header, base + off, sizeof(header));
+        fwrite(base + off, 1, sizeof(header) + header[1], fp);
+    }
+    fclose(fp);
+
+    {
+        std::lock_guard<std::mutex> lk(ctx.run_m);
+        ctx.run_files.push_back(path);
+    }
+    ctx.output_flush_count.fetch_add(1, std::memory_order_relaxed);
+    buffer.clear();
+}
+
+bool read_run_record(RunReader &r)
+{
+    uint32_t header[2];
+    if (fread(header, sizeof(header), 1, r.fp) != 1)
+        return false;
+    r.key_len = header[0];
+    r.line.resize(header[1]);
+    return header[1] == 0 || fread(r.line.data(), 1, header[1], r.fp) == header[1];
+}
+
+// Merges sorted run files into out. Intermediate passes keep the framing;
+// the final pass writes plain lines.
+bool merge_runs(const std::vector<std::string> &inputs, FILE *out, bool framed)
+{
+    std::vector<RunReader> readers(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        readers[i].fp = fopen(inputs[i].c_str(), "rb");
+        if (!readers[i].fp)
+        {
+            std::cerr << "Failed to open sorted run file " << inputs[i] << "\n";
+            for (auto &r : readers)
+                if (r.fp)
+                    fclose(r.fp);
+            return false;
+        }
+        setvbuf(readers[i].fp, NULL, _IOFBF, 256 * 1024);
+    }
+
+    auto greater = [&readers](size_t a, size_t b)
+    {
+        const RunReader &ra = readers[a], &rb = readers[b];
+        return compare_records(ra.line.data(), ra.key_len, (uint32_t)ra.line.size(), rb.line.data(), rb.key_len,
+                               (uint32_t)rb.line.size()) > 0;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        if (read_run_record(readers[i]))
+            heap.push(i);
+    }
+
+    std::string out_buf;
+    out_buf.reserve(1 << 20);
+    while (!heap.empty())
+    {
+        size_t i = heap.top();
+        heap.pop();
+        RunReader &r = readers[i];
+        if (framed)
+        {
+            uint32_t header[2] = {r.key_len, (uint32_t)r.line.size()};
+            out_buf.append(reinterpret_cast<const char *>(header), sizeof(header));
+        }
+        out_buf += r.line;
+        if (out_buf.size() >= (1 << 20))
+        {
+            fwrite(out_buf.data(), 1, out_buf.size(), out);
+            out_buf.clear();
+        }
+        if (read_run_record(r))
+            heap.push(i);
+    }
+    fwrite(out_buf.data(), 1, out_buf.size(), out);
+
+    for (auto &r : readers)
+        fclose(r.fp);
+    return true;
+}
+
+// Reduces the spilled runs to at most MERGE_FAN_IN (merging groups in
+// parallel) and then merges those into the output file
+bool merge_sorted_runs(ScanContext &ctx)
+{
+    std::vector<std::string> runs = std::move(ctx.run_files);
+    bool ok = !ctx.sort_failed.load();
+
+    while (ok && runs.size() > MERGE_FAN_IN)
+    {
+        size_t groups = (runs.size() + MERGE_FAN_IN - 1) / MERGE_FAN_IN;
+        std::vector<std::string> next(groups);
+        std::vector<char> group_ok(groups, 1);
+        std::atomic<size_t> next_group{0};
+        std::vector<std::thread> mergers;
+        for (int t = 0; t < std::min<int>(HARDWARE_THREADS, (int)groups); t++)
+        {
+            mergers.emplace_back([&]
+                                 {
+                for (size_t g; (g = next_group.fetch_add(1)) < groups;)
+                {
+                    std::vector<std::string> inputs(runs.begin() + g * MERGE_FAN_IN,
+                                                    runs.begin() + std::min(runs.size(), (g + 1) * MERGE_FAN_IN));
+                    next[g] = make_run_path(ctx);
+                    FILE *fp = fopen(next[g].c_str(), "wb");
+                    group_ok[g] = fp && merge_runs(inputs, fp, true);
+                    if (fp)
+                        fclose(fp);
+                    for (const auto &in : inputs)
+                        remove(in.c_str());
+                } });
+        }
+        for (auto &m : mergers)
+            m.join();
+        runs = std::move(next);
+        ok = std::all_of(group_ok.begin(), group_ok.end(), [](char v)
+                         { return v != 0; });
+    }
+
+    if (ok)
+    {
+        ok = merge_runs(runs, ctx.out_fp, false);
+    }
+    for (const auto &run : runs)
+        remove(run.c_str());
+    return ok;
+}
+
+// Writes a FILETIME as an ISO 8601 UTC timestamp (YYYY-MM-DDTHH:MM:SSZ)
+void format_modified(unsigned long long filetime, std::string &out)
+{
+    // Seconds since 1970-01-01, then days-to-civil (Howard Hinnant's algorithm)
+    long long secs = (long long)(filetime / 10000000ULL) - 11644473600LL;
+    long long days = secs >= 0 ? secs / 86400 : (secs - 86399) / 86400;
+    long long tod = secs - days * 86400;
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = (unsigned)(days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long year = (long long)yoe + era * 400;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned day = doy - (153 * mp + 2) / 5 + 1;
+    unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    if (month <= 2)
+        year++;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%04lld-%02u-%02uT%02lld:%02lld:%02lldZ", year, month, day,
+                       tod / 3600, (tod / 60) % 60, tod % 60);
+    out.append(buf, len);
+}
+
+// Builds one output line for a file. With --sorted the line is preceded by
+// its [key_len][line_len] frame for the run merge; the key is the path field
+// as written, quotes included, and compare_path_keys looks through them.
+void format_record(const ScanContext &ctx, const std::string &utf8_path, const DirEntry &entry, std::string &record)
+{
+    record.clear();
+    if (ctx.SORTED)
+    {
+        // Room for the frame, filled in below
+        record.append(2 * sizeof(uint32_t), '\0');
+    }
+    size_t line_start = record.size();
+    size_t key_len = 0;
+    if (ctx.columns.empty())
+    {
+        // Path-only output is written unquoted, as it always has been
+        record += utf8_path;
+        key_len = record.size() - line_start;
+    }
+    else
+    {
+        append_csv_field(utf8_path, record);
+        key_len = record.size() - line_start;
+        for (Column c : ctx.columns)
+        {
+            record += ',';
+            switch (c)
+            {
+            case Column::Size:
+            {
+                char buf[24];
+                record.append(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long)entry.size));
+                break;
+            }
+            case Column::Modified:
+                format_modified(entry.modified, record);
+                break;
+            case Column::Attributes:
+                format_attributes(entry.attributes, record);
+                break;
+            }
+        }
+    }
+    record += '\n';
+    if (ctx.SORTED)
+    {
+        uint32_t header[2] = {(uint32_t)key_len, (uint32_t)(record.size() - line_start)};
+        memcpy(record.data(), header, sizeof(header));
+    }
+}
+
+// Writes attributes as attrib-style letters, e.g. "RA" for read-only + archive
+void format_attributes(DWORD attributes, std::string &out)
+{
+    static const struct
+    {
+        DWORD flag;
+        char letter;
+    } flags[] = {
+        {FILE_ATTRIBUTE_READONLY, 'R'},
+        {FILE_ATTRIBUTE_HIDDEN, 'H'},
+        {FILE_ATTRIBUTE_SYSTEM, 'S'},
+        {FILE_ATTRIBUTE_ARCHIVE, 'A'},
+        {FILE_ATTRIBUTE_COMPRESSED, 'C'},
+        {FILE_ATTRIBUTE_ENCRYPTED, 'E'},
+        {FILE_ATTRIBUTE_TEMPORARY, 'T'},
+        {FILE_ATTRIBUTE_OFFLINE, 'O'},
+        {FILE_ATTRIBUTE_REPARSE_POINT, 'L'},
+    };
+    for (const auto &f : flags)
+    {
+        if (attributes & f.flag)
+            out += f.letter;
+    }
+}
+
+// dir + '\\' + name into out, reusing out's capacity
+void join_path(const std::wstring &dir, const wchar_t *name, size_t name_len, std::wstring &out)
+{
+    out.reserve(dir.size() + 1 + name_len);
+    out.assign(dir).append(1, L'\\').append(name, name_len);
+}
+
+// --prefix test on a subdirectory path (a substring match, as it always has been)
+bool prefix_matches(const ScanContext &ctx, const std::wstring &path)
+{
+    return ctx.PREFIX.empty() || path.find(ctx.PREFIX) != std::wstring::npos;
+}
+
+// --filetypes test on a file name. Names without a dot never match.
+bool extension_matches(const ScanContext &ctx, const wchar_t *name, size_t name_len)
+{
+    if (ctx.file_types.empty())
+        return true;
+    size_t dot = name_len;
+    while (dot > 0 && name[dot - 1] != L'.')
+        dot--;
+    if (dot == 0)
+        return false;
+    const wchar_t *ext = name + dot;
+    size_t ext_len = name_len - dot;
+    for (const auto &type : ctx.file_types)
+    {
+        if (type.size() == ext_len && _wcsnicmp(ext, type.c_str(), ext_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// UTF-16 to UTF-8 into out, reusing out's capacity. False on failure or
+// empty input.
+bool utf16_to_utf8(const wchar_t *text, size_t len, std::string &out)
+{
+    int utf8_len = WideCharToMultiByte(CP_UTF8, 0, text, (int)len, NULL, 0, NULL, NULL);
+    if (utf8_len <= 0)
+        return false;
+    out.resize(utf8_len);
+    WideCharToMultiByte(CP_UTF8, 0, text, (int)len, out.data(), utf8_len, NULL, NULL);
+    return true;
+}
+
+// Appends a CSV field, quoting it if it contains a comma, quote or newline
+void append_csv_field(const std::string &field, std::string &out)
+{
+    if (field.find_first_of(",\"\r\n") == std::string::npos)
+    {
+        out += field;
+        return;
+    }
+    out += '"';
+    for (char c : field)
+    {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+std::string csv_header(const ScanContext &ctx)
+{
+    std::string header = "File Path";
+    for (Column c : ctx.columns)
+    {
+        switch (c)
+        {
+        case Column::Size:
+            header += ",Size";
+            break;
+        case Column::Modified:
+            header += ",Modified";
+            break;
+        case Column::Attributes:
+            header += ",Attributes";
+            break;
+        }
+    }
+    return header + "\n";
+}
+
+// Handles one directory entry: queues subdirectories and writes matching
+// files to the output buffer
+void process_entry(ScanContext &ctx, const std::wstring &dir, const DirEntry &entry, WorkerState &ws)
+{
+    const wchar_t *name = entry.name;
+    size_t name_len = entry.name_len;
+    if ((entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+    {
+        // Skip '.' and '..'
+        if (name[0] == L'.' && (name_len == 1 || (name_len == 2 && name[1] == L'.')))
+        {
+            return;
+        }
+
+        std::wstring subdir;
+        join_path(dir, name, name_len, subdir);
+        // Check prefix if specified
+        if (!prefix_matches(ctx, subdir))
+        {
+            return;
+        }
+
+        if (ws.shard_filter_dirs && !shard_owns(ctx, subdir))
+            return;
+
+        push_directory(ctx, ws, std::move(subdir));
+    }
+    else if (!ws.shard_skip_files)
+    {
+        // Classify once against all queries before building the path
+        uint64_t query_mask = 0;
+        if (!ctx.queries.empty())
+        {
+            query_mask = match_queries(ctx, ws.dir_mask, name, name_len);
+            if (query_mask == 0)
+                return;
+        }
+
+        // File extension filtering
+        if (ctx.queries.empty() && !extension_matches(ctx, name, name_len))
+            return;
+
+        std::wstring full_path;
+        join_path(dir, name, name_len, full_path);
+
+        if (ctx.entry_sink)
+        {
+            if (claim_result(ctx))
+                add_batch_entry(ctx, ws, full_path, name_len, entry);
+            return;
+        }
+
+        // Convert to UTF-8 and add to output buffer. A result slot is only
+        // taken once the path converted, so unconvertible names don't use up --limit
+        thread_local std::string utf8_path;
+        thread_local std::string record;
+        if (utf16_to_utf8(full_path.c_str(), full_path.size(), utf8_path))
+        {
+            if (!claim_result(ctx))
+                return;
+
+            format_record(ctx, utf8_path, entry, record);
+
+            if (query_mask != 0)
+                append_query_outputs(ctx, ws, query_mask, record);
+            else if (ws.stage_rows)
+                stage_row(ctx, *ws.stage_rows, record);
+            else
+                append_output(ctx, ws, record.data(), record.size());
+
+            ctx.file_count.fetch_add(1, std::memory_order_relaxed);
+            ws.counters.files++;
+            ws.unpublished_bytes += (long long)entry.size;
+            ws.counters.bytes += (long long)record.size();
+        }
+        else
+        {
+            // Log the error or handle the file path gracefully
+            std::cerr << "Error converting file path to UTF-8: " << GetLastError() << "\n";
+        }
+    }
+}
+
+DirEntry make_dir_entry(const FILE_ID_BOTH_DIR_INFO *info)
+{
+    DirEntry entry;
+    entry.name = info->FileName;
+    entry.name_len = info->FileNameLength / sizeof(WCHAR);
+    entry.attributes = info->FileAttributes;
+    entry.size = (unsigned long long)info->EndOfFile.QuadPart;
+    entry.modified = (unsigned long long)info->LastWriteTime.QuadPart;
+    entry.file_id = (unsigned long long)info->FileId.QuadPart;
+    return entry;
+}
+
+void hold_entry(HeldEntries &held, const DirEntry &entry)
+{
+    held.entries.push_back({held.names.size(), entry.name_len, entry.attributes, entry.size, entry.modified,
+                            entry.file_id});
+    held.names.append(entry.name, entry.name_len);
+}
+
+// Handles held entries in the order they were held, then empties held
+void handle_held_entries(ScanContext &ctx, const std::wstring &dir, HeldEntries &held, WorkerState &ws)
+{
+    for (const auto &h : held.entries)
+    {
+        DirEntry entry;
+        entry.name = held.names.data() + h.name_offset;
+        entry.name_len = h.name_len;
+        entry.attributes = h.attributes;
+        entry.size = h.size;
+        entry.modified = h.modified;
+        entry.file_id = h.file_id;
+        process_entry(ctx, dir, entry, ws);
+        if (ctx.cancel_token.cancelled())
+            break;
+    }
+    held.names.clear();
+    held.entries.clear();
+}
+
+// Sorts held entries by file ID and handles them. On NTFS the file ID is the
+// MFT record number, so subdirectories are later opened in on-disk order
+// instead of hopping across the MFT in name order.
+void process_held_entries(ScanContext &ctx, const std::wstring &dir, HeldEntries &held, WorkerState &ws)
+{
+    std::sort(held.entries.begin(), held.entries.end(), [](const HeldEntries::Held &a, const HeldEntries::Held &b)
+              { return a.file_id < b.file_id; });
+    handle_held_entries(ctx, dir, held, ws);
+}
+
+//----------------------------------------------------------
+// Splitting huge directories (--split-entries)
+//
+// A listing is read by one thread, but the per-entry work (filtering, path
+// building, UTF-8 conversion, formatting, queueing subdirectories) need not
+// be. Past SPLIT_ENTRIES entries the listing thread packs entries into
+// chunks and hands each full chunk to an idle worker, or handles it itself
+// when nobody is idle. With --checkpoint a directory's rows are staged
+// until it completes, so directories are not split then.
+//----------------------------------------------------------
+
+void add_to_chunk(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, const DirEntry &entry)
+{
+    if (!ws.chunk)
+        ws.chunk.reset(new EntryChunk());
+    if (ws.chunk->held.entries.empty())
+    {
+        ws.chunk->dir = dir;
+        ws.chunk->dir_mask = ws.dir_mask;
+    }
+    hold_entry(ws.chunk->held, entry);
+    if (ws.chunk->held.entries.size() >= SPLIT_CHUNK_ENTRIES)
+        share_chunk(ctx, ws);
+}
+
+// Queues ws.chunk if a worker is idle with no chunk already waiting for it;
+// otherwise handles it on this thread
+void share_chunk(ScanContext &ctx, WorkerState &ws)
+{
+    bool shared = false;
+    {
+        TimedLock lk(ctx.q_m, ws.counters.queue_wait_ns, ws.trace);
+        if ((size_t)ctx.idle_workers.load() > ctx.entry_chunks.size())
+        {
+            ctx.entry_chunks.push_back(std::move(ws.chunk));
+            ctx.active_dir_count++;
+            shared = true;
+        }
+    }
+    if (shared)
+    {
+        ctx.chunks_shared.fetch_add(1, std::memory_order_relaxed);
+        ctx.q_cv.notify_one();
+        return;
+    }
+    process_entry_chunk(ctx, ws, *ws.chunk);
+}
+
+void process_entry_chunk(ScanContext &ctx, WorkerState &ws, EntryChunk &chunk)
+{
+    uint64_t dir_mask = ws.dir_mask;
+    ws.dir_mask = chunk.dir_mask;
+    handle_held_entries(ctx, chunk.dir, chunk.held, ws);
+    ws.dir_mask = dir_mask;
+}
+
+// Handles the chunk next_directory handed out and retires it
+void process_taken_chunk(ScanContext &ctx, WorkerState &ws)
+{
+    long long start = now_ns();
+    long long entries = (long long)ws.taken_chunk->held.entries.size();
+    enter_shard_directory(ctx, ws, ws.taken_chunk->dir);
+    process_entry_chunk(ctx, ws, *ws.taken_chunk);
+    long long ns = now_ns() - start;
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_CHUNK, start, ns, entries, &ws.taken_chunk->dir);
+    charge_subtree(ctx, ws, ws.taken_chunk->dir, ns, 0, 0);
+    ws.taken_chunk.reset();
+    if (ws.unpublished_bytes != 0)
+    {
+        ctx.file_bytes.fetch_add(ws.unpublished_bytes, std::memory_order_relaxed);
+        ws.unpublished_bytes = 0;
+    }
+    ctx.active_dir_count--;
+}
+
+//----------------------------------------------------------
+// Directory backends (--io-backend=find, --io-backend=simulated)
+//
+// The synchronous listing path sees only DirectoryBackend: open a directory,
+// read batches of DirEntry, close it. The find backend wraps FindFirstFileExW,
+// or GetFileInformationByHandleEx with --inode-order since only that returns
+// file IDs. The simulated backend serves a generated tree from memory and
+// blocks on every call for a configurable, jittered time, so scheduling can
+// be tuned for network-share latencies without a network share.
+//----------------------------------------------------------
+
+bool win32_stat(const std::wstring &path, DirEntry &out)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data))
+        return false;
+    out.name = nullptr;
+    out.name_len = 0;
+    out.attributes = data.dwFileAttributes;
+    out.size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    out.modified = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    out.file_id = 0;
+    return true;
+}
+
+// FindFirstFileExW/FindNextFileW, one entry per read. FindNextFileW is
+// usually answered from a batch the system already fetched, so --max-iops
+// charges one read per IOPS_ENTRIES_PER_READ entries rather than per call.
+struct FindBackend : DirectoryBackend
+{
+    struct Listing
+    {
+        HANDLE handle;
+        WIN32_FIND_DATAW fdata;
+        bool pending;      // fdata holds an entry not yet returned
+        std::wstring name; // The returned entry's name; FindNextFileW overwrites fdata
+    };
+
+    long long entries_per_io() const override { return IOPS_ENTRIES_PER_READ; }
+
+    void *open_directory(const std::wstring &dir) override
+    {
+        Listing *l = new Listing();
+        std::wstring search_pattern = dir + L"\\*";
+        l->handle = FindFirstFileExW(search_pattern.c_str(), FindExInfoBasic, &l->fdata, FindExSearchNameMatch, NULL,
+                                     FIND_FIRST_EX_LARGE_FETCH);
+        if (l->handle == INVALID_HANDLE_VALUE)
+        {
+            delete l;
+            return nullptr;
+        }
+        l->pending = true;
+        return l;
+    }
+
+    bool read_batch(void *listing, std::vector<DirEntry> &batch) override
+    {
+        Listing *l = static_cast<Listing *>(listing);
+        batch.clear();
+        if (!l->pending)
+            return false;
+        const WIN32_FIND_DATAW &fdata = l->fdata;
+        l->name.assign(fdata.cFileName);
+        DirEntry entry;
+        entry.name = l->name.c_str();
+        entry.name_len = l->name.size();
+        entry.attributes = fdata.dwFileAttributes;
+        entry.size = ((unsigned long long)fdata.nFileSizeHigh << 32) | fdata.nFileSizeLow;
+        entry.modified = ((unsigned long long)fdata.ftLastWriteTime.dwHighDateTime << 32) | fdata.ftLastWriteTime.dwLowDateTime;
+        entry.file_id = 0;
+        batch.push_back(entry);
+        l->pending = FindNextFileW(l->handle, &l->fdata) != FALSE;
+        return l->pending;
+    }
+
+    void close_directory(void *listing) override
+    {
+        Listing *l = static_cast<Listing *>(listing);
+        FindClose(l->handle);
+        delete l;
+    }
+
+    bool stat(const std::wstring &path, DirEntry &out) override { return win32_stat(path, out); }
+};
+
+// GetFileInformationByHandleEx, one 64 KB batch of FILE_ID_BOTH_DIR_INFO per
+// read. Used for --inode-order, which needs the file IDs.
+struct HandleBackend : DirectoryBackend
+{
+    struct Listing
+    {
+        HANDLE handle;
+        FILE_INFO_BY_HANDLE_CLASS info_class = FileIdBothDirectoryRestartInfo;
+        std::unique_ptr<unsigned char[]> buffer{new unsigned char[ASYNC_BATCH_BYTES]};
+    };
+
+    void *open_directory(const std::wstring &dir) override
+    {
+        HANDLE h = CreateFileW(dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+        if (h == INVALID_HANDLE_VALUE)
+            return nullptr;
+        Listing *l = new Listing();
+        l->handle = h;
+        return l;
+    }
+
+    bool read_batch(void *listing, std::vector<DirEntry> &batch) override
+    {
+        Listing *l = static_cast<Listing *>(listing);
+        batch.clear();
+        if (!GetFileInformationByHandleEx(l->handle, l->info_class, l->buffer.get(), ASYNC_BATCH_BYTES))
+            return false;
+        l->info_class = FileIdBothDirectoryInfo;
+        const unsigned char *p = l->buffer.get();
+        for (;;)
+        {
+            const FILE_ID_BOTH_DIR_INFO *info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(p);
+            batch.push_back(make_dir_entry(info));
+            if (info->NextEntryOffset == 0)
+                break;
+            p += info->NextEntryOffset;
+        }
+        return true;
+    }
+
+    void close_directory(void *listing) override
+    {
+        Listing *l = static_cast<Listing *>(listing);
+        CloseHandle(l->handle);
+        delete l;
+    }
+
+    bool stat(const std::wstring &path, DirEntry &out) override { return win32_stat(path, out); }
+};
+
+// FNV-1a over the UTF-16 code units, so a simulated directory's contents
+// depend only on its path
+uint64_t hash_path(const std::wstring &path)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (wchar_t c : path)
+    {
+        h ^= (uint64_t)c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+// Blocks the calling thread for ns, as a call waiting on the network would.
+// Sleep() rounds up to the 1-15.6 ms timer tick, so a high-resolution
+// waitable timer (Windows 10 1803 and later) is used where available.
+void simulated_wait(long long ns)
+{
+    struct Timer
+    {
+        HANDLE h = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        ~Timer()
+        {
+            if (h)
+                CloseHandle(h);
+        }
+    };
+    thread_local Timer timer;
+    if (timer.h)
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -(ns / 100); // Relative, in 100 ns units
+        if (SetWaitableTimer(timer.h, &due, 0, NULL, NULL, FALSE))
+        {
+            WaitForSingleObject(timer.h, INFINITE);
+            return;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+}
+
+// A tree of SIM_DEPTH levels with SIM_FANOUT subdirectories per directory
+// and SIM_FILES files in every directory below the root, the same shape
+// tree-generator builds. Contents are generated from the path on each open,
+// so the tree costs no memory. Every call blocks for its base latency times
+// a lognormal factor with median 1 and sigma SIM_JITTER.
+struct SimulatedBackend : DirectoryBackend
+{
+    struct Listing
+    {
+        std::vector<std::wstring> names;
+        std::vector<DirEntry> entries;
+        size_t next = 0;
+    };
+
+    std::wstring root;
+    int depth, fanout, files;
+    long long open_ns, read_ns, close_ns;
+    double jitter;
+
+    SimulatedBackend(const ScanContext &ctx)
+        : root(ctx.ROOT_DIR), depth(ctx.SIM_DEPTH), fanout(ctx.SIM_FANOUT), files(ctx.SIM_FILES),
+          open_ns((long long)(ctx.SIM_OPEN_MS * 1e6)), read_ns((long long)(ctx.SIM_READ_MS * 1e6)),
+          close_ns((long long)(ctx.SIM_CLOSE_MS * 1e6)), jitter(ctx.SIM_JITTER)
+    {
+    }
+
+    void delay(long long ns)
+    {
+        if (ns <= 0)
+            return;
+        thread_local std::mt19937_64 rng(std::random_device{}());
+        std::normal_distribution<double> normal(0.0, 1.0);
+        simulated_wait((long long)(ns * std::exp(jitter * normal(rng))));
+    }
+
+    // Levels below the root, or -1 if dir is outside the tree
+    int depth_of(const std::wstring &dir)
+    {
+        if (dir.compare(0, root.size(), root) != 0 || (dir.size() > root.size() && dir[root.size()] != L'\\'))
+            return -1;
+        int d = (int)std::count(dir.begin() + root.size(), dir.end(), L'\\');
+        return d <= depth ? d : -1;
+    }
+
+    void generate(const std::wstring &dir, int level, Listing &l)
+    {
+        static const wchar_t *EXTENSIONS[] = {L"txt", L"docx", L"pdf", L"xlsx", L"jpg", L"png", L"zip", L"log"};
+        std::mt19937_64 rng(hash_path(dir));
+        std::uniform_int_distribution<int> length(6, 20);
+        std::uniform_int_distribution<int> letter(0, 25);
+        std::uniform_int_distribution<int> ext(0, sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]) - 1);
+        std::uniform_int_distribution<int> size_bits(8, 24);
+
+        int dir_count = level < depth ? fanout : 0;
+        int file_count = level > 0 ? files : 0;
+        for (int i = 0; i < dir_count + file_count; i++)
+        {
+            std::wstring name;
+            for (int n = length(rng); n > 0; n--)
+                name += (wchar_t)(L'a' + letter(rng));
+            // The index keeps names unique within the directory
+            name += L"_" + std::to_wstring(i);
+            if (i >= dir_count)
+                name += std::wstring(L".") + EXTENSIONS[ext(rng)];
+            l.names.push_back(std::move(name));
+        }
+        l.entries.resize(l.names.size());
+        for (size_t i = 0; i < l.names.size(); i++)
+        {
+            DirEntry &e = l.entries[i];
+            e.name = l.names[i].c_str();
+            e.name_len = l.names[i].size();
+            e.attributes = (int)i < dir_count ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+            e.size = (int)i < dir_count ? 0 : rng() & ((1ull << size_bits(rng)) - 1);
+            // Within the four years from 2020-01-01
+            e.modified = 132223104000000000ull + rng() % (4ull * 365 * 86400 * 10000000ull);
+            e.file_id = rng() >> 16;
+        }
+    }
+
+    void *open_directory(const std::wstring &dir) override
+    {
+        delay(open_ns);
+        int level = depth_of(dir);
+        if (level < 0)
+            return nullptr;
+        Listing *l = new Listing();
+        generate(dir, level, *l);
+        return l;
+    }
+
+    bool read_batch(void *listing, std::vector<DirEntry> &batch) override
+    {
+        Listing *l = static_cast<Listing *>(listing);
+        delay(read_ns);
+        size_t n = std::min<size_t>(IOPS_ENTRIES_PER_READ, l->entries.size() - l->next);
+        batch.assign(l->entries.begin() + l->next, l->entries.begin() + l->next + n);
+        l->next += n;
+        return l->next < l->entries.size();
+    }
+
+    void close_directory(void *listing) override
+    {
+        delay(close_ns);
+        delete static_cast<Listing *>(listing);
+    }
+
+    bool stat(const std::wstring &path, DirEntry &out) override
+    {
+        delay(open_ns);
+        out = DirEntry();
+        if (path == root)
+        {
+            out.attributes = FILE_ATTRIBUTE_DIRECTORY;
+            return true;
+        }
+        size_t slash = path.rfind(L'\\');
+        int level = slash == std::wstring::npos ? -1 : depth_of(path.substr(0, slash));
+        if (level < 0)
+            return false;
+        Listing l;
+        generate(path.substr(0, slash), level, l);
+        for (const DirEntry &e : l.entries)
+        {
+            if (path.compare(slash + 1, std::wstring::npos, e.name, e.name_len) == 0)
+            {
+                out = e;
+                out.name = nullptr;
+                out.name_len = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Picks the backend for the synchronous paths unless one is already set
+void create_directory_backend(ScanContext &ctx)
+{
+    if (ctx.backend)
+        return;
+    if (ctx.SIMULATED_IO)
+        ctx.backend = std::make_shared<SimulatedBackend>(ctx);
+    else if (ctx.INODE_ORDER)
+        ctx.backend = std::make_shared<HandleBackend>();
+    else
+        ctx.backend = std::make_shared<FindBackend>();
+}
+
+// Processes a single directory: finds subdirectories (pushing them to queue)
+// and files (writing them to output if they match conditions)
+void process_directory(ScanContext &ctx, const std::wstring &dir, WorkerState &ws)
+{
+    if (ctx.cancel_token.cancelled())
+    {
+        drop_directory(ctx);
+        return;
+    }
+
+    if (ws.trace)
+    {
+        long long start = now_ns();
+        long long entries_before = ws.counters.entries;
+        process_directory_listing(ctx, dir, ws);
+        trace_event(ws.trace, TRACE_DIRECTORY, start, now_ns() - start, ws.counters.entries - entries_before, &dir);
+        return;
+    }
+    process_directory_listing(ctx, dir, ws);
+}
+
+// Lists one directory through ctx.backend. With --inode-order the entries
+// are held until the listing is complete and then handled in file ID order.
+void process_directory_listing(ScanContext &ctx, const std::wstring &dir, WorkerState &ws)
+{
+    if (!ctx.queries.empty())
+        ws.dir_mask = directory_query_mask(ctx, dir);
+    enter_shard_directory(ctx, ws, dir);
+
+    throttle(ctx, ctx.dirs_bucket, 1.0);
+    throttle(ctx, ctx.iops_bucket, 1.0);
+
+    DirectoryBackend &backend = *ctx.backend;
+    long long open_start = now_ns();
+    void *listing = backend.open_directory(dir);
+    long long open_ns = now_ns() - open_start;
+    ctx.open_count.fetch_add(1, std::memory_order_relaxed);
+    ctx.open_ns.fetch_add(open_ns, std::memory_order_relaxed);
+    ws.counters.enumerate_ns += open_ns;
+    record_latency(ws, LATENCY_OPEN, open_ns);
+    ws.dir_latency = DirLatency();
+    ws.dir_latency.open_ns = open_ns;
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_OPEN, open_start, open_ns, 0, nullptr);
+
+    if (!listing)
+    {
+        finish_directory(ctx, ws, dir, ws.dir_rows, ws.dir_journal);
+        return;
+    }
+
+    thread_local std::vector<DirEntry> batch;
+    thread_local HeldEntries held;
+    long long entries = 0;
+    // Rows staged per directory for --checkpoint must all come from this thread
+    long long split_after = ctx.INODE_ORDER || ws.stage_rows || ctx.SPLIT_ENTRIES <= 0 ? -1 : ctx.SPLIT_ENTRIES;
+    long long entries_per_io = backend.entries_per_io();
+    bool more = true;
+    while (more)
+    {
+        if (entries_per_io == 0)
+            throttle(ctx, ctx.iops_bucket, 1.0);
+        long long read_start = now_ns();
+        more = backend.read_batch(listing, batch);
+        long long read_ns = now_ns() - read_start;
+        ws.counters.enumerate_ns += read_ns;
+        record_read_latency(ws, ws.dir_latency, read_ns);
+        for (const DirEntry &entry : batch)
+        {
+            entries++;
+            if (ctx.INODE_ORDER)
+                hold_entry(held, entry);
+            else if (split_after >= 0 && entries > split_after)
+                add_to_chunk(ctx, ws, dir, entry);
+            else
+                process_entry(ctx, dir, entry, ws);
+            if (entries_per_io > 0 && entries % entries_per_io == 0)
+                throttle(ctx, ctx.iops_bucket, 1.0);
+        }
+        if (ctx.cancel_token.cancelled())
+            break;
+    }
+    if (split_after >= 0 && entries > split_after)
+    {
+        ctx.split_directories.fetch_add(1, std::memory_order_relaxed);
+        // The last, partial chunk stays on this thread
+        if (ws.chunk && !ws.chunk->held.entries.empty())
+            process_entry_chunk(ctx, ws, *ws.chunk);
+    }
+    long long close_start = now_ns();
+    backend.close_directory(listing);
+    long long close_ns = now_ns() - close_start;
+    record_latency(ws, LATENCY_CLOSE, close_ns);
+    ws.counters.enumerate_ns += close_ns;
+
+    const DirLatency &d = ws.dir_latency;
+    note_directory_latency(ctx, ws, dir, d, d.open_ns + d.read_ns + close_ns, entries);
+    charge_subtree(ctx, ws, dir, d.open_ns + d.read_ns + close_ns, entries, 1);
+    ctx.entry_count.fetch_add(entries, std::memory_order_relaxed);
+    ws.counters.entries += entries;
+    if (ctx.INODE_ORDER)
+        process_held_entries(ctx, dir, held, ws);
+    if (ctx.cancel_token.cancelled())
+        abandon_directory(ctx, ws.dir_rows, ws.dir_journal);
+    else
+        finish_directory(ctx, ws, dir, ws.dir_rows, ws.dir_journal);
+}
+
+//----------------------------------------------------------
+// Asynchronous enumeration backend (--io-backend=async)
+//
+// Directory reads are issued with NtQueryDirectoryFile on handles bound to
+// one I/O completion port, so a few threads keep QUEUE_DEPTH directories in
+// flight instead of each worker blocking on one FindNextFileW at a time.
+// Windows has no asynchronous open, so CreateFileW stays synchronous.
+//----------------------------------------------------------
+
+typedef LONG(NTAPI *NtQueryDirectoryFileFn)(HANDLE, HANDLE, PVOID, PVOID, PVOID, PVOID, ULONG, ULONG,
+                                             BOOLEAN, PVOID, BOOLEAN);
+static NtQueryDirectoryFileFn nt_query_directory_file = nullptr;
+
+static const ULONG FILE_ID_BOTH_DIRECTORY_INFORMATION_CLASS = 37;
+
+// NT_ERROR() from ntdef.h: only error statuses returned synchronously skip the
+// completion port; success and warnings (e.g. STATUS_NO_MORE_FILES) still post
+static inline bool nt_error(LONG status)
+{
+    return ((ULONG)status >> 30) == 3;
+}
+
+bool load_async_backend()
+{
+    nt_query_directory_file = reinterpret_cast<NtQueryDirectoryFileFn>(
+        reinterpret_cast<void *>(GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtQueryDirectoryFile")));
+    return nt_query_directory_file != nullptr;
+}
+
+// Issues the next batch read for an in-flight directory. Returns false when the
+// call failed synchronously, in which case no completion packet will arrive.
+bool submit_directory_read(AsyncDirRequest *req, bool restart)
+{
+    memset(&req->ov, 0, sizeof(req->ov));
+    // OVERLAPPED::Internal/InternalHigh have the IO_STATUS_BLOCK layout, and the
+    // ApcContext comes back from the port as the OVERLAPPED pointer
+    LONG status = nt_query_directory_file(req->handle, NULL, NULL, &req->ov, &req->ov.Internal,
+                                          req->buffer.get(), ASYNC_BATCH_BYTES,
+                                          FILE_ID_BOTH_DIRECTORY_INFORMATION_CLASS, FALSE, NULL,
+                                          restart ? TRUE : FALSE);
+    return !nt_error(status);
+}
+
+void finish_async_directory(ScanContext &ctx, WorkerState &ws, AsyncDirRequest *req)
+{
+    long long close_start = now_ns();
+    CloseHandle(req->handle);
+    long long close_end = now_ns();
+    record_latency(ws, LATENCY_CLOSE, close_end - close_start);
+    ws.counters.enumerate_ns += close_end - close_start;
+    // Wall time from the open to the last completion, including time queued at the device
+    note_directory_latency(ctx, ws, req->dir, req->latency, close_end - req->latency.started_ns, req->entries);
+    charge_subtree(ctx, ws, req->dir, close_end - req->latency.started_ns, req->entries, 1);
+    ctx.entry_count.fetch_add(req->entries, std::memory_order_relaxed);
+    ws.counters.entries += req->entries;
+    ctx.async_inflight--;
+    finish_directory(ctx, ws, req->dir, req->staged_rows, req->staged_journal);
+    delete req;
+}
+
+// Opens a directory, binds it to the completion port and queues its first read
+void open_async_directory(ScanContext &ctx, WorkerState &ws, std::wstring dir)
+{
+    if (ctx.cancel_token.cancelled())
+    {
+        drop_directory(ctx);
+        return;
+    }
+
+    // The open and the first read
+    throttle(ctx, ctx.dirs_bucket, 1.0);
+    throttle(ctx, ctx.iops_bucket, 2.0);
+
+    long long started_ns = now_ns();
+    auto open_start = std::chrono::steady_clock::now();
+    HANDLE h = CreateFileW(dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    auto open_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - open_start).count();
+    ctx.open_count.fetch_add(1, std::memory_order_relaxed);
+    ctx.open_ns.fetch_add(open_ns, std::memory_order_relaxed);
+    ws.counters.enumerate_ns += open_ns;
+    record_latency(ws, LATENCY_OPEN, open_ns);
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_OPEN, now_ns() - open_ns, open_ns, 0, &dir);
+
+    if (h != INVALID_HANDLE_VALUE && CreateIoCompletionPort(h, ctx.io_port, 0, 0) == NULL)
+    {
+        CloseHandle(h);
+        h = INVALID_HANDLE_VALUE;
+    }
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        finish_directory(ctx, ws, dir, ws.dir_rows, ws.dir_journal);
+        return;
+    }
+
+    AsyncDirRequest *req = new AsyncDirRequest();
+    req->handle = h;
+    req->dir = std::move(dir);
+    if (!ctx.queries.empty())
+        req->query_mask = directory_query_mask(ctx, req->dir);
+    req->buffer.reset(new unsigned char[ASYNC_BATCH_BYTES]);
+    req->latency.started_ns = started_ns;
+    req->latency.open_ns = open_ns;
+    ctx.async_inflight++;
+    long long submit_start = now_ns();
+    req->submitted_ns = submit_start;
+    bool submitted = submit_directory_read(req, true);
+    ws.counters.enumerate_ns += now_ns() - submit_start;
+    if (!submitted)
+    {
+        finish_async_directory(ctx, ws, req);
+    }
+}
+
+// Consumes one completed batch and either queues the next read or retires the
+// directory once the listing is exhausted
+void complete_directory_read(ScanContext &ctx, AsyncDirRequest *req, DWORD bytes, WorkerState &ws)
+{
+    // From submit to completion: the device's latency for this batch
+    record_read_latency(ws, req->latency, now_ns() - req->submitted_ns);
+
+    if (ctx.cancel_token.cancelled())
+    {
+        // Abandon the rest of the listing along with anything staged for it
+        CloseHandle(req->handle);
+        ctx.async_inflight--;
+        abandon_directory(ctx, req->staged_rows, req->staged_journal);
+        delete req;
+        return;
+    }
+
+    if (ctx.CHECKPOINT_SECONDS > 0)
+    {
+        ws.stage_rows = &req->staged_rows;
+        ws.stage_journal = &req->staged_journal;
+    }
+    ws.dir_mask = req->query_mask;
+    enter_shard_directory(ctx, ws, req->dir);
+
+    LONG status = (LONG)req->ov.Internal;
+    if (status < 0 || bytes == 0)
+    {
+        // STATUS_NO_MORE_FILES or a read error
+        if (!req->held.entries.empty())
+            process_held_entries(ctx, req->dir, req->held, ws);
+        finish_async_directory(ctx, ws, req);
+        return;
+    }
+
+    long long batch_start = now_ns();
+    long long entries_before = req->entries;
+    const unsigned char *p = req->buffer.get();
+    for (;;)
+    {
+        const FILE_ID_BOTH_DIR_INFO *info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(p);
+        req->entries++;
+        if (ctx.INODE_ORDER)
+            hold_entry(req->held, make_dir_entry(info));
+        else
+            process_entry(ctx, req->dir, make_dir_entry(info), ws);
+        if (info->NextEntryOffset == 0 || ctx.cancel_token.cancelled())
+            break;
+        p += info->NextEntryOffset;
+    }
+    if (ws.trace)
+        trace_event(ws.trace, TRACE_BATCH, batch_start, now_ns() - batch_start, req->entries - entries_before, &req->dir);
+
+    throttle(ctx, ctx.iops_bucket, 1.0);
+    long long submit_start = now_ns();
+    req->submitted_ns = submit_start;
+    bool submitted = submit_directory_read(req, false);
+    ws.counters.enumerate_ns += now_ns() - submit_start;
+    if (!submitted)
+    {
+        // The listing ends here, so entries held for inode order are complete
+        if (!req->held.entries.empty())
+            process_held_entries(ctx, req->dir, req->held, ws);
+        finish_async_directory(ctx, ws, req);
+    }
+}
+
+// Worker for the async backend: tops up in-flight directories from the queue
+// and drains completions in batches
+void async_directory_worker(ScanContext &ctx, int index)
+{
+    WorkerState ws;
+    ws.index = index;
+    ws.latency = ctx.worker_latency[index].get();
+    if (!ctx.traces.empty())
+        ws.trace = ctx.traces[index].get();
+    long long worker_start = now_ns();
+    if (!ctx.entry_sink)
+        ws.out_buf.reserve(ctx.output_block_bytes.load(std::memory_order_relaxed));
+    ws.query_bufs.resize(ctx.queries.size());
+    OVERLAPPED_ENTRY completions[64];
+
+    for (;;)
+    {
+        if (ctx.CHECKPOINT_SECONDS > 0)
+            flush_for_checkpoint(ctx, ws);
+
+        std::wstring dir;
+        while (ctx.async_inflight.load() < ctx.QUEUE_DEPTH && try_next_directory(ctx, ws, dir))
+        {
+            open_async_directory(ctx, ws, std::move(dir));
+        }
+
+        // Time blocked here is idle: every directory this worker holds is waiting on the device
+        ULONG count = 0;
+        long long wait_start = now_ns();
+        BOOL completed = GetQueuedCompletionStatusEx(ctx.io_port, completions, 64, &count, 10, FALSE);
+        long long waited = now_ns() - wait_start;
+        ws.counters.idle_ns += waited;
+        // Waits that returned at once would only crowd the ring
+        if (ws.trace && waited >= TRACE_MIN_WAIT_NS)
+            trace_event(ws.trace, TRACE_IDLE, wait_start, waited, 0, nullptr);
+        if (completed)
+        {
+            for (ULONG i = 0; i < count; i++)
+            {
+                AsyncDirRequest *req = CONTAINING_RECORD(completions[i].lpOverlapped, AsyncDirRequest, ov);
+                complete_directory_read(ctx, req, completions[i].dwNumberOfBytesTransferred, ws);
+            }
+        }
+        else if (ctx.done.load())
+        {
+            break;
+        }
+    }
+
+    flush_worker_buffers(ctx, ws);
+    ws.counters.wall_ns = now_ns() - worker_start;
+    ctx.worker_counters[index] = ws.counters;
+    ctx.worker_slowest[index] = std::move(ws.slowest);
+    ctx.worker_subtree_costs[index] = std::move(ws.subtree_costs);
+}
+
+// The main worker thread function that continuously processes directories from the queue
+void directory_processing_worker(ScanContext &ctx, int index)
+{
+    WorkerState ws;
+    ws.index = index;
+    ws.latency = ctx.worker_latency[index].get();
+    if (!ctx.traces.empty())
+        ws.trace = ctx.traces[index].get();
+    long long worker_start = now_ns();
+    if (!ctx.entry_sink)
+        ws.out_buf.reserve(ctx.output_block_bytes.load(std::memory_order_relaxed));
+    ws.query_bufs.resize(ctx.queries.size());
+    if (ctx.CHECKPOINT_SECONDS > 0)
+    {
+        ws.stage_rows = &ws.dir_rows;
+        ws.stage_journal = &ws.dir_journal;
+    }
+
+    for (;;)
+    {
+        // Park while the controller has this worker switched off
+        if (index >= ctx.active_thread_limit.load())
+        {
+            // Hand over local work and pass on a queue wakeup this worker may have consumed
+            share_local_directories(ctx, ws);
+            ctx.q_cv.notify_one();
+            long long park_start = now_ns();
+            std::unique_lock<std::mutex> lk(ctx.park_m);
+            ctx.park_cv.wait(lk, [&]
+                             { return index < ctx.active_thread_limit.load() || ctx.done.load(); });
+            ws.counters.idle_ns += now_ns() - park_start;
+            if (ws.trace)
+                trace_event(ws.trace, TRACE_PARKED, park_start, now_ns() - park_start, 0, nullptr);
+        }
+
+        std::wstring current_dir;
+        bool have_dir = false;
+        if (ctx.CHECKPOINT_SECONDS > 0)
+        {
+            // Do not sit on finished rows while blocked waiting for work
+            flush_for_checkpoint(ctx, ws);
+            have_dir = try_next_directory(ctx, ws, current_dir);
+            if (!have_dir && !ws.out_buf.empty())
+                flush_buffer(ctx, ws);
+        }
+        if (!have_dir && !next_directory(ctx, ws, current_dir))
+        {
+            // No more directories to process
+            break;
+        }
+        if (ws.taken_chunk)
+        {
+            process_taken_chunk(ctx, ws);
+            continue;
+        }
+        process_directory(ctx, current_dir, ws);
+    }
+
+    // Flush remaining buffer
+    flush_worker_buffers(ctx, ws);
+    ws.counters.wall_ns = now_ns() - worker_start;
+    ctx.worker_counters[index] = ws.counters;
+    ctx.worker_slowest[index] = std::move(ws.slowest);
+    ctx.worker_subtree_costs[index] = std::move(ws.subtree_costs);
+}
+
+//----------------------------------------------------------
+// Sampling estimate (--estimate)
+//
+// Knuth's random-probe estimator: a probe walks from the root to a leaf,
+// picking one subdirectory uniformly at random at each level. A directory
+// reached through parents with b1, b2, ... subdirectories stands in for
+// b1 * b2 * ... directories like it, so its file count and bytes are added
+// with that weight. Each probe is an unbiased estimate of the totals, and the
+// spread across probes gives the confidence interval. Listings are cached, so
+// the upper levels shared by most probes are read only once.
+//----------------------------------------------------------
+
+std::string to_utf8(const std::wstring &text)
+{
+    std::string out;
+    utf16_to_utf8(text.c_str(), text.size(), out);
+    return out;
+}
+
+// Applies --filetypes to a lower-case extension
+bool file_type_matches(const ScanContext &ctx, const std::wstring &ext)
+{
+    if (ctx.file_types.empty())
+        return true;
+    for (const auto &type : ctx.file_types)
+    {
+        if (_wcsicmp(ext.c_str(), type.c_str()) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool list_sampled_directory(const ScanContext &ctx, const std::wstring &dir, SampledDirectory &out)
+{
+    void *listing = ctx.backend->open_directory(dir);
+    if (!listing)
+        return false;
+
+    bool is_root = (dir == ctx.ROOT_DIR);
+    std::vector<DirEntry> batch;
+    std::wstring name;
+    bool more = true;
+    while (more)
+    {
+        more = ctx.backend->read_batch(listing, batch);
+        for (const DirEntry &entry : batch)
+        {
+            name.assign(entry.name, entry.name_len);
+            if ((entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+            {
+                if (name == L"." || name == L"..")
+                    continue;
+                // Same selection as the full scan: PREFIX applies to top-level folders
+                if (is_root && !top_level_matches(ctx, name.c_str()))
+                    continue;
+                out.subdirs.push_back(dir + L"\\" + name);
+            }
+            else if (!is_root)
+            {
+                // Like the full scan, files directly in the root are not listed
+                size_t dot = name.rfind(L'.');
+                std::wstring ext = dot != std::wstring::npos ? name.substr(dot + 1) : std::wstring();
+                std::transform(ext.begin(), ext.end(), ext.begin(), towlower);
+                if (!file_type_matches(ctx, ext))
+                    continue;
+                out.files++;
+                out.bytes += entry.size;
+                auto &e = out.extensions[ext];
+                e.first++;
+                e.second += entry.size;
+            }
+        }
+    }
+    ctx.backend->close_directory(listing);
+    return true;
+}
+
+TreeEstimate estimate_tree(ScanContext &ctx)
+{
+    create_directory_backend(ctx);
+
+    // Running sums of each per-probe estimate and of its square
+    struct Moments
+    {
+        double sum = 0.0;
+        double sum_sq = 0.0;
+        void add(double v)
+        {
+            sum += v;
+            sum_sq += v * v;
+        }
+        EstimateStat stat(long long n) const
+        {
+            EstimateStat s;
+            if (n <= 0)
+                return s;
+            s.mean = sum / n;
+            if (n > 1)
+            {
+                double variance = std::max(0.0, (sum_sq - n * s.mean * s.mean) / (n - 1));
+                s.ci95 = 1.96 * std::sqrt(variance / n);
+            }
+            return s;
+        }
+    };
+    struct Totals
+    {
+        Moments files, bytes, dirs;
+        std::unordered_map<std::wstring, std::pair<Moments, Moments>> extensions;
+    };
+
+    std::mutex cache_m;
+    std::unordered_map<std::wstring, std::shared_ptr<const SampledDirectory>> cache;
+    std::atomic<long long> listed{0};
+    auto lookup = [&](const std::wstring &dir)
+    {
+        {
+            std::lock_guard<std::mutex> lk(cache_m);
+            auto it = cache.find(dir);
+            if (it != cache.end())
+                return it->second;
+        }
+        // Listed outside the lock; two probes racing on one directory both list it, harmlessly
+        auto listing = std::make_shared<SampledDirectory>();
+        list_sampled_directory(ctx, dir, *listing);
+        listed++;
+        std::lock_guard<std::mutex> lk(cache_m);
+        return cache.emplace(dir, std::move(listing)).first->second;
+    };
+
+    int thread_count = ctx.FIXED_THREADS > 0 ? ctx.FIXED_THREADS : HARDWARE_THREADS * 4;
+    std::vector<Totals> totals(thread_count);
+    std::vector<std::thread> threads;
+    std::random_device seed;
+    for (int t = 0; t < thread_count; t++)
+    {
+        long long probes = ctx.ESTIMATE_PROBES / thread_count + (t < ctx.ESTIMATE_PROBES % thread_count ? 1 : 0);
+        unsigned long long thread_seed = ((unsigned long long)seed() << 32) | seed();
+        threads.emplace_back([&, t, probes, thread_seed]
+                             {
+            std::mt19937_64 rng(thread_seed);
+            Totals &acc = totals[t];
+            std::unordered_map<std::wstring, std::pair<double, double>> probe_ext;
+            for (long long p = 0; p < probes && !ctx.cancel_token.cancelled(); p++)
+            {
+                double weight = 1.0;
+                double files = 0.0, bytes = 0.0, dirs = 0.0;
+                probe_ext.clear();
+                std::shared_ptr<const SampledDirectory> node = lookup(ctx.ROOT_DIR);
+                bool at_root = true;
+                for (;;)
+                {
+                    if (!at_root)
+                    {
+                        dirs += weight;
+                        files += weight * node->files;
+                        bytes += weight * node->bytes;
+                        for (const auto &e : node->extensions)
+                        {
+                            auto &pe = probe_ext[e.first];
+                            pe.first += weight * e.second.first;
+                            pe.second += weight * e.second.second;
+                        }
+                    }
+                    if (node->subdirs.empty())
+                        break;
+                    weight *= node->subdirs.size();
+                    std::uniform_int_distribution<size_t> pick(0, node->subdirs.size() - 1);
+                    node = lookup(node->subdirs[pick(rng)]);
+                    at_root = false;
+                }
+                acc.files.add(files);
+                acc.bytes.add(bytes);
+                acc.dirs.add(dirs);
+                for (const auto &pe : probe_ext)
+                {
+                    auto &e = acc.extensions[pe.first];
+                    e.first.add(pe.second.first);
+                    e.second.add(pe.second.second);
+                }
+            } });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    // Probes that never reached an extension contributed zeros, which the sums already reflect
+    Totals all;
+    for (const auto &acc : totals)
+    {
+        all.files.sum += acc.files.sum;
+        all.files.sum_sq += acc.files.sum_sq;
+        all.bytes.sum += acc.bytes.sum;
+        all.bytes.sum_sq += acc.bytes.sum_sq;
+        all.dirs.sum += acc.dirs.sum;
+        all.dirs.sum_sq += acc.dirs.sum_sq;
+        for (const auto &e : acc.extensions)
+        {
+            auto &dst = all.extensions[e.first];
+            dst.first.sum += e.second.first.sum;
+            dst.first.sum_sq += e.second.first.sum_sq;
+            dst.second.sum += e.second.second.sum;
+            dst.second.sum_sq += e.second.second.sum_sq;
+        }
+    }
+
+    TreeEstimate result;
+    result.probes = ctx.ESTIMATE_PROBES;
+    result.directories_listed = listed.load();
+    result.files = all.files.stat(result.probes);
+    result.bytes = all.bytes.stat(result.probes);
+    result.directories = all.dirs.stat(result.probes);
+    for (const auto &e : all.extensions)
+    {
+        TreeEstimate::Extension ext;
+        ext.name = e.first;
+        ext.files = e.second.first.stat(result.probes);
+        ext.bytes = e.second.second.stat(result.probes);
+        result.extensions.push_back(ext);
+    }
+    std::sort(result.extensions.begin(), result.extensions.end(), [](const TreeEstimate::Extension &a, const TreeEstimate::Extension &b)
+              { return a.bytes.mean > b.bytes.mean; });
+    return result;
+}
+
+//----------------------------------------------------------
+// Worker lifecycle
+//----------------------------------------------------------
+
+// Creates worker threads until count exist. Workers are started on demand
+// rather than all MAX_THREADS up front, so an adaptive ceiling the controller
+// never reaches costs no threads and no output memory
+void start_workers(ScanContext &ctx, std::vector<std::thread> &threads, int count)
+{
+    if (count <= (int)threads.size())
+        return;
+    // Each worker holds one block per query in multi-query mode
+    size_output_buffers(ctx, count * (int)std::max<size_t>(ctx.queries.size(), 1));
+    for (int i = (int)threads.size(); i < count; i++)
+    {
+        if (ctx.ASYNC_IO)
+            threads.emplace_back(async_directory_worker, std::ref(ctx), i);
+        else
+            threads.emplace_back(directory_processing_worker, std::ref(ctx), i);
+    }
+    ctx.started_threads = (int)threads.size();
+}
+
+// Runs the workers until every queued directory has been processed. The
+// calling thread samples progress, retunes the worker count and writes
+// checkpoints meanwhile.
+void run_workers(ScanContext &ctx)
+{
+    create_directory_backend(ctx);
+    if (ctx.ASYNC_IO)
+    {
+        if (!load_async_backend())
+        {
+            std::cerr << "NtQueryDirectoryFile is unavailable; falling back to --io-backend=find.\n";
+            ctx.ASYNC_IO = false;
+        }
+        else if ((ctx.io_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, ctx.MAX_THREADS)) == NULL)
+        {
+            std::cerr << "Failed to create I/O completion port; falling back to --io-backend=find.\n";
+            ctx.ASYNC_IO = false;
+        }
+    }
+
+    init_token_bucket(ctx.iops_bucket, ctx.MAX_IOPS);
+    init_token_bucket(ctx.dirs_bucket, ctx.MAX_DIRS_PER_SEC);
+
+    ctx.worker_counters.assign(ctx.MAX_THREADS, WorkerCounters());
+    ctx.worker_slowest.assign(ctx.MAX_THREADS, std::vector<SlowDirectory>());
+    ctx.worker_subtree_costs.assign(ctx.MAX_THREADS, std::unordered_map<std::wstring, SubtreeCost>());
+    ctx.worker_latency.clear();
+    for (int i = 0; i < ctx.MAX_THREADS; i++)
+        ctx.worker_latency.emplace_back(new WorkerLatency());
+    ctx.traces.clear();
+    if (!ctx.TRACE_FILE.empty())
+    {
+        // The extra ring is the main thread's
+        for (int i = 0; i <= ctx.MAX_THREADS; i++)
+            ctx.traces.emplace_back(new TraceRing());
+    }
+
+    // Launch the first active_thread_limit workers; more follow as the limit rises
+    set_thread_limit(ctx, HARDWARE_THREADS);
+    std::vector<std::thread> threads;
+    threads.reserve(ctx.MAX_THREADS);
+    start_workers(ctx, threads, ctx.active_thread_limit.load());
+
+    // Wait until all directories are processed, retuning the worker count as we go
+    ThreadController tc;
+    tc.last_sample = std::chrono::steady_clock::now();
+    auto budget_end = tc.last_sample + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                           std::chrono::duration<double>(ctx.TIME_BUDGET_SECONDS));
+    auto last_checkpoint = tc.last_sample;
+    bool checkpoint_requested = false;
+    auto last_latency_report = tc.last_sample;
+    LatencySummary latency_before[LATENCY_KIND_COUNT];
+    ProgressSample progress;
+    progress.time = tc.last_sample;
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lk(ctx.q_m);
+            if (ctx.active_dir_count.load() == 0 && ctx.dir_queue.empty() && !ctx.cluster)
+                break;
+        }
+        // A --connect node only stops once the coordinator has no work left
+        if (ctx.cluster && cluster_tick(ctx))
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (ctx.PROGRESS_SECONDS > 0 &&
+            std::chrono::steady_clock::now() - progress.time >= std::chrono::duration<double>(ctx.PROGRESS_SECONDS))
+        {
+            report_progress(ctx, progress, true);
+        }
+        if (ctx.LATENCY_INTERVAL_SECONDS > 0 &&
+            std::chrono::steady_clock::now() - last_latency_report >= std::chrono::duration<double>(ctx.LATENCY_INTERVAL_SECONDS))
+        {
+            // Percentiles of the calls made since the previous report
+            last_latency_report = std::chrono::steady_clock::now();
+            for (int k = 0; k < LATENCY_KIND_COUNT; k++)
+            {
+                LatencySummary now = collect_latency(ctx, (LatencyKind)k);
+                std::cerr << "latency " << LATENCY_KIND_NAMES[k] << ": " << format_latency(latency_delta(now, latency_before[k])) << "\n";
+                latency_before[k] = std::move(now);
+            }
+        }
+        if (ctx.TIME_BUDGET_SECONDS > 0 && !ctx.cancel_token.cancelled() && std::chrono::steady_clock::now() >= budget_end)
+        {
+            ctx.budget_expired = true;
+            ctx.cancel_token.cancel();
+        }
+        if (ctx.cancel_token.cancelled())
+        {
+            drain_cancelled_queue(ctx);
+            continue;
+        }
+        ctx.peak_pending = std::max(ctx.peak_pending, ctx.pending_dirs.load());
+        if (!ctx.traces.empty())
+            trace_event(main_trace(ctx), TRACE_PENDING, now_ns(), -1, ctx.pending_dirs.load() + ctx.spilled_dirs.load(), nullptr);
+        if (checkpoint_requested)
+        {
+            // Workers have had one tick to flush their buffers
+            long long checkpoint_start = now_ns();
+            write_checkpoint(ctx);
+            if (!ctx.traces.empty())
+                trace_event(main_trace(ctx), TRACE_CHECKPOINT, checkpoint_start, now_ns() - checkpoint_start, 0, nullptr);
+            last_checkpoint = std::chrono::steady_clock::now();
+            checkpoint_requested = false;
+        }
+        else if (ctx.journal_fp &&
+                 std::chrono::steady_clock::now() - last_checkpoint >= std::chrono::seconds(ctx.CHECKPOINT_SECONDS))
+        {
+            ctx.checkpoint_epoch++;
+            checkpoint_requested = true;
+        }
+        if (!ctx.ASYNC_IO && ctx.MIN_THREADS < ctx.MAX_THREADS)
+        {
+            adjust_thread_count(ctx, tc);
+            start_workers(ctx, threads, ctx.active_thread_limit.load());
+        }
+    }
+
+    // Signal threads to finish
+    {
+        std::lock_guard<std::mutex> lk(ctx.q_m);
+        ctx.done.store(true);
+    }
+    ctx.q_cv.notify_all();
+    {
+        std::lock_guard<std::mutex> lk(ctx.park_m);
+    }
+    ctx.park_cv.notify_all();
+
+    for (auto &t : threads)
+        t.join();
+
+    if (ctx.io_port != NULL)
+    {
+        CloseHandle(ctx.io_port);
+    }
+    if (ctx.spill_fp)
+    {
+        fclose(ctx.spill_fp);
+        remove(spill_path(ctx).c_str());
+    }
+    if (ctx.PROGRESS_SECONDS > 0)
+    {
+        report_progress(ctx, progress, false);
+    }
+}
+
+//----------------------------------------------------------
+// Distributed scanning (--coordinator, --connect)
+//
+// One coordinator process lists the root and hands top-level directories to
+// worker processes, which scan them with their own thread pools and write
+// their own output files. Frames on the TCP connection are a type byte, a
+// uint32 payload length and the payload:
+//
+//   'H' worker -> coordinator  hello: protocol version, sizeof(wchar_t)
+//   'R' worker -> coordinator  idle, everything handed out so far is done
+//   'W' coordinator -> worker  directories to scan
+//   'S' coordinator -> worker  give back part of your frontier
+//   'F' worker -> coordinator  directories given back, possibly none
+//   'D' coordinator -> worker  no work left anywhere
+//   'T' worker -> coordinator  totals: files, directories, entries
+//
+// Directory lists are uint32 length-prefixed UTF-16 paths relative to the
+// root, so the nodes may reach the share under different names. When a
+// worker is idle and the coordinator has nothing queued, it asks the busy
+// workers for half of their shared queues; in breadth-first order those are
+// the oldest, shallowest directories, which carry the most work.
+//----------------------------------------------------------
+
+static const uint32_t MAX_FRAME_BYTES = 64u << 20;
+static const size_t MAX_HANDOUT_DIRS = 256;     // Directories per 'W' frame
+static const long long STEAL_RETRY_NS = 100000000; // Wait after a worker had nothing to give back
+
+bool send_frame(SOCKET sock, char type, const std::string &payload)
+{
+    std::string frame(1 + sizeof(uint32_t), '\0');
+    frame[0] = type;
+    uint32_t len = (uint32_t)payload.size();
+    memcpy(&frame[1], &len, sizeof(len));
+    frame += payload;
+    for (size_t sent = 0; sent < frame.size();)
+    {
+        int n = send(sock, frame.data() + sent, (int)std::min<size_t>(frame.size() - sent, 1 << 20), 0);
+        if (n <= 0)
+            return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+static bool recv_all(SOCKET sock, char *data, size_t len)
+{
+    for (size_t got = 0; got < len;)
+    {
+        int n = recv(sock, data + got, (int)std::min<size_t>(len - got, 1 << 20), 0);
+        if (n <= 0)
+            return false;
+        got += (size_t)n;
+    }
+    return true;
+}
+
+// Blocking read of one frame; false once the connection is closed or broken
+bool recv_frame(SOCKET sock, char &type, std::string &payload)
+{
+    char header[1 + sizeof(uint32_t)];
+    uint32_t len;
+    if (!recv_all(sock, header, sizeof(header)))
+        return false;
+    type = header[0];
+    memcpy(&len, header + 1, sizeof(len));
+    if (len > MAX_FRAME_BYTES)
+        return false;
+    payload.resize(len);
+    return len == 0 || recv_all(sock, &payload[0], len);
+}
+
+void append_cluster_dir(std::string &payload, const std::wstring &relative)
+{
+    uint32_t len = (uint32_t)relative.size();
+    payload.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    payload.append(reinterpret_cast<const char *>(relative.data()), relative.size() * sizeof(wchar_t));
+}
+
+bool parse_cluster_dirs(const std::string &payload, std::vector<std::wstring> &dirs)
+{
+    dirs.clear();
+    for (size_t pos = 0; pos < payload.size();)
+    {
+        uint32_t len;
+        if (payload.size() - pos < sizeof(len))
+            return false;
+        memcpy(&len, payload.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        if ((payload.size() - pos) / sizeof(wchar_t) < len)
+            return false;
+        std::wstring dir(len, L'\0');
+        memcpy(&dir[0], payload.data() + pos, len * sizeof(wchar_t));
+        pos += len * sizeof(wchar_t);
+        dirs.push_back(std::move(dir));
+    }
+    return true;
+}
+
+std::string cluster_hello()
+{
+    uint32_t hello[2] = {CLUSTER_PROTOCOL_VERSION, (uint32_t)sizeof(wchar_t)};
+    return std::string(reinterpret_cast<const char *>(hello), sizeof(hello));
+}
+
+// Connects to the coordinator at CONNECT_ADDRESS (host:port) and starts the reader thread
+bool connect_to_coordinator(ScanContext &ctx)
+{
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        std::cerr << "Failed to initialize Winsock.\n";
+        return false;
+    }
+    size_t colon = ctx.CONNECT_ADDRESS.rfind(':');
+    std::string host = ctx.CONNECT_ADDRESS.substr(0, colon);
+    std::string port = colon == std::string::npos ? std::string() : ctx.CONNECT_ADDRESS.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    if (port.empty() || getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+        std::cerr << "Cannot resolve coordinator address " << ctx.CONNECT_ADDRESS << ".\n";
+        WSACleanup();
+        return false;
+    }
+    SOCKET sock = INVALID_SOCKET;
+    for (addrinfo *a = addresses; a && sock == INVALID_SOCKET; a = a->ai_next)
+    {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock != INVALID_SOCKET && connect(sock, a->ai_addr, (int)a->ai_addrlen) != 0)
+        {
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (sock == INVALID_SOCKET || !send_frame(sock, 'H', cluster_hello()))
+    {
+        std::cerr << "Failed to connect to coordinator " << ctx.CONNECT_ADDRESS << ".\n";
+        if (sock != INVALID_SOCKET)
+            closesocket(sock);
+        WSACleanup();
+        return false;
+    }
+    // Frames are small and answered right away
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&nodelay), sizeof(nodelay));
+
+    ctx.cluster.reset(new ClusterNode());
+    ctx.cluster->sock = sock;
+    ctx.cluster->reader = std::thread(cluster_reader, std::ref(ctx));
+    return true;
+}
+
+// Worker node: queues directories from the coordinator and notes its requests
+void cluster_reader(ScanContext &ctx)
+{
+    ClusterNode &node = *ctx.cluster;
+    char type;
+    std::string payload;
+    std::vector<std::wstring> dirs;
+    while (recv_frame(node.sock, type, payload))
+    {
+        if (type == 'W' && parse_cluster_dirs(payload, dirs))
+        {
+            {
+                std::lock_guard<std::mutex> lk(ctx.q_m);
+                for (auto &dir : dirs)
+                    ctx.dir_queue.push(ctx.ROOT_DIR + L"\\" + dir);
+                ctx.pending_dirs += (long long)dirs.size();
+                ctx.active_dir_count += (int)dirs.size();
+                // Under q_m, so cluster_tick never sees this node idle with its request answered
+                node.requested = false;
+            }
+            node.received += (long long)dirs.size();
+            ctx.q_cv.notify_all();
+        }
+        else if (type == 'S')
+        {
+            node.give_back = true;
+        }
+        else if (type == 'D')
+        {
+            node.finished = true;
+        }
+    }
+    if (!node.finished.load())
+    {
+        std::cerr << "Lost the connection to the coordinator; finishing the directories already received.\n";
+        node.lost = true;
+        node.finished = true;
+    }
+}
+
+// Called by run_workers every tick on a --connect node. Gives back half of
+// the shared queue when asked, asks for work when idle, and returns true
+// once the coordinator has no work left and this node is idle.
+bool cluster_tick(ScanContext &ctx)
+{
+    ClusterNode &node = *ctx.cluster;
+    bool give_back = node.give_back.exchange(false);
+    bool ask = false;
+    bool idle;
+    std::string returned;
+    {
+        std::lock_guard<std::mutex> lk(ctx.q_m);
+        if (give_back)
+        {
+            size_t count = ctx.dir_queue.size() / 2;
+            for (size_t i = 0; i < count; i++)
+            {
+                append_cluster_dir(returned, ctx.dir_queue.front().substr(ctx.ROOT_DIR.size() + 1));
+                ctx.dir_queue.pop();
+            }
+            ctx.pending_dirs -= (long long)count;
+            ctx.active_dir_count -= (int)count;
+            node.returned += (long long)count;
+        }
+        idle = ctx.active_dir_count.load() == 0 && ctx.dir_queue.empty();
+        if (idle && !node.requested.load() && !node.finished.load())
+        {
+            node.requested = true;
+            ask = true;
+        }
+    }
+    if ((give_back && !send_frame(node.sock, 'F', returned)) || (ask && !send_frame(node.sock, 'R', std::string())))
+    {
+        if (!node.finished.load())
+            std::cerr << "Lost the connection to the coordinator.\n";
+        node.lost = true;
+        node.finished = true;
+        shutdown(node.sock, SD_BOTH);
+    }
+    return idle && node.finished.load();
+}
+
+// Reports this node's totals and waits for the coordinator to close
+void finish_cluster_worker(ScanContext &ctx)
+{
+    ClusterNode &node = *ctx.cluster;
+    if (!node.lost.load())
+    {
+        long long totals[3] = {ctx.file_count.load(), ctx.dir_done_count.load(), ctx.entry_count.load()};
+        send_frame(node.sock, 'T', std::string(reinterpret_cast<const char *>(totals), sizeof(totals)));
+        shutdown(node.sock, SD_SEND);
+    }
+    node.reader.join();
+    closesocket(node.sock);
+    WSACleanup();
+}
+
+// One worker connection as the coordinator sees it
+struct CoordinatorPeer
+{
+    SOCKET sock = INVALID_SOCKET;
+    std::string address;
+    std::string in;        // Bytes received but not yet parsed into frames
+    bool hello = false;
+    bool idle = false;     // Sent 'R' and nothing handed out since
+    bool stealing = false; // 'S' sent, waiting for 'F'
+    bool done_sent = false;
+    bool closed = false;
+    long long next_steal_ns = 0;
+    long long handed = 0;
+    long long returned = 0;
+    long long totals[3] = {-1, 0, 0}; // From 'T': files, directories, entries
+};
+
+// Handles the frames complete in peer.in; false on a protocol error
+static bool handle_peer_frames(CoordinatorPeer &peer, std::deque<std::wstring> &work)
+{
+    size_t pos = 0;
+    const size_t header = 1 + sizeof(uint32_t);
+    while (peer.in.size() - pos >= header)
+    {
+        uint32_t len;
+        memcpy(&len, peer.in.data() + pos + 1, sizeof(len));
+        if (len > MAX_FRAME_BYTES)
+            return false;
+        if (peer.in.size() - pos - header < len)
+            break;
+        char type = peer.in[pos];
+        std::string payload = peer.in.substr(pos + header, len);
+        pos += header + len;
+
+        if (type == 'H')
+        {
+            if (payload != cluster_hello())
+            {
+                std::cerr << "Worker " << peer.address << " speaks a different protocol version; disconnecting.\n";
+                return false;
+            }
+            peer.hello = true;
+        }
+        else if (!peer.hello)
+        {
+            return false;
+        }
+        else if (type == 'R')
+        {
+            peer.idle = true;
+        }
+        else if (type == 'F')
+        {
+            std::vector<std::wstring> dirs;
+            if (!parse_cluster_dirs(payload, dirs))
+                return false;
+            peer.stealing = false;
+            peer.returned += (long long)dirs.size();
+            if (dirs.empty())
+                peer.next_steal_ns = now_ns() + STEAL_RETRY_NS;
+            for (auto &dir : dirs)
+                work.push_back(std::move(dir));
+        }
+        else if (type == 'T' && payload.size() == sizeof(peer.totals))
+        {
+            memcpy(peer.totals, payload.data(), sizeof(peer.totals));
+        }
+    }
+    peer.in.erase(0, pos);
+    return true;
+}
+
+// Lists the root, then serves its top-level directories to --connect
+// workers until all of them are idle with nothing left to hand out.
+// Returns false if the port cannot be opened or a worker was lost mid-scan.
+bool run_coordinator(ScanContext &ctx)
+{
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        std::cerr << "Failed to initialize Winsock.\n";
+        return false;
+    }
+    std::deque<std::wstring> work;
+    if (initialize_directory_queue(ctx))
+    {
+        for (; !ctx.dir_queue.empty(); ctx.dir_queue.pop())
+            work.push_back(ctx.dir_queue.front().substr(ctx.ROOT_DIR.size() + 1));
+    }
+    long long seeded = (long long)work.size();
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short)ctx.COORDINATOR_PORT);
+    if (listener == INVALID_SOCKET || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        std::cerr << "Failed to listen on port " << ctx.COORDINATOR_PORT << ".\n";
+        if (listener != INVALID_SOCKET)
+            closesocket(listener);
+        WSACleanup();
+        return false;
+    }
+    std::cout << "Coordinator listening on port " << ctx.COORDINATOR_PORT << " with " << seeded
+              << " top-level directories to hand out\n";
+
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<CoordinatorPeer> peers;
+    bool finishing = false;
+    bool lost_work = false;
+    for (;;)
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        SOCKET max_sock = listener;
+        FD_SET(listener, &readable);
+        for (auto &p : peers)
+        {
+            if (p.closed)
+                continue;
+            FD_SET(p.sock, &readable);
+            max_sock = std::max(max_sock, p.sock);
+        }
+        timeval timeout = {0, 50000};
+        if (select((int)max_sock + 1, &readable, nullptr, nullptr, &timeout) < 0)
+        {
+            std::cerr << "select failed: " << WSAGetLastError() << "\n";
+            lost_work = true;
+            break;
+        }
+
+        if (FD_ISSET(listener, &readable))
+        {
+            sockaddr_in from = {};
+            socklen_t from_len = sizeof(from);
+            SOCKET sock = accept(listener, reinterpret_cast<sockaddr *>(&from), &from_len);
+            if (sock != INVALID_SOCKET)
+            {
+                int nodelay = 1;
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&nodelay), sizeof(nodelay));
+                CoordinatorPeer peer;
+                peer.sock = sock;
+                peer.address = std::string(inet_ntoa(from.sin_addr)) + ":" + std::to_string(ntohs(from.sin_port));
+                std::cout << "Worker " << peer.address << " connected\n";
+                peers.push_back(std::move(peer));
+            }
+        }
+
+        for (auto &p : peers)
+        {
+            if (p.closed || !FD_ISSET(p.sock, &readable))
+                continue;
+            char buf[64 * 1024];
+            int n = recv(p.sock, buf, sizeof(buf), 0);
+            if (n > 0)
+                p.in.append(buf, n);
+            if (n <= 0 || !handle_peer_frames(p, work))
+            {
+                // A worker that leaves while busy takes the rest of its directories with it
+                if (p.hello && !p.done_sent && !p.idle)
+                {
+                    std::cerr << "Worker " << p.address << " disconnected before finishing its directories.\n";
+                    lost_work = true;
+                }
+                closesocket(p.sock);
+                p.closed = true;
+            }
+        }
+
+        // Hand out an even share of the queue to every idle worker
+        size_t workers = 0;
+        for (auto &p : peers)
+            workers += p.hello && !p.closed ? 1 : 0;
+        for (auto &p : peers)
+        {
+            if (!p.hello || p.closed || !p.idle || work.empty())
+                continue;
+            size_t count = std::min(std::max<size_t>((work.size() + workers - 1) / workers, 1), MAX_HANDOUT_DIRS);
+            std::string payload;
+            for (size_t i = 0; i < count; i++)
+            {
+                append_cluster_dir(payload, work.front());
+                work.pop_front();
+            }
+            p.idle = false;
+            p.handed += (long long)count;
+            send_frame(p.sock, 'W', payload);
+        }
+
+        // Nothing queued while someone waits: ask the busy workers for part of their frontier
+        bool anyone_idle = false;
+        bool all_idle = true;
+        for (auto &p : peers)
+        {
+            if (!p.hello || p.closed)
+                continue;
+            anyone_idle = anyone_idle || p.idle;
+            all_idle = all_idle && p.idle && !p.stealing;
+        }
+        if (work.empty() && anyone_idle && !all_idle && !finishing)
+        {
+            long long now = now_ns();
+            for (auto &p : peers)
+            {
+                if (p.hello && !p.closed && !p.idle && !p.stealing && now >= p.next_steal_ns)
+                {
+                    p.stealing = true;
+                    send_frame(p.sock, 'S', std::string());
+                }
+            }
+        }
+
+        if (!finishing && work.empty() && all_idle && workers > 0)
+            finishing = true;
+        if (finishing)
+        {
+            for (auto &p : peers)
+            {
+                if (p.hello && !p.closed && !p.done_sent)
+                {
+                    p.done_sent = true;
+                    send_frame(p.sock, 'D', std::string());
+                }
+            }
+            bool all_closed = std::all_of(peers.begin(), peers.end(), [](const CoordinatorPeer &p)
+                                          { return p.closed || !p.hello; });
+            if (all_closed)
+                break;
+        }
+    }
+    closesocket(listener);
+    for (auto &p : peers)
+    {
+        if (!p.closed)
+            closesocket(p.sock);
+    }
+    WSACleanup();
+
+    double elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    long long files = 0;
+    long long dirs = 0;
+    for (auto &p : peers)
+    {
+        if (!p.hello)
+            continue;
+        std::cout << "Worker " << p.address << ": " << p.handed << " directories handed out, " << p.returned
+                  << " given back, " << std::max(p.totals[0], 0LL) << " files, " << p.totals[1] << " directories\n";
+        files += std::max(p.totals[0], 0LL);
+        dirs += p.totals[1];
+    }
+    std::cout << "Distributed scan completed in " << elapsed_seconds << " seconds\n";
+    std::cout << "Processed " << files << " files in " << dirs << " directories\n";
+    return !lost_work;
+}
+
+//----------------------------------------------------------
+// Latency histograms
+//----------------------------------------------------------
+
+int latency_bucket(long long ns)
+{
+    unsigned long long v = (unsigned long long)std::max(ns, 0LL);
+    if (v < (1ull << LATENCY_SUB_BITS))
+        return (int)v;
+    int msb = 63;
+    while ((v >> msb) == 0)
+        msb--;
+    int shift = msb - LATENCY_SUB_BITS + 1;
+    int bucket = shift * LATENCY_HALF_SUB + (int)(v >> shift);
+    return std::min(bucket, LATENCY_BUCKETS - 1);
+}
+
+// Largest value that falls into bucket
+long long latency_bucket_upper(int bucket)
+{
+    if (bucket < 2 * LATENCY_HALF_SUB)
+        return bucket;
+    int shift = bucket / LATENCY_HALF_SUB - 1;
+    long long sub = bucket - shift * LATENCY_HALF_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+void record_latency(WorkerState &ws, LatencyKind kind, long long ns)
+{
+    if (!ws.latency)
+        return;
+    // Single writer: plain load and store instead of a locked read-modify-write
+    LatencyHistogram &h = ws.latency->kinds[kind];
+    std::atomic<long long> &count = h.counts[latency_bucket(ns)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.sum_ns.store(h.sum_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if (ns > h.max_ns.load(std::memory_order_relaxed))
+        h.max_ns.store(ns, std::memory_order_relaxed);
+}
+
+// Records one listing read in the histogram and in the directory's totals
+void record_read_latency(WorkerState &ws, DirLatency &d, long long ns)
+{
+    record_latency(ws, LATENCY_READ, ns);
+    d.read_ns += ns;
+    d.reads++;
+    d.slowest_read_ns = std::max(d.slowest_read_ns, ns);
+}
+
+// Keeps the directory if it is among the worker's SLOWEST_DIRS slowest so far
+void note_directory_latency(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, const DirLatency &d,
+                            long long total_ns, long long entries)
+{
+    if (ctx.SLOWEST_DIRS <= 0)
+        return;
+    auto faster = [](const SlowDirectory &a, const SlowDirectory &b)
+    { return a.total_ns > b.total_ns; };
+    if ((int)ws.slowest.size() >= ctx.SLOWEST_DIRS)
+    {
+        if (total_ns <= ws.slowest.front().total_ns)
+            return;
+        std::pop_heap(ws.slowest.begin(), ws.slowest.end(), faster);
+        ws.slowest.pop_back();
+    }
+    SlowDirectory slow;
+    slow.dir = dir;
+    slow.total_ns = total_ns;
+    slow.open_ns = d.open_ns;
+    slow.slowest_read_ns = d.slowest_read_ns;
+    slow.reads = d.reads;
+    slow.entries = entries;
+    ws.slowest.push_back(std::move(slow));
+    std::push_heap(ws.slowest.begin(), ws.slowest.end(), faster);
+}
+
+// Merges every worker's histogram of one kind; safe while workers are running
+LatencySummary collect_latency(const ScanContext &ctx, LatencyKind kind)
+{
+    LatencySummary s;
+    for (const auto &w : ctx.worker_latency)
+    {
+        const LatencyHistogram &h = w->kinds[kind];
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            long long n = h.counts[i].load(std::memory_order_relaxed);
+            s.counts[i] += n;
+            s.count += n;
+        }
+        s.sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+        s.max_ns = std::max(s.max_ns, h.max_ns.load(std::memory_order_relaxed));
+    }
+    return s;
+}
+
+// What was recorded between two snapshots; max_ns becomes the top bucket's bound
+LatencySummary latency_delta(const LatencySummary &now, const LatencySummary &before)
+{
+    LatencySummary d;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        d.counts[i] = now.counts[i] - before.counts[i];
+        d.count += d.counts[i];
+        if (d.counts[i] > 0)
+            d.max_ns = std::min(latency_bucket_upper(i), now.max_ns);
+    }
+    d.sum_ns = now.sum_ns - before.sum_ns;
+    return d;
+}
+
+// Upper bound of the bucket holding the given fraction of samples, as HDR reports it
+long long latency_percentile(const LatencySummary &s, double fraction)
+{
+    if (s.count == 0)
+        return 0;
+    long long target = std::max(1LL, (long long)std::ceil(fraction * s.count));
+    long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += s.counts[i];
+        if (seen >= target)
+            return std::min(latency_bucket_upper(i), s.max_ns);
+    }
+    return s.max_ns;
+}
+
+std::string format_ns(long long ns)
+{
+    char text[32];
+    if (ns < 1000)
+        snprintf(text, sizeof(text), "%lldns", ns);
+    else if (ns < 1000000)
+        snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+    else
+        snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+    return text;
+}
+
+std::string format_latency(const LatencySummary &s)
+{
+    return "n=" + std::to_string(s.count) + " p50=" + format_ns(latency_percentile(s, 0.50)) +
+           " p90=" + format_ns(latency_percentile(s, 0.90)) + " p99=" + format_ns(latency_percentile(s, 0.99)) +
+           " p99.9=" + format_ns(latency_percentile(s, 0.999)) + " max=" + format_ns(s.max_ns);
+}
+
+// Every worker's slowest directories merged, slowest first; call after the workers exit
+std::vector<SlowDirectory> slowest_directories(const ScanContext &ctx)
+{
+    std::vector<SlowDirectory> all;
+    for (const auto &list : ctx.worker_slowest)
+        all.insert(all.end(), list.begin(), list.end());
+    std::sort(all.begin(), all.end(), [](const SlowDirectory &a, const SlowDirectory &b)
+              { return a.total_ns > b.total_ns; });
+    if ((int)all.size() > ctx.SLOWEST_DIRS)
+        all.resize(std::max(ctx.SLOWEST_DIRS, 0));
+    return all;
+}
+
+//----------------------------------------------------------
+// Live progress (--progress, --metrics-file)
+//
+// Everything here is read from counters the workers already maintain with
+// relaxed atomics, so reporting adds nothing to the worker hot path.
+//----------------------------------------------------------
+
+// Prometheus text exposition format, one HELP/TYPE block per metric
+std::string format_progress_metrics(ScanContext &ctx, const ProgressSample &last, const ProgressSample &now, bool running)
+{
+    size_t queue_depth;
+    {
+        std::lock_guard<std::mutex> lk(ctx.q_m);
+        queue_depth = ctx.dir_queue.size();
+    }
+    double interval = std::chrono::duration<double>(now.time - last.time).count();
+    auto rate = [&](long long a, long long b)
+    { return interval > 0 ? (double)(a - b) / interval : 0.0; };
+
+    std::string out;
+    auto metric = [&](const char *name, const char *type, const char *help, double value)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), "%.17g", value);
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+        out += name;
+        out += ' ';
+        out += line;
+        out += '\n';
+    };
+    metric("scanner_running", "gauge", "1 while the scan is in progress, 0 once it has finished.", running ? 1 : 0);
+    metric("scanner_elapsed_seconds", "gauge", "Time since the scan started.",
+           std::chrono::duration<double>(now.time - ctx.start_time).count());
+    metric("scanner_directories_done_total", "counter", "Directories fully listed.", (double)now.directories);
+    metric("scanner_directories_active", "gauge", "Directories queued, spilled or being listed.", ctx.active_dir_count.load());
+    metric("scanner_directories_pending", "gauge", "Directories waiting in memory, shared queue plus worker stacks.",
+           (double)ctx.pending_dirs.load(std::memory_order_relaxed));
+    metric("scanner_directories_spilled", "gauge", "Directories waiting in the frontier spill file.", (double)ctx.spilled_dirs.load());
+    metric("scanner_queue_depth", "gauge", "Directories in the shared queue.", (double)queue_depth);
+    metric("scanner_entries_total", "counter", "Directory entries seen, matching or not.", (double)ctx.entry_count.load());
+    metric("scanner_files_total", "counter", "Matching files emitted.", (double)now.files);
+    metric("scanner_file_bytes_total", "counter", "Total size of matching files emitted.", (double)now.file_bytes);
+    metric("scanner_output_bytes_total", "counter", "Bytes written to the output file.", (double)ctx.output_bytes_written.load());
+    metric("scanner_files_per_second", "gauge", "Matching files per second since the previous report.", rate(now.files, last.files));
+    metric("scanner_file_bytes_per_second", "gauge", "Matching file bytes per second since the previous report.",
+           rate(now.file_bytes, last.file_bytes));
+    metric("scanner_directories_per_second", "gauge", "Directories per second since the previous report.",
+           rate(now.directories, last.directories));
+    metric("scanner_threads_enabled", "gauge", "Worker threads the controller allows to take work.", ctx.active_thread_limit.load());
+    metric("scanner_threads_idle", "gauge", "Enabled workers waiting for a directory.", ctx.idle_workers.load());
+    metric("scanner_async_inflight", "gauge", "Directories with a read outstanding on the async backend.", ctx.async_inflight.load());
+    metric("scanner_throttle_seconds_total", "counter", "Worker time spent waiting for rate-limit tokens.",
+           ctx.throttle_ns.load() / 1e9);
+    return out;
+}
+
+// Writes one report and moves the baseline forward. The metrics file is
+// written beside its final name and renamed over it, so a scraper never sees
+// a partial file.
+void report_progress(ScanContext &ctx, ProgressSample &last, bool running)
+{
+    ProgressSample now;
+    now.time = std::chrono::steady_clock::now();
+    now.files = ctx.file_count.load();
+    now.file_bytes = ctx.file_bytes.load();
+    now.directories = ctx.dir_done_count.load();
+
+    if (ctx.PROGRESS_STDERR)
+    {
+        double interval = std::chrono::duration<double>(now.time - last.time).count();
+        double elapsed = std::chrono::duration<double>(now.time - ctx.start_time).count();
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "[%.1fs] dirs %lld done, %lld pending | files %lld (%.0f/s) | %.1f MB (%.1f MB/s) | threads %d enabled, %d idle\n",
+                 elapsed, now.directories, ctx.pending_dirs.load(std::memory_order_relaxed) + ctx.spilled_dirs.load(),
+                 now.files, interval > 0 ? (now.files - last.files) / interval : 0.0, now.file_bytes / 1e6,
+                 interval > 0 ? (now.file_bytes - last.file_bytes) / 1e6 / interval : 0.0,
+                 ctx.active_thread_limit.load(), ctx.idle_workers.load());
+        std::cerr << line;
+    }
+    if (!ctx.METRICS_FILE.empty())
+    {
+        std::string text = format_progress_metrics(ctx, last, now, running);
+        std::string tmp = ctx.METRICS_FILE + ".tmp";
+        FILE *fp = fopen(tmp.c_str(), "wb");
+        if (fp)
+        {
+            bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+            if (fclose(fp) == 0 && ok)
+                MoveFileExA(tmp.c_str(), ctx.METRICS_FILE.c_str(), MOVEFILE_REPLACE_EXISTING);
+        }
+    }
+    last = now;
+}
+
+//----------------------------------------------------------
+// Timeline trace (--trace)
+//
+// Each thread appends to its own ring, so recording takes no lock. The rings
+// are written out as Chrome trace-event JSON once the workers have exited;
+// chrome://tracing and ui.perfetto.dev both open it.
+//----------------------------------------------------------
+
+void trace_event(TraceRing *ring, TraceKind kind, long long start_ns, long long dur_ns, long long value,
+                 const std::wstring *path)
+{
+    TraceEvent *e;
+    if (ring->events.size() < TRACE_RING_EVENTS)
+    {
+        ring->events.emplace_back();
+        e = &ring->events.back();
+    }
+    else
+    {
+        e = &ring->events[ring->next];
+        ring->next = (ring->next + 1) % TRACE_RING_EVENTS;
+        ring->overwritten++;
+    }
+    e->kind = kind;
+    e->start_ns = start_ns;
+    e->dur_ns = dur_ns;
+    e->value = value;
+    if (path)
+        e->path.assign(*path);
+    else
+        e->path.clear();
+}
+
+// Ring for events recorded by the thread running run_workers
+TraceRing *main_trace(ScanContext &ctx)
+{
+    return ctx.traces.back().get();
+}
+
+bool write_trace(const ScanContext &ctx, const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    long long epoch_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(ctx.start_time.time_since_epoch()).count();
+    std::string out = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    char number[64];
+    bool ok = true;
+    for (size_t t = 0; t < ctx.traces.size(); t++)
+    {
+        const TraceRing &ring = *ctx.traces[t];
+        bool is_main = t + 1 == ctx.traces.size();
+        std::string thread_name = is_main ? "main" : "worker " + std::to_string(t);
+        if (ring.overwritten > 0)
+            thread_name += " (oldest " + std::to_string(ring.overwritten) + " events overwritten)";
+        out += first ? "" : ",\n";
+        first = false;
+        out += "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " + std::to_string(t) +
+               ", \"args\": {\"name\": ";
+        append_json_string(thread_name, out);
+        out += "}}";
+
+        for (size_t i = 0; i < ring.events.size(); i++)
+        {
+            const TraceEvent &e = ring.events[(ring.next + i) % ring.events.size()];
+            bool counter = e.kind == TRACE_THREADS || e.kind == TRACE_PENDING;
+            out += ",\n{\"name\": \"";
+            out += TRACE_KIND_NAMES[e.kind];
+            out += "\", \"ph\": \"";
+            out += counter ? "C" : (e.dur_ns < 0 ? "i" : "X");
+            snprintf(number, sizeof(number), "%.3f", (e.start_ns - epoch_ns) / 1e3);
+            out += "\", \"pid\": 1, \"tid\": " + std::to_string(t) + ", \"ts\": " + number;
+            if (counter)
+            {
+                out += ", \"args\": {\"value\": " + std::to_string(e.value) + "}}";
+                continue;
+            }
+            if (e.dur_ns >= 0)
+            {
+                snprintf(number, sizeof(number), "%.3f", e.dur_ns / 1e3);
+                out += ", \"dur\": ";
+                out += number;
+            }
+            else
+            {
+                out += ", \"s\": \"t\"";
+            }
+            out += ", \"args\": {\"value\": " + std::to_string(e.value);
+            if (!e.path.empty())
+            {
+                out += ", \"path\": ";
+                append_json_string(to_utf8(e.path), out);
+            }
+            out += "}}";
+
+            if (out.size() >= (1u << 20))
+            {
+                ok = ok && fwrite(out.data(), 1, out.size(), fp) == out.size();
+                out.clear();
+            }
+        }
+    }
+    out += "\n]}\n";
+    ok = ok && fwrite(out.data(), 1, out.size(), fp) == out.size();
+    return fclose(fp) == 0 && ok;
+}
+
+//----------------------------------------------------------
+// Run report (--report)
+//----------------------------------------------------------
+
+WorkerCounters total_worker_counters(const ScanContext &ctx)
+{
+    WorkerCounters total;
+    for (const auto &c : ctx.worker_counters)
+    {
+        total.directories += c.directories;
+        total.entries += c.entries;
+        total.files += c.files;
+        total.bytes += c.bytes;
+        total.enumerate_ns += c.enumerate_ns;
+        total.queue_wait_ns += c.queue_wait_ns;
+        total.output_wait_ns += c.output_wait_ns;
+        total.flush_ns += c.flush_ns;
+        total.idle_ns += c.idle_ns;
+        total.wall_ns += c.wall_ns;
+    }
+    return total;
+}
+
+void append_json_string(const std::string &text, std::string &out)
+{
+    out += '"';
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char)c;
+        }
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+// Appends one counter set as JSON members. "other_ns" is the rest of the
+// worker's lifetime: filtering, formatting, transcoding and throttling.
+void append_counters_json(const WorkerCounters &c, std::string &out)
+{
+    long long other_ns = c.wall_ns - c.enumerate_ns - c.queue_wait_ns - c.flush_ns - c.idle_ns;
+    out += "\"directories\": " + std::to_string(c.directories);
+    out += ", \"entries\": " + std::to_string(c.entries);
+    out += ", \"files\": " + std::to_string(c.files);
+    out += ", \"bytes\": " + std::to_string(c.bytes);
+    out += ", \"enumerate_ns\": " + std::to_string(c.enumerate_ns);
+    out += ", \"queue_wait_ns\": " + std::to_string(c.queue_wait_ns);
+    out += ", \"output_wait_ns\": " + std::to_string(c.output_wait_ns);
+    out += ", \"flush_ns\": " + std::to_string(c.flush_ns);
+    out += ", \"idle_ns\": " + std::to_string(c.idle_ns);
+    out += ", \"other_ns\": " + std::to_string(std::max(other_ns, 0LL));
+    out += ", \"wall_ns\": " + std::to_string(c.wall_ns);
+}
+
+void append_latency_json(const LatencySummary &s, std::string &out)
+{
+    out += "{\"count\": " + std::to_string(s.count);
+    out += ", \"mean_ns\": " + std::to_string(s.count > 0 ? s.sum_ns / s.count : 0);
+    out += ", \"p50_ns\": " + std::to_string(latency_percentile(s, 0.50));
+    out += ", \"p90_ns\": " + std::to_string(latency_percentile(s, 0.90));
+    out += ", \"p99_ns\": " + std::to_string(latency_percentile(s, 0.99));
+    out += ", \"p999_ns\": " + std::to_string(latency_percentile(s, 0.999));
+    out += ", \"max_ns\": " + std::to_string(s.max_ns) + "}";
+}
+
+// Writes the run summary and every worker's counters as one JSON object
+bool write_run_report(const ScanContext &ctx, const std::string &path, double seconds)
+{
+    std::string json = "{\n  \"root\": ";
+    append_json_string(to_utf8(ctx.ROOT_DIR), json);
+    json += ",\n  \"backend\": ";
+    json += ctx.ASYNC_IO ? "\"async\"" : ctx.SIMULATED_IO ? "\"simulated\"" : "\"find\"";
+    json += ",\n  \"traversal\": ";
+    json += ctx.DEPTH_FIRST ? "\"dfs\"" : "\"bfs\"";
+    json += ",\n  \"elapsed_seconds\": " + std::to_string(seconds);
+    json += ",\n  \"files\": " + std::to_string(ctx.file_count.load());
+    json += ",\n  \"directories\": " + std::to_string(ctx.dir_done_count.load());
+    json += ",\n  \"entries\": " + std::to_string(ctx.entry_count.load());
+    json += ",\n  \"directory_opens\": " + std::to_string(ctx.open_count.load());
+    json += ",\n  \"open_ns\": " + std::to_string(ctx.open_ns.load());
+    json += ",\n  \"output_bytes_written\": " + std::to_string(ctx.output_bytes_written.load());
+    json += ",\n  \"output_flushes\": " + std::to_string(ctx.output_flush_count.load());
+    json += ",\n  \"throttle_ns\": " + std::to_string(ctx.throttle_ns.load());
+    json += ",\n  \"threads\": {\"min\": " + std::to_string(ctx.MIN_THREADS) + ", \"max\": " +
+            std::to_string(ctx.MAX_THREADS) + ", \"peak_active\": " + std::to_string(ctx.peak_thread_limit) + "}";
+    json += ",\n  \"totals\": {";
+    append_counters_json(total_worker_counters(ctx), json);
+    json += "},\n  \"latency\": {";
+    for (int k = 0; k < LATENCY_KIND_COUNT; k++)
+    {
+        json += k == 0 ? "\n    \"" : ",\n    \"";
+        json += LATENCY_KIND_NAMES[k];
+        json += "\": ";
+        append_latency_json(collect_latency(ctx, (LatencyKind)k), json);
+    }
+    json += "\n  },\n  \"slowest_directories\": [";
+    std::vector<SlowDirectory> slowest = slowest_directories(ctx);
+    for (size_t i = 0; i < slowest.size(); i++)
+    {
+        const SlowDirectory &s = slowest[i];
+        json += i == 0 ? "\n    {\"path\": " : ",\n    {\"path\": ";
+        append_json_string(to_utf8(s.dir), json);
+        json += ", \"total_ns\": " + std::to_string(s.total_ns) + ", \"open_ns\": " + std::to_string(s.open_ns) +
+                ", \"slowest_read_ns\": " + std::to_string(s.slowest_read_ns) + ", \"reads\": " +
+                std::to_string(s.reads) + ", \"entries\": " + std::to_string(s.entries) + "}";
+    }
+    json += "\n  ],\n  \"workers\": [";
+    for (size_t i = 0; i < ctx.worker_counters.size(); i++)
+    {
+        json += i == 0 ? "\n    {" : ",\n    {";
+        json += "\"index\": " + std::to_string(i) + ", ";
+        append_counters_json(ctx.worker_counters[i], json);
+        json += "}";
+    }
+    json += "\n  ]\n}\n";
+
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(json.data(), 1, json.size(), fp) == json.size();
+    return fclose(fp) == 0 && ok;
+}
+
+//----------------------------------------------------------
+// Library API (Scanner)
+//----------------------------------------------------------
+
+Scanner::Scanner(ScanOptions options) : options(std::move(options))
+{
+}
+
+Scanner::~Scanner()
+{
+    if (runner.joinable())
+    {
+        cancel();
+        // Destroyed from a consumer woken on the runner thread itself: the
+        // runner has nothing left to do after the final wake, so let it end
+        if (std::this_thread::get_id() == runner.get_id())
+            runner.detach();
+        else
+            runner.join();
+    }
+}
+
+void Scanner::cancel()
+{
+    if (context)
+        context->cancel_token.cancel();
+
+    // Let workers blocked on a full batch queue drop their batches and wind down
+    std::function<void()> wake;
+    {
+        std::lock_guard<std::mutex> lk(batch_m);
+        abandoned = true;
+        batches.clear();
+        wake.swap(waiter);
+    }
+    batch_space.notify_all();
+    batch_ready.notify_all();
+    if (wake)
+        wake();
+}
+
+// A spill file prefix no other Scanner shares: the temp directory, the
+// process ID and a per-process instance number
+std::string default_temp_prefix()
+{
+    static std::atomic<unsigned> next_instance{0};
+    char dir[MAX_PATH + 1];
+    DWORD len = GetTempPathA(sizeof(dir), dir);
+    std::string prefix = len > 0 && len < sizeof(dir) ? std::string(dir, len) : std::string();
+    return prefix + "scanner-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(next_instance++);
+}
+
+// Builds a fresh engine context from the options
+bool Scanner::prepare()
+{
+    context.reset(new ScanContext);
+    ScanContext &ctx = *context;
+    ctx.ROOT_DIR = options.root;
+    ctx.PREFIX = options.prefix;
+    ctx.file_types = options.file_types;
+    ctx.FIXED_THREADS = options.threads;
+    ctx.MIN_THREADS = options.min_threads;
+    ctx.MAX_THREADS = options.max_threads;
+    ctx.ASYNC_IO = options.async_io;
+    ctx.QUEUE_DEPTH = options.queue_depth;
+    ctx.INODE_ORDER = options.inode_order;
+    ctx.backend = options.backend;
+    if (ctx.backend)
+        ctx.ASYNC_IO = false;
+    ctx.DEPTH_FIRST = options.depth_first;
+    ctx.SHARD_INDEX = options.shard_index;
+    ctx.SHARD_COUNT = options.shard_count;
+    ctx.SHARD_DEPTH = options.shard_depth;
+    ctx.HISTORY_FILE = options.history_file;
+    ctx.MAX_PENDING = options.max_pending;
+    ctx.LIMIT = options.limit;
+    ctx.MAX_IOPS = options.max_iops;
+    ctx.MAX_DIRS_PER_SEC = options.max_dirs_per_sec;
+    ctx.TIME_BUDGET_SECONDS = options.time_budget_seconds;
+    ctx.cancel_token = options.cancel_token.child();
+    ctx.OUTPUT_FILE = options.temp_prefix.empty() ? default_temp_prefix() : options.temp_prefix;
+    ctx.SINK_BATCH_ENTRIES = std::max<size_t>(options.batch_entries, 1);
+    start_time = std::chrono::steady_clock::now();
+    elapsed_seconds = 0.0;
+    bool shard_ok = ctx.SHARD_COUNT >= 1 && ctx.SHARD_INDEX >= 0 && ctx.SHARD_INDEX < ctx.SHARD_COUNT &&
+                    (ctx.SHARD_DEPTH == 1 || ctx.SHARD_DEPTH == 2);
+    if (ctx.ROOT_DIR.empty() || !shard_ok || !normalize_thread_settings(ctx))
+    {
+        context.reset();
+        return false;
+    }
+    return true;
+}
+
+// Runs the engine on the prepared context
+void Scanner::scan()
+{
+    if (initialize_directory_queue(*context))
+    {
+        run_workers(*context);
+        if (!context->HISTORY_FILE.empty() && !context->cancel_token.cancelled() && !save_history(*context))
+            std::cerr << "Failed to write history " << context->HISTORY_FILE << ".\n";
+    }
+    elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+bool Scanner::run(const EntryCallback &callback)
+{
+    if (runner.joinable() || !prepare())
+        return false;
+    context->entry_sink = [&](ScanBatch &batch)
+    {
+        bind_batch_paths(batch);
+        std::lock_guard<std::mutex> lk(callback_m);
+        callback(batch.entries.data(), batch.entries.size());
+    };
+    scan();
+    return true;
+}
+
+bool Scanner::start()
+{
+    if (runner.joinable() || !prepare())
+        return false;
+    context->entry_sink = [this](ScanBatch &batch)
+    {
+        std::function<void()> wake;
+        {
+            std::unique_lock<std::mutex> lk(batch_m);
+            batch_space.wait(lk, [&]
+                             { return batches.size() < options.max_queued_batches || abandoned; });
+            if (abandoned)
+                return;
+            batches.push_back(std::move(batch));
+            wake.swap(waiter);
+        }
+        batch_ready.notify_one();
+        if (wake)
+            wake();
+    };
+    runner = std::thread([this]
+                         {
+                             scan();
+                             std::function<void()> wake;
+                             {
+                                 std::lock_guard<std::mutex> lk(batch_m);
+                                 finished = true;
+                                 wake.swap(waiter);
+                             }
+                             batch_ready.notify_all();
+                             if (wake)
+                                 wake(); });
+    return true;
+}
+
+bool Scanner::next_batch(ScanBatch &batch)
+{
+    // Without a successful start() nothing would ever set finished
+    if (!runner.joinable())
+        return false;
+    std::unique_lock<std::mutex> lk(batch_m);
+    batch_ready.wait(lk, [&]
+                     { return !batches.empty() || finished || abandoned; });
+    if (batches.empty())
+        return false;
+    batch = std::move(batches.front());
+    batches.pop_front();
+    lk.unlock();
+    batch_space.notify_one();
+    bind_batch_paths(batch);
+    return true;
+}
+
+Scanner::Poll Scanner::poll_batch(ScanBatch &batch, std::function<void()> wake)
+{
+    if (!runner.joinable())
+        return Poll::Finished;
+    {
+        std::lock_guard<std::mutex> lk(batch_m);
+        if (batches.empty())
+        {
+            if (finished || abandoned)
+                return Poll::Finished;
+            waiter = std::move(wake);
+            return Poll::Pending;
+        }
+        batch = std::move(batches.front());
+        batches.pop_front();
+    }
+    batch_space.notify_one();
+    bind_batch_paths(batch);
+    return Poll::Ready;
+}
+
+bool Scanner::next(ScanEntry &entry)
+{
+    while (current_pos >= current.entries.size())
+    {
+        current_pos = 0;
+        if (!next_batch(current))
+            return false;
+    }
+    entry = current.entries[current_pos++];
+    return true;
+}
+
+Scanner::iterator Scanner::begin()
+{
+    if (!runner.joinable() && !start())
+        return end();
+    return iterator(this);
+}
+
+ScanStats Scanner::stats() const
+{
+    ScanStats s;
+    if (!context)
+        return s;
+    s.files = context->file_count.load();
+    s.directories = context->dir_done_count.load();
+    s.entries = context->entry_count.load();
+    s.seconds = elapsed_seconds.load();
+    if (s.seconds == 0.0)
+        s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    return s;
+}
@@ -0,0 +1,241 @@
+// Embedding API of the directory scanning engine: the Scanner class with its
+// options, entries and statistics, and the DirectoryBackend interface for
+// supplying a custom enumeration. The engine itself is in scanner_internal.h
+// and scanner.cpp.
+#ifndef LANDRYS_SCANNER_H
+#define LANDRYS_SCANNER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+//----------------------------------------------------------
+// Library API
+//
+// Scanner runs the same engine as the command-line tool but hands matching
+// files over as ScanEntry spans instead of formatting CSV. Either pass a
+// callback to run(), or call start() and pull entries with next(),
+// next_batch() or a range-for while the scan continues on worker threads.
+//----------------------------------------------------------
+
+// One directory entry as returned by either enumeration backend. Both listing
+// APIs return size, timestamps and attributes with the name, so metadata
+// columns never need a separate per-file call.
+struct DirEntry
+{
+    const wchar_t *name;
+    size_t name_len;
+    uint32_t attributes; // FILE_ATTRIBUTE_* flags
+    unsigned long long size;
+    unsigned long long modified; // FILETIME: 100 ns ticks since 1601-01-01 UTC
+    unsigned long long file_id;  // NTFS file reference (MFT record), 0 if the backend lacks it
+};
+
+// Synchronous directory enumeration. open_directory returns an opaque
+// listing (nullptr if the directory cannot be read), read_batch replaces
+// batch with its next entries and returns false once it is exhausted (the
+// last batch may still hold entries), and close_directory releases it.
+// Entry names stay valid until the next call on the same listing. stat
+// fills in one path's metadata as its parent's listing reports it, with no
+// name. One instance is shared by all workers; listings are not.
+struct DirectoryBackend
+{
+    virtual ~DirectoryBackend() {}
+    virtual void *open_directory(const std::wstring &dir) = 0;
+    virtual bool read_batch(void *listing, std::vector<DirEntry> &batch) = 0;
+    virtual void close_directory(void *listing) = 0;
+    virtual bool stat(const std::wstring &path, DirEntry &out) = 0;
+    // Entries per storage round trip, for --max-iops; 0 = each read_batch is one
+    virtual long long entries_per_io() const { return 0; }
+};
+
+// One matching file handed to library callers (see Scanner). path points into
+// the ScanBatch that delivered the entry and is NUL terminated.
+struct ScanEntry
+{
+    const wchar_t *path = nullptr;
+    size_t path_len = 0;
+    size_t name_offset = 0; // The file name starts at path + name_offset
+    uint32_t attributes = 0; // FILE_ATTRIBUTE_* flags
+    unsigned long long size = 0;
+    unsigned long long modified = 0; // FILETIME: 100 ns ticks since 1601-01-01 UTC
+    unsigned long long file_id = 0;  // NTFS file reference, 0 if the backend lacks it
+};
+
+// A span of entries with their paths packed into one buffer. path_offsets
+// records where each path starts; bind_batch_paths turns them into pointers
+// once the batch has reached its final owner.
+struct ScanBatch
+{
+    std::vector<ScanEntry> entries;
+    std::wstring paths;
+    std::vector<size_t> path_offsets;
+};
+
+// Stop flag shared between a scan and whoever may stop it. Copies share one
+// flag, so a caller can keep a copy and hand another to the scan. Once
+// cancelled it stays cancelled.
+class CancellationToken
+{
+public:
+    void cancel() { flag->store(true); }
+    bool cancelled() const
+    {
+        return flag->load(std::memory_order_relaxed) || (parent && parent->load(std::memory_order_relaxed));
+    }
+
+    // A token that is also cancelled when this one is, but whose own cancel
+    // (e.g. on reaching --limit) does not propagate back
+    CancellationToken child() const
+    {
+        CancellationToken t;
+        t.parent = flag;
+        return t;
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+    std::shared_ptr<std::atomic<bool>> parent;
+};
+
+struct ScanContext; // Engine state, see scanner_internal.h
+
+// Scan settings, named after the command-line options they mirror
+struct ScanOptions
+{
+    std::wstring root;                    // --path
+    std::wstring prefix;                  // --prefix
+    std::vector<std::wstring> file_types; // --filetypes
+    int threads = 0;                      // --threads, 0 = adaptive within min_threads..max_threads
+    int min_threads = 1;                  // --min-threads
+    int max_threads = 0;                  // --max-threads, 0 = 16x hardware threads
+    bool async_io = false;                // --io-backend=async
+    int queue_depth = 256;                // --queue-depth
+    bool inode_order = false;             // --inode-order
+    std::shared_ptr<DirectoryBackend> backend; // Own enumeration for the synchronous path; overrides async_io
+    bool depth_first = false;             // --traversal=dfs
+    int shard_index = 0;                  // --shard=<shard_index>/<shard_count>
+    int shard_count = 1;
+    int shard_depth = 1;                  // --shard-depth
+    std::string history_file;             // --history; rewritten only when the scan completes
+    long long max_pending = 0;            // --max-pending
+    long long limit = 0;                  // --limit, 0 = every match
+    double max_iops = 0.0;                // --max-iops, 0 = unlimited
+    double max_dirs_per_sec = 0.0;        // --max-dirs-per-sec, 0 = unlimited
+    double time_budget_seconds = 0.0;     // --time-budget, 0 = unlimited; the scan is then cancelled
+    CancellationToken cancel_token;       // Cancel a copy of this to stop the scan from anywhere
+    std::string temp_prefix;              // Spilled frontier goes to <temp_prefix>.frontier.tmp; empty = a name
+                                          // unique to this scan in the temp directory. Set it only to a prefix
+                                          // no concurrent scan uses.
+    size_t batch_entries = 1024;          // Entries per callback span or pulled batch
+    size_t max_queued_batches = 64;       // Pull mode: batches buffered before workers wait for the caller
+};
+
+struct ScanStats
+{
+    long long files = 0;       // Entries delivered
+    long long directories = 0; // Directories enumerated
+    long long entries = 0;     // Directory entries seen, matching or not
+    double seconds = 0.0;
+};
+
+// Receives up to ScanOptions::batch_entries entries; they are only valid during the call
+using EntryCallback = std::function<void(const ScanEntry *entries, size_t count)>;
+
+class Scanner
+{
+public:
+    explicit Scanner(ScanOptions options);
+    ~Scanner();
+    Scanner(const Scanner &) = delete;
+    Scanner &operator=(const Scanner &) = delete;
+
+    // Scans to completion on the calling thread plus the workers. Callback
+    // calls come from worker threads but never overlap.
+    bool run(const EntryCallback &callback);
+
+    // Pull interface: start() launches the scan in the background, or returns
+    // false if the options are invalid. next_batch and next block until
+    // entries are available and return false once the scan has finished and
+    // everything has been consumed, or at once if no scan was started; a
+    // range-for over a scanner whose start() fails is empty. An entry from
+    // next() stays valid until the following call.
+    bool start();
+    bool next_batch(ScanBatch &batch);
+    bool next(ScanEntry &entry);
+
+    class iterator
+    {
+    public:
+        iterator(Scanner *scanner = nullptr) : scanner(scanner) { ++*this; }
+        const ScanEntry &operator*() const { return current; }
+        const ScanEntry *operator->() const { return &current; }
+        iterator &operator++()
+        {
+            if (scanner && !scanner->next(current))
+                scanner = nullptr;
+            return *this;
+        }
+        bool operator!=(const iterator &other) const { return scanner != other.scanner; }
+
+    private:
+        Scanner *scanner;
+        ScanEntry current;
+    };
+    // Starts the scan if needed and iterates over every entry
+    iterator begin();
+    iterator end() { return iterator(); }
+
+    // Stops a running scan from any thread, as does cancelling
+    // options.cancel_token. Queued directories are dropped without being
+    // enumerated, and entries not yet pulled are discarded.
+    void cancel();
+
+    // Non-blocking pull for event loops (see scanner_coro.h). Returns Ready
+    // with the next batch, Finished, or Pending after storing wake, which a
+    // worker thread then calls once when a batch or the end of the scan arrives.
+    enum class Poll
+    {
+        Ready,
+        Pending,
+        Finished
+    };
+    Poll poll_batch(ScanBatch &batch, std::function<void()> wake);
+
+    ScanStats stats() const;
+
+private:
+    bool prepare();
+    void scan();
+
+    ScanOptions options;
+    std::unique_ptr<ScanContext> context;
+    std::chrono::steady_clock::time_point start_time; // Set before the workers start
+    std::atomic<double> elapsed_seconds{0.0};         // Set once the scan has finished
+
+    // Run mode
+    std::mutex callback_m;
+
+    // Pull mode
+    std::thread runner;
+    std::mutex batch_m;
+    std::condition_variable batch_ready;
+    std::condition_variable batch_space;
+    std::deque<ScanBatch> batches;
+    ScanBatch current; // Batch that next() is walking
+    size_t current_pos = 0;
+    bool finished = false;
+    bool abandoned = false;
+    std::function<void()> waiter; // Set by poll_batch while a consumer is suspended
+};
+
+#endif // LANDRYS_SCANNER_H
@@ -0,0 +1,91 @@
+// C++20 coroutine front end for Scanner, for services built around an event
+// loop. Needs -std=c++20; scanner.h and scanner.cpp still build as C++17.
+#ifndef LANDRYS_SCANNER_CORO_H
+#define LANDRYS_SCANNER_CORO_H
+
+#include <coroutine>
+#include "scanner.h"
+
+// Streams a scan to a coroutine as batches:
+//
+//   AsyncScanner scan(options, [&](std::coroutine_handle<> h) { loop.post(h); });
+//   ScanBatch batch;
+//   while (co_await scan.next(batch))
+//       consume(batch);
+//
+// Waiting for a batch suspends the coroutine instead of blocking its thread.
+// Workers run at most ScanOptions::max_queued_batches ahead of the consumer
+// and then pause, so a consumer that stops awaiting pauses the scan and picks
+// it up again by awaiting. cancel() ends it from any thread.
+class AsyncScanner
+{
+public:
+    // Schedules a suspended consumer, e.g. by posting the handle to the event
+    // loop. It is called on an engine thread (a worker, or the thread that
+    // ends the scan) and must not resume the handle there: a consumer that
+    // then destroyed its AsyncScanner would wait for the very thread it runs on.
+    using Resumer = std::function<void(std::coroutine_handle<>)>;
+
+    AsyncScanner(ScanOptions options, Resumer resume) : scanner(std::move(options)), resume(std::move(resume)) {}
+
+    // Optional: next() starts the scan on first use
+    bool start()
+    {
+        started = true;
+        return scanner.start();
+    }
+    void cancel() { scanner.cancel(); }
+    ScanStats stats() const { return scanner.stats(); }
+
+    // co_await yields true with the next batch, or false once the scan has
+    // finished or been cancelled
+    class NextAwaiter
+    {
+    public:
+        NextAwaiter(AsyncScanner &owner, ScanBatch &batch) : owner(owner), batch(batch) {}
+
+        bool await_ready()
+        {
+            if (!owner.started && !owner.start())
+            {
+                result = Scanner::Poll::Finished;
+                return true;
+            }
+            result = owner.scanner.poll_batch(batch, {});
+            return result != Scanner::Poll::Pending;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            AsyncScanner *scan = &owner;
+            Scanner::Poll r = owner.scanner.poll_batch(batch, [scan, handle]
+                                                        { scan->resume(handle); });
+            if (r == Scanner::Poll::Pending)
+                return true; // The wake may already have resumed us, so touch nothing here
+            result = r;
+            return false;
+        }
+
+        bool await_resume()
+        {
+            // Woken only once a batch or the end of the scan is available
+            if (result == Scanner::Poll::Pending)
+                result = owner.scanner.poll_batch(batch, {});
+            return result == Scanner::Poll::Ready;
+        }
+
+    private:
+        AsyncScanner &owner;
+        ScanBatch &batch;
+        Scanner::Poll result = Scanner::Poll::Pending;
+    };
+
+    NextAwaiter next(ScanBatch &batch) { return NextAwaiter(*this, batch); }
+
+private:
+    Scanner scanner;
+    Resumer resume;
+    bool started = false;
+};
+
+#endif // LANDRYS_SCANNER_CORO_H
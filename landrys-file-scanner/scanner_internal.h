@@ -0,0 +1,740 @@
+// Engine internals shared by scanner.cpp, the command-line tool and the
+// microbenchmark: the scan context, worker state and every engine function.
+// Programs that embed the scanner include scanner.h instead.
+#ifndef LANDRYS_SCANNER_INTERNAL_H
+#define LANDRYS_SCANNER_INTERNAL_H
+
+#include <winsock2.h> // Before windows.h, which would pull in the older winsock.h
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <cwctype>
+#include <random>
+#include <cmath>
+#include <io.h>
+#include "scanner.h"
+
+//----------------------------------------------------------
+// Data structures and global settings
+//----------------------------------------------------------
+
+// Optional metadata columns written after the path (--columns)
+enum class Column
+{
+    Size,
+    Modified,
+    Attributes
+};
+
+// A directory's entries held back so they can be handled in file ID order
+// (--inode-order). Names are packed into one buffer to avoid a string per entry.
+struct HeldEntries
+{
+    struct Held
+    {
+        size_t name_offset;
+        size_t name_len;
+        DWORD attributes;
+        unsigned long long size;
+        unsigned long long modified;
+        unsigned long long file_id;
+    };
+    std::wstring names;
+    std::vector<Held> entries;
+};
+
+// Worker side of a distributed scan (--connect). The reader thread queues the
+// directories the coordinator hands out; the main thread's loop in
+// run_workers asks for more when idle and returns part of the frontier when
+// the coordinator requests it.
+struct ClusterNode
+{
+    SOCKET sock = INVALID_SOCKET;
+    std::thread reader;
+    std::atomic<bool> finished{false};  // Coordinator sent 'D', or the connection dropped
+    std::atomic<bool> lost{false};      // The connection dropped
+    std::atomic<bool> requested{false}; // 'R' sent and no work received since
+    std::atomic<bool> give_back{false}; // Coordinator asked for part of the frontier
+    std::atomic<long long> received{0}; // Directories handed to this node
+    long long returned = 0;             // Directories given back
+};
+
+// Protocol version in the 'H' frame; both ends must also agree on sizeof(wchar_t)
+static const uint32_t CLUSTER_PROTOCOL_VERSION = 1;
+
+// Part of a huge directory's listing handed to another worker for filtering
+// and formatting while the listing thread keeps reading (--split-entries)
+struct EntryChunk
+{
+    std::wstring dir;
+    uint64_t dir_mask = 0;
+    HeldEntries held;
+};
+
+// Entries per chunk of a split directory
+static const size_t SPLIT_CHUNK_ENTRIES = 4096;
+
+// A named query from the --queries file. Each has its own filters and output
+// file, and all of them are evaluated in one shared traversal.
+struct Query
+{
+    std::string name;
+    std::wstring prefix;
+    std::vector<std::wstring> file_types;
+    std::string output_file;
+    FILE *fp = nullptr;
+    std::mutex m; // Guards fp
+    std::atomic<long long> file_count{0};
+    std::atomic<long long> bytes_written{0};
+};
+
+// Queries are tracked as bits in a 64-bit mask
+static const size_t MAX_QUERIES = 64;
+
+// One directory as seen by the sampling estimator (--estimate): its
+// subdirectories and the files in it that pass the filters
+struct SampledDirectory
+{
+    std::vector<std::wstring> subdirs;
+    long long files = 0;
+    unsigned long long bytes = 0;
+    std::unordered_map<std::wstring, std::pair<long long, unsigned long long>> extensions; // files, bytes
+};
+
+// Mean of the per-probe estimates and the half-width of its 95% confidence interval
+struct EstimateStat
+{
+    double mean = 0.0;
+    double ci95 = 0.0;
+};
+
+// Result of estimate_tree
+struct TreeEstimate
+{
+    long long probes = 0;
+    long long directories_listed = 0;
+    EstimateStat files;
+    EstimateStat bytes;
+    EstimateStat directories;
+    struct Extension
+    {
+        std::wstring name; // Lower case, empty for files without one
+        EstimateStat files;
+        EstimateStat bytes;
+    };
+    std::vector<Extension> extensions; // Largest estimated bytes first
+};
+
+// Nanoseconds on the steady clock, for the per-worker counters
+inline long long now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Counters kept by each worker without synchronisation and published to
+// ScanContext::worker_counters when it exits. Times are in nanoseconds.
+struct WorkerCounters
+{
+    long long directories = 0;    // Directories finished
+    long long entries = 0;        // Directory entries seen, matching or not
+    long long files = 0;          // Rows or entries emitted
+    long long bytes = 0;          // Output bytes formatted
+    long long enumerate_ns = 0;   // Directory opens and listing calls
+    long long queue_wait_ns = 0;  // Contended acquisitions of q_m
+    long long output_wait_ns = 0; // Contended acquisitions of out_m and query output locks
+    long long flush_ns = 0;       // Inside flush_buffer / flush_query_buffer, waits included
+    long long idle_ns = 0;        // Waiting for work: empty queue, parked, or no completions
+    long long wall_ns = 0;        // Lifetime of the worker thread
+};
+
+// HDR-style latency histogram: values below 2^LATENCY_SUB_BITS ns get their own
+// bucket, and every power of two above that is split into 32 linear buckets,
+// so a bucket's bounds are within about 3% of each other. Values from 2^36 ns
+// (about 69 s) up share the last bucket; max_ns stays exact. Only the owning
+// worker records, with relaxed stores, so other threads can read it at any time.
+static const int LATENCY_SUB_BITS = 6;
+static const int LATENCY_HALF_SUB = 1 << (LATENCY_SUB_BITS - 1);
+static const int LATENCY_MAX_BITS = 36;
+static const int LATENCY_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_HALF_SUB;
+
+struct LatencyHistogram
+{
+    std::atomic<long long> counts[LATENCY_BUCKETS]{};
+    std::atomic<long long> sum_ns{0};
+    std::atomic<long long> max_ns{0};
+};
+
+// The calls that are timed. Metadata comes with the listing on every backend,
+// so there is no separate per-file metadata call to time.
+enum LatencyKind
+{
+    LATENCY_OPEN,  // Backend open: FindFirstFileExW or CreateFileW on the directory
+    LATENCY_READ,  // Backend read (FindNextFileW, GetFileInformationByHandleEx), or async batch submit to completion
+    LATENCY_CLOSE, // Backend close: FindClose or CloseHandle
+    LATENCY_KIND_COUNT
+};
+static const char *const LATENCY_KIND_NAMES[LATENCY_KIND_COUNT] = {"open", "read", "close"};
+
+// One worker's histograms, allocated before the workers start
+struct WorkerLatency
+{
+    LatencyHistogram kinds[LATENCY_KIND_COUNT];
+};
+
+// Plain copy of one or more histograms, for percentiles and interval deltas
+struct LatencySummary
+{
+    std::vector<long long> counts = std::vector<long long>(LATENCY_BUCKETS, 0);
+    long long count = 0;
+    long long sum_ns = 0;
+    long long max_ns = 0;
+};
+
+// Time spent on one directory, accumulated while it is listed
+struct DirLatency
+{
+    long long started_ns = 0; // Async backend: when the open was issued
+    long long open_ns = 0;
+    long long read_ns = 0;
+    long long slowest_read_ns = 0;
+    long long reads = 0;
+};
+
+// Work below one top-level directory, summed over every directory in it (--history)
+struct SubtreeCost
+{
+    long long ns = 0;      // Open, read and close time, plus time spent on split chunks
+    long long entries = 0; // Directory entries seen
+    long long dirs = 0;    // Directories listed, the top-level one included
+};
+
+// One entry of the slowest-directories list
+struct SlowDirectory
+{
+    std::wstring dir;
+    long long total_ns = 0;
+    long long open_ns = 0;
+    long long slowest_read_ns = 0;
+    long long reads = 0;
+    long long entries = 0;
+};
+
+// Timeline events for --trace. Counters become Chrome "C" events, events
+// recorded without a duration become instants, and the rest become spans.
+enum TraceKind
+{
+    TRACE_DIRECTORY,   // Listing and processing one directory (find backend)
+    TRACE_OPEN,        // Directory open
+    TRACE_BATCH,       // One async batch processed
+    TRACE_QUEUE_LOCK,  // Contended q_m
+    TRACE_OUTPUT_LOCK, // Contended out_m or query output lock
+    TRACE_FLUSH,       // Output block written
+    TRACE_IDLE,        // Waiting for a directory or for completions
+    TRACE_PARKED,      // Switched off by the thread controller
+    TRACE_HANDOFF,     // Depth-first worker gave directories to the shared queue
+    TRACE_STEAL,       // Depth-first worker took a directory from the shared queue
+    TRACE_CHUNK,       // Entries of a split directory processed by another worker
+    TRACE_CHECKPOINT,  // Checkpoint written by the main thread
+    TRACE_THREADS,     // Counter: enabled worker threads
+    TRACE_PENDING,     // Counter: pending directories
+    TRACE_KIND_COUNT
+};
+static const char *const TRACE_KIND_NAMES[TRACE_KIND_COUNT] = {
+    "directory", "open", "batch", "queue lock", "output lock", "flush", "idle",
+    "parked", "handoff", "steal", "chunk", "checkpoint", "threads enabled", "pending directories"};
+
+struct TraceEvent
+{
+    long long start_ns = 0;
+    long long dur_ns = 0; // -1 for instants and counters
+    long long value = 0;  // Entries, bytes or directories, depending on kind
+    TraceKind kind = TRACE_DIRECTORY;
+    std::wstring path;
+};
+
+// Events kept per thread; once full, the oldest are overwritten
+static const size_t TRACE_RING_EVENTS = 32768;
+
+// Completion-port waits shorter than this are not traced
+static const long long TRACE_MIN_WAIT_NS = 20000;
+
+// One thread's events. Only the owning thread writes; the rings are
+// serialised after every worker has exited.
+struct TraceRing
+{
+    std::vector<TraceEvent> events; // Grows to TRACE_RING_EVENTS, then wraps
+    size_t next = 0;                // Oldest event once the ring has wrapped
+    long long overwritten = 0;
+};
+
+void trace_event(TraceRing *ring, TraceKind kind, long long start_ns, long long dur_ns, long long value,
+                 const std::wstring *path);
+
+// std::unique_lock that charges time spent on a contended mutex to wait_ns,
+// and to the trace when one is given; an uncontended lock costs no clock reads
+struct TimedLock
+{
+    std::unique_lock<std::mutex> lock;
+    TimedLock(std::mutex &m, long long &wait_ns, TraceRing *trace = nullptr, TraceKind kind = TRACE_QUEUE_LOCK)
+        : lock(m, std::try_to_lock)
+    {
+        if (!lock.owns_lock())
+        {
+            long long start = now_ns();
+            lock.lock();
+            long long waited = now_ns() - start;
+            wait_ns += waited;
+            if (trace)
+                trace_event(trace, kind, start, waited, 0, nullptr);
+        }
+    }
+};
+
+// Token bucket shared by all workers (--max-iops, --max-dirs-per-sec). Callers
+// take tokens up front and sleep off any deficit, so waiters are served in
+// arrival order and no thread spins.
+struct TokenBucket
+{
+    double rate = 0.0;     // Tokens per second, 0 = unlimited
+    double capacity = 0.0; // Burst size
+    double tokens = 0.0;
+    std::chrono::steady_clock::time_point last;
+    std::mutex m;
+};
+
+// Holds all scanning context shared across threads
+struct ScanContext
+{
+    std::wstring ROOT_DIR;
+    std::wstring PREFIX = L"";
+    size_t OUTPUT_BLOCK_BYTES = 1024 * 1024;         // Per-thread output block (--buffer, in KB)
+    size_t OUTPUT_MEMORY_LIMIT_BYTES = 256u << 20;   // Total in-flight output across threads (--output-memory, in MB)
+    std::string OUTPUT_FILE = "file_list.csv";
+    std::vector<std::wstring> file_types;
+    std::vector<Column> columns;
+    int MIN_THREADS = 1;  // Lower bound for the adaptive controller (--min-threads)
+    int MAX_THREADS = 0;  // Upper bound, 0 = 16x hardware threads (--max-threads)
+    int FIXED_THREADS = 0; // Disables the controller when set (--threads)
+    bool ASYNC_IO = false;  // Enumerate through an I/O completion port (--io-backend=async)
+    int QUEUE_DEPTH = 256;  // Directories kept in flight by the async backend (--queue-depth)
+    bool INODE_ORDER = false; // Handle each directory's entries in file ID order (--inode-order)
+    bool SIMULATED_IO = false; // Enumerate a generated in-memory tree (--io-backend=simulated)
+    int SIM_DEPTH = 4;         // Simulated tree shape (--sim-tree=depth,fanout,files)
+    int SIM_FANOUT = 8;
+    int SIM_FILES = 20;
+    double SIM_OPEN_MS = 1.0;  // Median simulated call latencies (--sim-latency=open,read,close)
+    double SIM_READ_MS = 1.0;
+    double SIM_CLOSE_MS = 0.2;
+    double SIM_JITTER = 0.5;   // Sigma of the lognormal latency factor (--sim-jitter)
+    bool SORTED = false;      // Write output sorted by path via sorted runs and a merge (--sorted)
+    std::string SORT_TEMP_DIR; // Where sorted runs are spilled, default next to the output (--sort-temp)
+    bool DEPTH_FIRST = false;  // Workers descend through a local LIFO first (--traversal=dfs)
+    long long MAX_PENDING = 0; // In-memory pending directories before spilling to disk, 0 = no cap (--max-pending)
+    long long SPLIT_ENTRIES = 16384; // Entries into one listing before idle workers share it, 0 = never (--split-entries)
+    int SHARD_INDEX = 0;             // This process's share of the tree, 0..SHARD_COUNT-1 (--shard=i/N)
+    int SHARD_COUNT = 1;
+    int SHARD_DEPTH = 1;             // Level whose directories are hashed to shards, 1 or 2 (--shard-depth)
+    int COORDINATOR_PORT = 0;        // Hand out the tree to worker processes instead of scanning (--coordinator)
+    std::string CONNECT_ADDRESS;     // Scan what the coordinator at host:port hands out (--connect)
+    std::unique_ptr<ClusterNode> cluster;
+    int CHECKPOINT_SECONDS = 0; // Journal progress to <output>.checkpoint this often, 0 = off (--checkpoint)
+    bool RESUME = false;        // Continue an interrupted scan from its checkpoint (--resume)
+    long long LIMIT = 0;        // Stop after this many results, 0 = no limit (--limit)
+    double MAX_IOPS = 0.0;            // Directory opens and listing reads per second, 0 = unlimited (--max-iops)
+    double MAX_DIRS_PER_SEC = 0.0;    // Directories started per second, 0 = unlimited (--max-dirs-per-sec)
+    double TIME_BUDGET_SECONDS = 0.0; // Stop and leave a resumable checkpoint after this long (--time-budget)
+    long long ESTIMATE_PROBES = 0;    // Random root-to-leaf probes instead of a full scan (--estimate)
+
+    std::mutex q_m;
+    std::condition_variable q_cv;
+    std::queue<std::wstring> dir_queue;
+    std::atomic<int> active_dir_count{0};
+    std::atomic<bool> done{false};
+    CancellationToken cancel_token; // Once cancelled, queued directories are dropped without being enumerated
+
+    // Pending-directory frontier: dir_queue plus every worker's local stack.
+    // Directories past MAX_PENDING go to an on-disk FIFO (guarded by q_m).
+    std::atomic<long long> pending_dirs{0};
+    std::atomic<int> idle_workers{0};
+    long long peak_pending = 0;
+    FILE *spill_fp = nullptr;
+    long long spill_read_off = 0;
+    long long spill_write_off = 0;
+    std::atomic<long long> spilled_dirs{0};
+    long long spill_total = 0;
+
+    // Chunks of huge directories waiting for an idle worker (guarded by q_m).
+    // Each counts in active_dir_count until it has been processed.
+    std::deque<std::unique_ptr<EntryChunk>> entry_chunks;
+    std::atomic<long long> chunks_shared{0};
+    std::atomic<long long> split_directories{0};
+
+    // Worker threads with an index at or above this limit stay parked
+    std::mutex park_m;
+    std::condition_variable park_cv;
+    std::atomic<int> active_thread_limit{0};
+    int peak_thread_limit = 0;
+    int started_threads = 0; // Threads created so far, see start_workers
+
+    // Enumeration counters sampled by the thread controller
+    std::atomic<long long> dir_done_count{0};
+    std::atomic<long long> entry_count{0};
+    std::atomic<long long> open_count{0};
+    std::atomic<long long> open_ns{0};
+
+    std::shared_ptr<DirectoryBackend> backend; // Synchronous enumeration, see create_directory_backend
+    HANDLE io_port = NULL;
+    std::atomic<int> async_inflight{0};
+
+    std::mutex out_m;
+    FILE *out_fp = nullptr;
+    std::atomic<size_t> output_block_bytes{0}; // OUTPUT_BLOCK_BYTES cut to the started threads' share
+    std::atomic<long long> output_flush_count{0};
+    std::atomic<long long> output_bytes_written{0};
+
+    // Sorted runs spilled by workers in --sorted mode, merged at the end
+    std::mutex run_m;
+    std::vector<std::string> run_files;
+    std::atomic<int> next_run_id{0};
+    std::atomic<bool> sort_failed{false};
+
+    // Checkpoint journal. journal_committed collects records for directories
+    // whose rows have been written to out_fp; it is guarded by out_m.
+    FILE *journal_fp = nullptr;
+    std::string journal_committed;
+    std::atomic<long long> staged_bytes{0};     // Rows of unfinished directories held in memory
+    std::atomic<int> next_stage_id{0};
+    std::atomic<long long> staged_spill_count{0}; // Directories whose rows went through a temp file
+    std::unordered_set<std::wstring> resume_done; // Finished before the crash but not yet linked to a parent
+    long long checkpoint_count = 0;
+    std::atomic<long long> checkpoint_epoch{0}; // Bumped shortly before a checkpoint so workers flush
+
+    // Multi-query mode (--queries). The filters of all queries are compiled
+    // into one extension -> query mask table so each file is classified once.
+    std::string QUERIES_FILE;
+    std::vector<std::unique_ptr<Query>> queries;
+    std::unordered_map<std::wstring, uint64_t> ext_query_mask; // Lower-case extension -> queries listing it
+    uint64_t any_ext_query_mask = 0;                          // Queries without a filetypes filter
+
+    // Library mode: matching files go to entry_sink in batches of
+    // SINK_BATCH_ENTRIES instead of being formatted as CSV
+    std::function<void(ScanBatch &)> entry_sink;
+    size_t SINK_BATCH_ENTRIES = 1024;
+
+    std::atomic<long long> file_count{0};
+    std::atomic<long long> results_claimed{0}; // Result slots handed out under --limit
+    std::atomic<bool> limit_reached{false};    // The last --limit slot was taken
+
+    // Load limits
+    TokenBucket iops_bucket;
+    TokenBucket dirs_bucket;
+    std::atomic<long long> throttle_ns{0}; // Time workers spent waiting for tokens
+    std::atomic<bool> budget_expired{false};
+
+    // One slot per worker thread, filled in as each worker exits (--report)
+    std::vector<WorkerCounters> worker_counters;
+    std::string REPORT_FILE;
+
+    // Latency histograms, live for the whole run, and each worker's slowest
+    // directories, filled in as it exits
+    std::vector<std::unique_ptr<WorkerLatency>> worker_latency;
+    std::vector<std::vector<SlowDirectory>> worker_slowest;
+    int SLOWEST_DIRS = 5;                  // Directories kept in the slowest list (--slowest-dirs)
+
+    // Subtree costs: those recorded by an earlier scan, keyed by top-level
+    // directory name, and each worker's costs from this scan, filled in as it
+    // exits
+    std::string HISTORY_FILE; // Read before and rewritten after a complete scan (--history)
+    std::unordered_map<std::wstring, SubtreeCost> history;
+    std::vector<std::unordered_map<std::wstring, SubtreeCost>> worker_subtree_costs;
+    long long history_known = 0; // Seeded directories that had a recorded cost
+    double LATENCY_INTERVAL_SECONDS = 0.0; // Print interval percentiles to stderr (--latency-interval)
+
+    // Live progress, sampled by the main thread from the counters above
+    double PROGRESS_SECONDS = 0.0; // Report interval, 0 = off (--progress, --metrics-file)
+    bool PROGRESS_STDERR = false;  // One line per interval on stderr (--progress)
+    std::string METRICS_FILE;      // Prometheus text, replaced every interval (--metrics-file)
+    std::atomic<long long> file_bytes{0}; // Sizes of matching files, added once per directory
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    // Per-thread event rings for --trace: one per worker plus one for the
+    // main thread at the end. Empty when tracing is off.
+    std::string TRACE_FILE;
+    std::vector<std::unique_ptr<TraceRing>> traces;
+};
+
+// Counter values at the previous progress report, for per-second rates
+struct ProgressSample
+{
+    std::chrono::steady_clock::time_point time;
+    long long files = 0;
+    long long file_bytes = 0;
+    long long directories = 0;
+};
+
+static const int HARDWARE_THREADS = std::max(1u, std::thread::hardware_concurrency());
+
+// Smallest per-thread output block; --output-memory must hold one per thread and query
+static const size_t MIN_OUTPUT_BLOCK_BYTES = 4096;
+
+// Buffer for one handle-based listing batch (FILE_ID_BOTH_DIR_INFO records)
+static const ULONG ASYNC_BATCH_BYTES = 64 * 1024;
+
+// Rows of one directory held back until it completes (--checkpoint). Once
+// they reach an output block, or all staged rows together reach half of
+// --output-memory, they continue in a temp file, so a huge directory does not
+// keep its whole listing in memory.
+struct StagedRows
+{
+    std::string rows; // Newest rows, written after those in the spill file
+    FILE *spill = nullptr;
+    std::string spill_path;
+    bool spill_failed = false; // Temp file unavailable: keep the rows in memory
+};
+
+// Per-thread state handed through the processing functions
+struct WorkerState
+{
+    int index = 0;
+    std::string out_buf;                 // Local output block, see append_output
+    std::deque<std::wstring> local_dirs; // Depth-first stack, shallowest directory at the front
+
+    // With --checkpoint, a directory's rows and journal records are staged
+    // here (or in its AsyncDirRequest) until it completes
+    StagedRows dir_rows;
+    std::string dir_journal;
+    StagedRows *stage_rows = nullptr;
+    std::string *stage_journal = nullptr;
+    std::string journal_ready; // Records for directories whose rows are already in out_buf
+    long long flushed_epoch = 0;
+
+    // Multi-query mode: one output block per query, and the queries whose
+    // prefix admits the directory being processed
+    std::vector<std::string> query_bufs;
+    uint64_t dir_mask = 0;
+
+    ScanBatch batch; // Library mode: entries waiting for entry_sink
+
+    // --split-entries: the chunk being filled from the current listing, and
+    // one taken from ctx.entry_chunks by next_directory
+    std::unique_ptr<EntryChunk> chunk;
+    std::unique_ptr<EntryChunk> taken_chunk;
+
+    // --shard-depth=2 while a top-level directory is being listed: its files
+    // belong to the shard owning it, its subdirectories are hashed one by one
+    bool shard_skip_files = false;
+    bool shard_filter_dirs = false;
+
+    WorkerCounters counters;
+    WorkerLatency *latency = nullptr;
+    DirLatency dir_latency;             // Directory being listed by a synchronous backend
+    std::vector<SlowDirectory> slowest; // Min-heap on total_ns, at most SLOWEST_DIRS long
+    std::unordered_map<std::wstring, SubtreeCost> subtree_costs; // Only filled with --history
+    std::wstring subtree_key;
+    long long unpublished_bytes = 0;    // Matching file sizes not yet added to ctx.file_bytes
+    TraceRing *trace = nullptr;         // Only set with --trace
+};
+
+// With --max-iops, FindNextFileW entries charged as one listing read
+static const long long IOPS_ENTRIES_PER_READ = 256;
+
+// Directories read back from the spill file per refill
+static const long long SPILL_REFILL_BATCH = 4096;
+
+// One directory in flight on the async backend. ov must stay the first member:
+// the completion port returns its address and CONTAINING_RECORD recovers this.
+struct AsyncDirRequest
+{
+    OVERLAPPED ov;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    std::wstring dir;
+    long long entries = 0;
+    std::unique_ptr<unsigned char[]> buffer;
+    HeldEntries held; // Only used with --inode-order
+    StagedRows staged_rows;     // Only used with --checkpoint
+    std::string staged_journal; // Only used with --checkpoint
+    uint64_t query_mask = 0;    // Only used with --queries
+    DirLatency latency;
+    long long submitted_ns = 0; // When the outstanding read was issued
+};
+
+// Sequential reader over one sorted run file. Records are framed as
+// [u32 key_len][u32 line_len][line], where the key is the line's path field.
+struct RunReader
+{
+    FILE *fp = nullptr;
+    std::string line;
+    uint32_t key_len = 0;
+};
+
+// Maximum number of runs merged at once; more runs are merged in several passes
+static const size_t MERGE_FAN_IN = 64;
+
+// Hill-climbing state for the adaptive worker count
+struct ThreadController
+{
+    std::chrono::steady_clock::time_point last_sample;
+    long long last_entries = 0;
+    long long last_opens = 0;
+    long long last_open_ns = 0;
+    double last_throughput = 0.0;
+    double last_latency_us = 0.0;
+    int direction = 1;
+};
+
+//----------------------------------------------------------
+// Function Declarations
+//----------------------------------------------------------
+void split_extensions(std::wstring extensions, std::vector<std::wstring> &out);
+bool load_queries(ScanContext &ctx);
+void compile_query_matcher(ScanContext &ctx);
+uint64_t directory_query_mask(const ScanContext &ctx, const std::wstring &dir);
+uint64_t match_queries(const ScanContext &ctx, uint64_t dir_mask, const wchar_t *name, size_t name_len);
+bool open_query_outputs(ScanContext &ctx);
+bool top_level_matches(const ScanContext &ctx, const wchar_t *name);
+bool shard_owns(const ScanContext &ctx, const std::wstring &path);
+void enter_shard_directory(const ScanContext &ctx, WorkerState &ws, const std::wstring &dir);
+bool send_frame(SOCKET sock, char type, const std::string &payload);
+bool recv_frame(SOCKET sock, char &type, std::string &payload);
+void append_cluster_dir(std::string &payload, const std::wstring &relative);
+bool parse_cluster_dirs(const std::string &payload, std::vector<std::wstring> &dirs);
+std::string cluster_hello();
+bool connect_to_coordinator(ScanContext &ctx);
+void cluster_reader(ScanContext &ctx);
+bool cluster_tick(ScanContext &ctx);
+void finish_cluster_worker(ScanContext &ctx);
+bool run_coordinator(ScanContext &ctx);
+bool initialize_directory_queue(ScanContext &ctx);
+bool normalize_thread_settings(ScanContext &ctx);
+void set_thread_limit(ScanContext &ctx, int limit);
+void adjust_thread_count(ScanContext &ctx, ThreadController &tc);
+std::string spill_path(const ScanContext &ctx);
+bool spill_directory(ScanContext &ctx, const std::wstring &dir);
+void refill_from_spill(ScanContext &ctx);
+void share_with_idle_workers(ScanContext &ctx, WorkerState &ws, size_t keep);
+void push_directory(ScanContext &ctx, WorkerState &ws, std::wstring dir);
+bool try_next_directory(ScanContext &ctx, WorkerState &ws, std::wstring &dir);
+bool next_directory(ScanContext &ctx, WorkerState &ws, std::wstring &dir);
+void share_local_directories(ScanContext &ctx, WorkerState &ws);
+void size_output_buffers(ScanContext &ctx, int thread_count);
+void fit_output_block(ScanContext &ctx, std::string &buffer);
+void flush_buffer(ScanContext &ctx, WorkerState &ws);
+void append_output(ScanContext &ctx, WorkerState &ws, const char *data, size_t len);
+void flush_query_buffer(Query &q, std::string &buffer, WorkerState &ws);
+void append_query_outputs(ScanContext &ctx, WorkerState &ws, uint64_t mask, const std::string &record);
+void flush_worker_buffers(ScanContext &ctx, WorkerState &ws);
+void add_batch_entry(ScanContext &ctx, WorkerState &ws, const std::wstring &full_path, size_t name_len,
+                     const DirEntry &entry);
+void publish_batch(ScanContext &ctx, WorkerState &ws);
+void bind_batch_paths(ScanBatch &batch);
+std::string default_temp_prefix();
+size_t output_memory_for_blocks(const ScanContext &ctx);
+void stage_row(ScanContext &ctx, StagedRows &staged, const std::string &record);
+void spill_staged_rows(ScanContext &ctx, StagedRows &staged);
+void discard_staged_rows(ScanContext &ctx, StagedRows &staged);
+void commit_spilled_directory(ScanContext &ctx, WorkerState &ws, StagedRows &staged, std::string &journal);
+void finish_directory(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, StagedRows &rows,
+                      std::string &journal);
+void drop_directory(ScanContext &ctx);
+void abandon_directory(ScanContext &ctx, StagedRows &rows, std::string &journal);
+void drain_cancelled_queue(ScanContext &ctx);
+bool claim_result(ScanContext &ctx);
+void init_token_bucket(TokenBucket &bucket, double rate);
+void throttle(ScanContext &ctx, TokenBucket &bucket, double tokens);
+void flush_for_checkpoint(ScanContext &ctx, WorkerState &ws);
+std::string checkpoint_path(const ScanContext &ctx);
+void append_journal_record(std::string &out, char type, const void *data, uint32_t len);
+void append_journal_path(std::string &out, char type, const std::wstring &path);
+bool open_checkpoint(ScanContext &ctx);
+void write_checkpoint(ScanContext &ctx);
+bool load_checkpoint(ScanContext &ctx);
+bool load_history(ScanContext &ctx);
+void order_by_history(ScanContext &ctx);
+void charge_subtree(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, long long ns, long long entries, long long dirs);
+std::unordered_map<std::wstring, SubtreeCost> subtree_costs(const ScanContext &ctx);
+bool save_history(const ScanContext &ctx);
+int compare_path_keys(const char *a, uint32_t a_len, const char *b, uint32_t b_len);
+int compare_records(const char *a_line, uint32_t a_key, uint32_t a_len, const char *b_line, uint32_t b_key,
+                    uint32_t b_len);
+std::string make_run_path(ScanContext &ctx);
+void spill_sorted_run(ScanContext &ctx, std::string &buffer);
+bool read_run_record(RunReader &r);
+bool merge_runs(const std::vector<std::string> &inputs, FILE *out, bool framed);
+bool merge_sorted_runs(ScanContext &ctx);
+void format_modified(unsigned long long filetime, std::string &out);
+void format_attributes(DWORD attributes, std::string &out);
+void join_path(const std::wstring &dir, const wchar_t *name, size_t name_len, std::wstring &out);
+bool prefix_matches(const ScanContext &ctx, const std::wstring &path);
+bool extension_matches(const ScanContext &ctx, const wchar_t *name, size_t name_len);
+bool utf16_to_utf8(const wchar_t *text, size_t len, std::string &out);
+void append_csv_field(const std::string &field, std::string &out);
+void format_record(const ScanContext &ctx, const std::string &utf8_path, const DirEntry &entry, std::string &record);
+std::string csv_header(const ScanContext &ctx);
+void process_entry(ScanContext &ctx, const std::wstring &dir, const DirEntry &entry, WorkerState &ws);
+DirEntry make_dir_entry(const FILE_ID_BOTH_DIR_INFO *info);
+void hold_entry(HeldEntries &held, const DirEntry &entry);
+void handle_held_entries(ScanContext &ctx, const std::wstring &dir, HeldEntries &held, WorkerState &ws);
+void process_held_entries(ScanContext &ctx, const std::wstring &dir, HeldEntries &held, WorkerState &ws);
+void add_to_chunk(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, const DirEntry &entry);
+void share_chunk(ScanContext &ctx, WorkerState &ws);
+void process_entry_chunk(ScanContext &ctx, WorkerState &ws, EntryChunk &chunk);
+void process_taken_chunk(ScanContext &ctx, WorkerState &ws);
+bool win32_stat(const std::wstring &path, DirEntry &out);
+uint64_t hash_path(const std::wstring &path);
+void simulated_wait(long long ns);
+void create_directory_backend(ScanContext &ctx);
+void process_directory(ScanContext &ctx, const std::wstring &dir, WorkerState &ws);
+void process_directory_listing(ScanContext &ctx, const std::wstring &dir, WorkerState &ws);
+bool load_async_backend();
+bool submit_directory_read(AsyncDirRequest *req, bool restart);
+void finish_async_directory(ScanContext &ctx, WorkerState &ws, AsyncDirRequest *req);
+void open_async_directory(ScanContext &ctx, WorkerState &ws, std::wstring dir);
+void complete_directory_read(ScanContext &ctx, AsyncDirRequest *req, DWORD bytes, WorkerState &ws);
+void async_directory_worker(ScanContext &ctx, int index);
+void directory_processing_worker(ScanContext &ctx, int index);
+void start_workers(ScanContext &ctx, std::vector<std::thread> &threads, int count);
+void run_workers(ScanContext &ctx);
+WorkerCounters total_worker_counters(const ScanContext &ctx);
+void append_json_string(const std::string &text, std::string &out);
+void append_counters_json(const WorkerCounters &c, std::string &out);
+bool write_run_report(const ScanContext &ctx, const std::string &path, double seconds);
+int latency_bucket(long long ns);
+long long latency_bucket_upper(int bucket);
+void record_latency(WorkerState &ws, LatencyKind kind, long long ns);
+void record_read_latency(WorkerState &ws, DirLatency &d, long long ns);
+void note_directory_latency(ScanContext &ctx, WorkerState &ws, const std::wstring &dir, const DirLatency &d,
+                            long long total_ns, long long entries);
+LatencySummary collect_latency(const ScanContext &ctx, LatencyKind kind);
+LatencySummary latency_delta(const LatencySummary &now, const LatencySummary &before);
+long long latency_percentile(const LatencySummary &s, double fraction);
+std::string format_ns(long long ns);
+std::string format_latency(const LatencySummary &s);
+std::vector<SlowDirectory> slowest_directories(const ScanContext &ctx);
+void append_latency_json(const LatencySummary &s, std::string &out);
+std::string format_progress_metrics(ScanContext &ctx, const ProgressSample &last, const ProgressSample &now, bool running);
+void report_progress(ScanContext &ctx, ProgressSample &last, bool running);
+TraceRing *main_trace(ScanContext &ctx);
+bool write_trace(const ScanContext &ctx, const std::string &path);
+std::string to_utf8(const std::wstring &text);
+bool file_type_matches(const ScanContext &ctx, const std::wstring &ext);
+bool list_sampled_directory(const ScanContext &ctx, const std::wstring &dir, SampledDirectory &out);
+TreeEstimate estimate_tree(ScanContext &ctx);
+
+#endif // LANDRYS_SCANNER_INTERNAL_H
@@ -0,0 +1,278 @@
+#include <windows.h>
+#include <io.h>
+#include <direct.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <unordered_set>
+
+//----------------------------------------------------------
+// Synthetic directory tree generator
+//
+// Builds a reproducible tree for benchmarking landrys-file-scanner: DEPTH
+// levels below the root, FANOUT subdirectories per directory and FILES files
+// in every directory except the root. The same --seed always produces the
+// same names, so runs on different machines scan identical trees.
+//----------------------------------------------------------
+
+struct TreeSpec
+{
+    std::wstring ROOT_DIR;
+    int DEPTH = 4;
+    int FANOUT = 8;
+    int FILES = 20;
+    int NAME_LENGTH_MIN = 8;
+    int NAME_LENGTH_MAX = 24;
+    double UNICODE_RATIO = 0.1; // Share of names that contain non-ASCII characters
+    long long FILE_SIZE = 0;    // Bytes per file; extended with _chsize_s, not written
+    unsigned long long SEED = 1;
+    std::vector<std::wstring> extensions = {L"txt", L"doc", L"docx", L"pdf", L"xlsx", L"jpg", L"png", L"zip", L"log", L""};
+
+    std::mt19937_64 rng;
+    long long dir_count = 0;
+    long long file_count = 0;
+    long long failures = 0;
+};
+
+void print_help();
+bool parse_arguments(int argc, char *argv[], TreeSpec &spec);
+std::wstring random_name(TreeSpec &spec);
+bool create_file(TreeSpec &spec, const std::wstring &path);
+void generate_directory(TreeSpec &spec, const std::wstring &dir, int depth);
+
+// Lower-case letters only, so no two names differ just by case on a
+// case-insensitive volume
+static const wchar_t ASCII_CHARS[] = L"abcdefghijklmnopqrstuvwxyz0123456789_-";
+static const wchar_t UNICODE_CHARS[] = L"àéîöüñçø"  // Latin-1
+                                       L"αβγδλπσω"  // Greek
+                                       L"абвджящы"  // Cyrillic
+                                       L"一中文件目录数据"  // CJK
+                                       L"あいうかカキクケ"; // Kana
+
+void print_help()
+{
+    std::cout << "Usage: tree-generator --path=<root_path> [--depth=<n>] [--fanout=<n>] [--files=<n>] "
+                 "[--name-length=<min>-<max>] [--unicode=<ratio>] [--file-size=<bytes>] [--seed=<n>] "
+                 "[--extensions=<list>]\n\n"
+                 "Options:\n"
+                 "  --path       Directory to create the tree in (required, created if missing).\n"
+                 "  --depth      Levels of subdirectories below the root (default: 4).\n"
+                 "  --fanout     Subdirectories per directory (default: 8).\n"
+                 "  --files      Files per directory; the root itself gets none (default: 20).\n"
+                 "  --name-length\n"
+                 "               Range of name lengths in characters, drawn uniformly (default: 8-24).\n"
+                 "  --unicode    Share of names with non-ASCII characters, 0 to 1 (default: 0.1).\n"
+                 "               About one name in eight of those also gets a surrogate pair.\n"
+                 "  --file-size  Size of every file in bytes (default: 0).\n"
+                 "  --seed       Random seed; the same seed gives the same tree (default: 1).\n"
+                 "  --extensions Comma-separated extensions to pick from; an empty item gives files\n"
+                 "               without one (default: txt,doc,docx,pdf,xlsx,jpg,png,zip,log,).\n"
+                 "  --help       Display this help message.\n";
+}
+
+bool parse_arguments(int argc, char *argv[], TreeSpec &spec)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.find("--path=") == 0)
+        {
+            spec.ROOT_DIR = std::wstring(arg.begin() + 7, arg.end());
+        }
+        else if (arg.find("--depth=") == 0)
+        {
+            spec.DEPTH = std::stoi(arg.substr(8));
+        }
+        else if (arg.find("--fanout=") == 0)
+        {
+            spec.FANOUT = std::stoi(arg.substr(9));
+        }
+        else if (arg.find("--files=") == 0)
+        {
+            spec.FILES = std::stoi(arg.substr(8));
+        }
+        else if (arg.find("--name-length=") == 0)
+        {
+            std::string range = arg.substr(14);
+            size_t dash = range.find('-');
+            spec.NAME_LENGTH_MIN = std::stoi(range.substr(0, dash));
+            spec.NAME_LENGTH_MAX = dash == std::string::npos ? spec.NAME_LENGTH_MIN : std::stoi(range.substr(dash + 1));
+        }
+        else if (arg.find("--unicode=") == 0)
+        {
+            spec.UNICODE_RATIO = std::stod(arg.substr(10));
+        }
+        else if (arg.find("--file-size=") == 0)
+        {
+            spec.FILE_SIZE = std::stoll(arg.substr(12));
+        }
+        else if (arg.find("--seed=") == 0)
+        {
+            spec.SEED = std::stoull(arg.substr(7));
+        }
+        else if (arg.find("--extensions=") == 0)
+        {
+            spec.extensions.clear();
+            std::wstring list(arg.begin() + 13, arg.end());
+            size_t start = 0;
+            for (;;)
+            {
+                size_t comma = list.find(L',', start);
+                spec.extensions.push_back(list.substr(start, comma - start));
+                if (comma == std::wstring::npos)
+                    break;
+                start = comma + 1;
+            }
+        }
+        else if (arg == "--help")
+        {
+            print_help();
+            return false;
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << arg << "\n\n";
+            print_help();
+            return false;
+        }
+    }
+
+    if (spec.ROOT_DIR.empty())
+    {
+        std::cerr << "Error: --path is required.\n\n";
+        print_help();
+        return false;
+    }
+    if (spec.DEPTH < 0 || spec.FANOUT < 0 || spec.FILES < 0 || spec.NAME_LENGTH_MIN < 1 || spec.NAME_LENGTH_MAX < spec.NAME_LENGTH_MIN ||
+        spec.NAME_LENGTH_MAX > 200 || spec.UNICODE_RATIO < 0 || spec.UNICODE_RATIO > 1 || spec.FILE_SIZE < 0)
+    {
+        std::cerr << "Error: invalid tree shape.\n\n";
+        print_help();
+        return false;
+    }
+    return true;
+}
+
+// A name of NAME_LENGTH_MIN..NAME_LENGTH_MAX UTF-16 code units. Unicode names swap about a
+// third of their characters for non-ASCII ones, and some get a surrogate pair
+// (U+1F4C1) so that 4-byte UTF-8 output is exercised too.
+std::wstring random_name(TreeSpec &spec)
+{
+    std::uniform_int_distribution<int> length(spec.NAME_LENGTH_MIN, spec.NAME_LENGTH_MAX);
+    std::uniform_int_distribution<size_t> ascii(0, wcslen(ASCII_CHARS) - 1);
+    std::uniform_int_distribution<size_t> unicode(0, wcslen(UNICODE_CHARS) - 1);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    int len = length(spec.rng);
+    bool is_unicode = chance(spec.rng) < spec.UNICODE_RATIO;
+    std::wstring name;
+    name.reserve(len);
+    if (is_unicode && len >= 3 && chance(spec.rng) < 0.125)
+    {
+        name += L"\U0001F4C1";
+    }
+    while ((int)name.size() < len)
+    {
+        if (is_unicode && chance(spec.rng) < 0.33)
+            name += UNICODE_CHARS[unicode(spec.rng)];
+        else
+            name += ASCII_CHARS[ascii(spec.rng)];
+    }
+    // A leading '-' would read like an option on command lines
+    if (name[0] == L'-')
+        name[0] = L'_';
+    return name;
+}
+
+bool create_file(TreeSpec &spec, const std::wstring &path)
+{
+    FILE *fp = _wfopen(path.c_str(), L"wb");
+    if (!fp)
+        return false;
+    bool ok = spec.FILE_SIZE == 0 || _chsize_s(_fileno(fp), spec.FILE_SIZE) == 0;
+    return fclose(fp) == 0 && ok;
+}
+
+// Creates dir's files and subdirectories, depth-first
+void generate_directory(TreeSpec &spec, const std::wstring &dir, int depth)
+{
+    std::uniform_int_distribution<size_t> pick_ext(0, spec.extensions.size() - 1);
+    std::unordered_set<std::wstring> used;
+
+    if (depth > 0)
+    {
+        for (int i = 0; i < spec.FILES; i++)
+        {
+            std::wstring name;
+            do
+            {
+                name = random_name(spec);
+                const std::wstring &ext = spec.extensions[pick_ext(spec.rng)];
+                if (!ext.empty())
+                    name += L"." + ext;
+            } while (!used.insert(name).second);
+
+            if (create_file(spec, dir + L"\\" + name))
+                spec.file_count++;
+            else
+                spec.failures++;
+        }
+    }
+
+    if (depth == spec.DEPTH)
+        return;
+    for (int i = 0; i < spec.FANOUT; i++)
+    {
+        std::wstring name;
+        do
+        {
+            name = random_name(spec);
+        } while (!used.insert(name).second);
+
+        std::wstring sub = dir + L"\\" + name;
+        if (_wmkdir(sub.c_str()) != 0)
+        {
+            spec.failures++;
+            continue;
+        }
+        spec.dir_count++;
+        generate_directory(spec, sub, depth + 1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    TreeSpec spec;
+    if (!parse_arguments(argc, argv, spec))
+    {
+        return 1;
+    }
+    spec.rng.seed(spec.SEED);
+
+    long long planned_dirs = 0;
+    long long level = 1;
+    for (int d = 1; d <= spec.DEPTH; d++)
+    {
+        level *= spec.FANOUT;
+        planned_dirs += level;
+    }
+    std::cout << "Generating " << planned_dirs << " directories and " << planned_dirs * spec.FILES << " files\n";
+
+    auto start_time = std::chrono::steady_clock::now();
+    _wmkdir(spec.ROOT_DIR.c_str());
+    generate_directory(spec, spec.ROOT_DIR, 0);
+    double elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    std::cout << "Created " << spec.dir_count << " directories and " << spec.file_count << " files ("
+              << spec.file_count * spec.FILE_SIZE << " bytes) in " << elapsed_seconds << " seconds\n";
+    if (spec.failures > 0)
+    {
+        std::cerr << spec.failures << " files or directories could not be created.\n";
+        return 1;
+    }
+    return 0;
+}